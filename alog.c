@@ -0,0 +1,440 @@
+/*
+ * alog.c - asynchronous access log (see alog.h)
+ *
+ * Each logging thread is given one of ALOG_RINGS rings the first time it
+ * logs. A ring is a bounded multi-producer queue of slots with sequence
+ * numbers: a producer claims a slot with one compare-and-swap on head,
+ * fills it, and publishes it by storing the slot's sequence number; the
+ * drainer, the only consumer, takes slots in order and hands them back
+ * by advancing their sequence numbers a lap.
+ *
+ * The drainer sorts each record into the log buffer, the capture buffer
+ * or both by its flags; neither output is formatted on the request path.
+ */
+#include "csapp.h"
+#include "alog.h"
+#include <time.h>
+#include <ctype.h>
+
+#define ALOG_RINGS     8
+#define ALOG_RING_RECS 512          /* Slots per ring, a power of two */
+#define ALOG_OUT_SIZE  65536        /* Drainer's output buffers, each written with one write() */
+#define ALOG_IDLE_NS   10000000L    /* Drainer sleep when every ring is empty */
+
+typedef struct {
+    long seq;                       /* Slot is free for the producer of pos seq, full for the drainer at seq - 1 */
+    alog_rec rec;
+} alog_slot;
+
+typedef struct {
+    long head __attribute__((aligned(64)));     /* Next position to claim (producers) */
+    long sampled, dropped;
+    long tail __attribute__((aligned(64)));     /* Next position to drain (drainer) */
+    alog_slot slots[ALOG_RING_RECS];
+} alog_ring;
+
+int alog_level = ALOG_INFO;
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+} alog_out;
+
+static alog_ring *rings;            /* NULL until alog_init */
+static int alog_sample = 1, alog_binary;
+static alog_out log_out, capture_out = { -1 };
+static int next_ring;
+static __thread int my_ring = -1;
+
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+/* Take the next record of r in order, or return 0 if it is not there yet */
+static int alog_pop(alog_ring *r, alog_rec *rec)
+{
+    alog_slot *s = &r->slots[r->tail & (ALOG_RING_RECS - 1)];
+
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != r->tail + 1)
+        return 0;
+    *rec = s->rec;
+    __atomic_store_n(&s->seq, r->tail + ALOG_RING_RECS, __ATOMIC_RELEASE);
+    r->tail++;
+    return 1;
+}
+
+/* Write all of o's buffer, giving up on an error other than EINTR */
+static void alog_flush(alog_out *o)
+{
+    char *buf = o->buf;
+    ssize_t n;
+
+    while (o->len > 0) {
+        if ((n = write(o->fd, buf, o->len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        buf += n;
+        o->len -= n;
+    }
+    o->len = 0;
+}
+
+/* Append rec to the outputs its flags name */
+static void alog_append(const alog_rec *rec)
+{
+    char *whole = rec->capture_text;
+    alog_rec cut;
+    size_t need;
+
+    if (rec->flags & ALOG_F_LOG) {
+        if (ALOG_OUT_SIZE - log_out.len < ALOG_LINE_MAX)
+            alog_flush(&log_out);
+        if (alog_binary) {
+            memcpy(log_out.buf + log_out.len, rec, sizeof(alog_rec));
+            ((alog_rec *)(log_out.buf + log_out.len))->capture_text = NULL;
+            log_out.len += sizeof(alog_rec);
+        } else
+            log_out.len += alog_format(rec, log_out.buf + log_out.len, ALOG_OUT_SIZE - log_out.len);
+    }
+    if (rec->flags & ALOG_F_CAPTURE) {
+        /* Every byte of the whole text may be escaped to 6 */
+        need = ALOG_LINE_MAX + (whole != NULL ? 6 * strlen(whole) + 2 : 0);
+        if (need > ALOG_OUT_SIZE) {                 /* Too long for even an empty buffer: captured cut */
+            cut = *rec;
+            cut.capture_text = NULL;
+            rec = &cut;
+            need = ALOG_LINE_MAX;
+        }
+        if (ALOG_OUT_SIZE - capture_out.len < need)
+            alog_flush(&capture_out);
+        capture_out.len += alog_format_json(rec, capture_out.buf + capture_out.len, ALOG_OUT_SIZE - capture_out.len);
+    }
+    free(whole);
+}
+
+static void *alog_thread(void *vargp)
+{
+    struct timespec idle = { 0, ALOG_IDLE_NS }, now;
+    alog_rec rec;
+    long reported = 0, dropped;
+    int i, k, n;
+
+    Pthread_detach(pthread_self());
+    if (alog_binary) {
+        memcpy(log_out.buf, ALOG_MAGIC, 8);
+        log_out.len = 8;
+    }
+    while (1) {
+        n = 0;
+        for (i = 0; i < ALOG_RINGS; i++) {
+            /* At most a lap per ring, so one busy ring cannot hold up the others */
+            for (k = 0; k < ALOG_RING_RECS && alog_pop(&rings[i], &rec); k++)
+                alog_append(&rec);
+            n += k;
+        }
+        if ((dropped = alog_dropped()) != reported) {
+            memset(&rec, 0, sizeof(rec));
+            clock_gettime(CLOCK_REALTIME, &now);
+            rec.time = now.tv_sec * 1000000000L + now.tv_nsec;
+            rec.conn = -1;
+            rec.level = ALOG_WARN;
+            rec.event = ALOG_EV_MSG;
+            rec.flags = ALOG_F_LOG;
+            rec.text_len = snprintf(rec.text, ALOG_TEXT, "log rings full, %ld records dropped", dropped - reported);
+            alog_append(&rec);
+            reported = dropped;
+        }
+        if (log_out.len > 0)
+            alog_flush(&log_out);
+        if (capture_out.len > 0)
+            alog_flush(&capture_out);
+        if (n == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * alog_init - Allocate the rings and start the drainer, which writes the
+ *     log to fd and transactions to capture_fd (none if -1). Only every
+ *     sample-th INFO record is logged.
+ */
+void alog_init(int level, int sample, int binary, int fd, int capture_fd)
+{
+    pthread_t tid;
+    alog_ring *r;
+    int i, k;
+
+    r = Malloc(ALOG_RINGS * sizeof(alog_ring));
+    for (i = 0; i < ALOG_RINGS; i++) {
+        r[i].head = r[i].tail = r[i].sampled = r[i].dropped = 0;
+        for (k = 0; k < ALOG_RING_RECS; k++)
+            r[i].slots[k].seq = k;
+    }
+    alog_level = level;
+    alog_sample = sample > 1 ? sample : 1;
+    alog_binary = binary;
+    log_out.fd = fd;
+    log_out.buf = Malloc(ALOG_OUT_SIZE);
+    capture_out.fd = capture_fd;
+    if (capture_fd >= 0)
+        capture_out.buf = Malloc(ALOG_OUT_SIZE);
+    rings = r;
+    Pthread_create(&tid, NULL, alog_thread, NULL);
+}
+
+/*
+ * alog_start - Claim a slot for a record, or return NULL if the record
+ *     would be neither logged nor captured, or its ring is full. The
+ *     caller fills in the fields it has (everything else is zero) and
+ *     hands it over with alog_commit.
+ */
+alog_rec *alog_start(int level, int event, int capture)
+{
+    struct timespec ts;
+    alog_ring *r;
+    alog_slot *s;
+    long pos, seq;
+    int flags = 0;
+
+    if (rings == NULL)
+        return NULL;
+    if (capture && capture_out.fd >= 0)
+        flags |= ALOG_F_CAPTURE;
+    if (level > alog_level && !flags)
+        return NULL;
+    if (my_ring < 0)
+        my_ring = __atomic_fetch_add(&next_ring, 1, __ATOMIC_RELAXED) % ALOG_RINGS;
+    r = &rings[my_ring];
+    if (level <= alog_level && (level != ALOG_INFO || alog_sample == 1
+                                || __atomic_fetch_add(&r->sampled, 1, __ATOMIC_RELAXED) % alog_sample == 0))
+        flags |= ALOG_F_LOG;
+    if (!flags)
+        return NULL;
+
+    pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    while (1) {
+        s = &r->slots[pos & (ALOG_RING_RECS - 1)];
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {                           /* Free: claim it */
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (seq < pos) {                     /* Still holds the record of the previous lap */
+            __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else                                      /* Another producer claimed it */
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    }
+
+    memset(&s->rec, 0, offsetof(alog_rec, text));
+    clock_gettime(CLOCK_REALTIME, &ts);
+    s->rec.time = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    s->rec.conn = -1;
+    s->rec.level = level;
+    s->rec.event = event;
+    s->rec.flags = flags;
+    return &s->rec;
+}
+
+/* Copy text into r, cut to ALOG_TEXT - 1 bytes (whole for the capture); NULL means none */
+void alog_text(alog_rec *r, const char *text)
+{
+    size_t len = text != NULL ? strnlen(text, ALOG_TEXT) : 0;
+
+    if (len == ALOG_TEXT) {
+        len--;
+        r->flags |= ALOG_F_CUT;
+        if (r->flags & ALOG_F_CAPTURE)
+            r->capture_text = strdup(text);         /* NULL if out of memory: captured cut */
+    }
+    if (len > 0)
+        memcpy(r->text, text, len);
+    r->text[len] = '\0';
+    r->text_len = len;
+}
+
+/* Publish a record from alog_start to the drainer */
+void alog_commit(alog_rec *r)
+{
+    alog_slot *s = (alog_slot *)((char *)r - offsetof(alog_slot, rec));
+
+    /* The slot's sequence number is still the position it was claimed at */
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+void alog_write(int level, int event, long conn, int status,
+                long bytes_in, long bytes_out, long latency, const char *text)
+{
+    alog_rec *r;
+
+    if (level > alog_level || (r = alog_start(level, event, 0)) == NULL)
+        return;
+    r->conn = conn;
+    r->status = status;
+    r->bytes_in = bytes_in;
+    r->bytes_out = bytes_out;
+    r->latency = latency;
+    alog_text(r, text);
+    alog_commit(r);
+}
+
+void alog_msg(int level, const char *msg)
+{
+    alog_write(level, ALOG_EV_MSG, -1, 0, 0, 0, 0, msg);
+}
+
+/*
+ * alog_format - Format r as one text line into buf (at least
+ *     ALOG_LINE_MAX bytes). Returns the length, without the NUL.
+ */
+size_t alog_format(const alog_rec *r, char *buf, size_t size)
+{
+    struct tm tm;
+    time_t sec = r->time / 1000000000L;
+    const char *level = r->level < 4 ? level_names[r->level] : "?";
+    size_t n;
+    int len = r->text_len < ALOG_TEXT ? r->text_len : ALOG_TEXT - 1;
+
+    gmtime_r(&sec, &tm);
+    n = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    n += snprintf(buf + n, size - n, ".%06ldZ %s ", r->time % 1000000000L / 1000, level);
+    switch (r->event) {
+    case ALOG_EV_ACCEPT:
+        n += snprintf(buf + n, size - n, "accept conn=%ld client=%.*s\n", r->conn, len, r->text);
+        break;
+    case ALOG_EV_HIT:
+    case ALOG_EV_MISS:
+        n += snprintf(buf + n, size - n, "%s conn=%ld status=%d bytes=%ld time_us=%ld uri=%.*s\n",
+                      r->event == ALOG_EV_HIT ? "hit" : "miss", r->conn, r->status, r->bytes_out,
+                      r->latency / 1000, len, r->text);
+        break;
+    case ALOG_EV_ERROR:
+        n += snprintf(buf + n, size - n, "error conn=%ld status=%d uri=%.*s\n", r->conn, r->status, len, r->text);
+        break;
+    case ALOG_EV_TIMEOUT:
+        n += snprintf(buf + n, size - n, "timeout %.*s\n", len, r->text);
+        break;
+    case ALOG_EV_TUNNEL:
+        n += snprintf(buf + n, size - n, "tunnel conn=%ld up=%ld down=%ld host=%.*s\n",
+                      r->conn, r->bytes_in, r->bytes_out, len, r->text);
+        break;
+    default:
+        n += snprintf(buf + n, size - n, "%.*s\n", len, r->text);
+    }
+    return n < size ? n : size - 1;
+}
+
+/* Write text[0, len) into buf as the inside of a JSON string; buf has room for 6 bytes per byte */
+static size_t json_escape(char *buf, const char *text, int len)
+{
+    size_t n = 0;
+    int i;
+    unsigned char ch;
+
+    for (i = 0; i < len; i++) {
+        ch = text[i];
+        if (ch == '"' || ch == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = ch;
+        } else if (ch < 0x20 || ch == 0x7f)
+            n += sprintf(buf + n, "\\u%04x", ch);
+        else
+            buf[n++] = ch;
+    }
+    return n;
+}
+
+/*
+ * uri_normalize - Lower-case the scheme and host of an absolute http uri,
+ *     drop a default :80 port and give it at least the path "/", so the
+ *     same object is always spelled the same way. Other uris (CONNECT
+ *     host:port, origin-form paths) are copied as they are. out has room
+ *     for len + 2 bytes.
+ */
+static int uri_normalize(const char *uri, int len, char *out)
+{
+    int i, n, host, port = -1;
+
+    if (len < 7 || strncasecmp(uri, "http://", 7)) {
+        memcpy(out, uri, len);
+        return len;
+    }
+    memcpy(out, "http://", 7);
+    for (i = n = host = 7; i < len && uri[i] != '/'; i++) {
+        if (uri[i] == ':')
+            port = i;
+        out[n++] = tolower((unsigned char)uri[i]);
+    }
+    if (port >= 0 && i - port == 3 && uri[port + 1] == '8' && uri[port + 2] == '0')
+        n -= 3;
+    if (i == len)
+        out[n++] = '/';
+    memcpy(out + n, uri + i, len - i);
+    return n + len - i;
+}
+
+/*
+ * alog_format_json - Format a transaction as one JSON line into buf (at
+ *     least ALOG_LINE_MAX bytes, and 6 more per byte of capture_text).
+ *     Phase times are in us; phases the transaction did not go through
+ *     are 0. Returns the length.
+ */
+size_t alog_format_json(const alog_rec *r, char *buf, size_t size)
+{
+    char short_uri[ALOG_TEXT + 2], *uri = short_uri;
+    const char *text = r->text, *cache;
+    size_t n;
+    int len = r->text_len < ALOG_TEXT ? r->text_len : ALOG_TEXT - 1;
+
+    if (r->capture_text != NULL) {
+        text = r->capture_text;
+        len = strlen(text);
+        uri = Malloc(len + 2);
+    }
+
+    switch (r->event) {
+    case ALOG_EV_HIT:    cache = "hit"; break;
+    case ALOG_EV_MISS:                              /* Methods the cache never stores pass through */
+        cache = strcmp(r->method, "GET") && strcmp(r->method, "HEAD") ? "pass" : "miss";
+        break;
+    case ALOG_EV_ERROR:  cache = "error"; break;
+    case ALOG_EV_TUNNEL: cache = "tunnel"; break;
+    default:             cache = "none";
+    }
+    n = snprintf(buf, size, "{\"ts\":%ld.%06ld,\"conn\":%ld,\"method\":\"",
+                 r->time / 1000000000L, r->time % 1000000000L / 1000, r->conn);
+    n += json_escape(buf + n, r->method, strnlen(r->method, sizeof(r->method)));
+    n += snprintf(buf + n, size - n, "\",\"uri\":\"");
+    n += json_escape(buf + n, uri, uri_normalize(text, len, uri));
+    n += snprintf(buf + n, size - n, "\",%s\"status\":%d,\"bytes\":%ld,\"cache\":\"%s\","
+                  "\"parse_us\":%d,\"lookup_us\":%d,\"connect_us\":%d,\"first_byte_us\":%d,"
+                  "\"transfer_us\":%d,\"total_us\":%ld}\n",
+                  text == r->text && r->flags & ALOG_F_CUT ? "\"uri_cut\":true," : "", r->status, r->bytes_out, cache,
+                  r->phase[ALOG_PH_PARSE], r->phase[ALOG_PH_LOOKUP], r->phase[ALOG_PH_CONNECT],
+                  r->phase[ALOG_PH_FIRST_BYTE], r->phase[ALOG_PH_TRANSFER], r->latency / 1000);
+    if (uri != short_uri)
+        free(uri);
+    return n < size ? n : size - 1;
+}
+
+int alog_parse_level(const char *name)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+        if (!strcasecmp(name, level_names[i]))
+            return i;
+    return -1;
+}
+
+/* Records dropped so far because a ring was full */
+long alog_dropped(void)
+{
+    long n = 0;
+    int i;
+
+    for (i = 0; rings != NULL && i < ALOG_RINGS; i++)
+        n += __atomic_load_n(&rings[i].dropped, __ATOMIC_RELAXED);
+    return n;
+}
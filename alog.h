@@ -0,0 +1,93 @@
+/*
+ * alog.h - asynchronous access log
+ *
+ * Threads that log only fill in a fixed-size record and put it in a
+ * lock-free ring; a background thread drains the rings and hands the
+ * output to the kernel in large batched write()s. Nothing on the
+ * logging path formats text, takes a lock or can block on a slow log
+ * file or pipe: when a ring is full the record is dropped and counted.
+ *
+ * Records below the configured level are not built at all, and INFO
+ * records (one per request) can be sampled 1 in n. The drainer either
+ * formats records as text lines or, in binary mode, writes them as they
+ * are after an ALOG_MAGIC header; alog_format() turns those back into
+ * the same text (see bench/logcat.c).
+ *
+ * Records started with capture set are also written, whatever the level
+ * and sampling, as JSON lines to a separate capture file when one is
+ * open: one line per transaction, for replay (bench/replay.c) and for
+ * offline cache studies. The capture needs the whole uri, so a captured
+ * record whose text is too long for it also carries a malloc'd copy of
+ * all of it; only such records allocate, and only the log text is cut.
+ */
+#ifndef __ALOG_H__
+#define __ALOG_H__
+
+#include <stddef.h>
+
+/* Levels */
+#define ALOG_ERROR 0
+#define ALOG_WARN  1
+#define ALOG_INFO  2                /* One record per request; sampled */
+#define ALOG_DEBUG 3
+
+/* Events; text holds what is in brackets */
+#define ALOG_EV_MSG    0            /* Message [message] */
+#define ALOG_EV_ACCEPT 1            /* Connection accepted [client host:port] */
+#define ALOG_EV_HIT    2            /* Response sent from the cache [uri] */
+#define ALOG_EV_MISS   3            /* Response relayed from the end server [uri] */
+#define ALOG_EV_ERROR  4            /* Error response sent by the proxy [uri] */
+#define ALOG_EV_TUNNEL 5            /* CONNECT tunnel closed [host:port] */
+#define ALOG_EV_TIMEOUT 6           /* Socket shut down by a deadline [what it was waiting for] */
+
+/* Phases of a transaction, phase[] in us */
+#define ALOG_PH_PARSE      0
+#define ALOG_PH_LOOKUP     1
+#define ALOG_PH_CONNECT    2
+#define ALOG_PH_FIRST_BYTE 3
+#define ALOG_PH_TRANSFER   4
+#define ALOG_PHASES        5
+
+/* flags */
+#define ALOG_F_LOG     1            /* Goes to the log */
+#define ALOG_F_CAPTURE 2            /* Goes to the capture file */
+#define ALOG_F_CUT     4            /* text was cut short (whole in capture_text, if set) */
+
+#define ALOG_TEXT 172               /* Longer text is cut short */
+#define ALOG_LINE_MAX 1536          /* Longest record formatted as text or JSON */
+#define ALOG_MAGIC "ALOG0003"       /* First 8 bytes of a binary log, then alog_rec's */
+
+typedef struct {
+    long time;                      /* CLOCK_REALTIME ns */
+    long conn;                      /* Connection number, -1 if none */
+    long bytes_in, bytes_out;       /* Bytes from and to the client */
+    long latency;                   /* ns */
+    int phase[ALOG_PHASES];         /* Transactions only */
+    unsigned char level, event, flags, reserved;
+    unsigned short status;
+    char method[8];                 /* Transactions only */
+    char *capture_text;             /* Whole text of a cut captured record, freed by the drainer; NULL in a binary log */
+    unsigned short text_len;
+    char text[ALOG_TEXT];
+} alog_rec;
+
+extern int alog_level;              /* Records above this level are skipped */
+
+void alog_init(int level, int sample, int binary, int fd, int capture_fd);
+alog_rec *alog_start(int level, int event, int capture);
+void alog_text(alog_rec *r, const char *text);
+void alog_commit(alog_rec *r);
+void alog_write(int level, int event, long conn, int status,
+                long bytes_in, long bytes_out, long latency, const char *text);
+void alog_msg(int level, const char *msg);
+size_t alog_format(const alog_rec *r, char *buf, size_t size);
+size_t alog_format_json(const alog_rec *r, char *buf, size_t size);
+int alog_parse_level(const char *name);     /* -1 if unknown */
+long alog_dropped(void);
+
+static inline int alog_enabled(int level)
+{
+    return level <= alog_level;
+}
+
+#endif /* __ALOG_H__ */
@@ -0,0 +1,216 @@
+/*
+ * cache-bench.c - throughput and lock contention of the proxy's cache
+ *     (../cache.c, built with -DCACHE_LOCK_STATS), without any network.
+ *
+ * Each thread runs operations on keys drawn uniformly or from a Zipf
+ * distribution (rank r is picked with probability proportional to
+ * 1/r^s). A read is a cache_get, filling the cache with cache_uri on a
+ * miss as the proxy does after fetching. A write is a cache_invalidate
+ * followed by a cache_uri, as when a POST changes the object and the
+ * next GET fetches it again. Every key has a fixed object size, picked
+ * once from the -s range.
+ *
+ * For each thread count the run reports operations per second, the hit
+ * ratio of reads, and how often and how long lock acquisitions waited.
+ *
+ * usage: cache-bench [-t <threads,...>] [-d <seconds>] [-k <keys>]
+ *                    [-D uniform|zipf] [-z <zipf exponent>]
+ *                    [-s <size>|<min>-<max>] [-r <read percent>]
+ */
+#include "csapp.h"
+#include "cache.h"
+#include <time.h>
+#include <math.h>
+
+#define NS_PER_SEC 1000000000L
+#define MAX_THREADS 256
+
+typedef struct {
+    int id;
+    long end;                       /* CLOCK_MONOTONIC ns */
+    unsigned rng;
+    long reads, hits, writes;
+    long acquires, waits, wait_ns;
+} bench_thread;
+
+/* Options */
+static int duration = 2, nkeys = 100, read_pct = 90, zipf = 0;
+static double zipf_s = 0.99;
+static int size_min = 512, size_max = 16384;
+
+static char **keys;
+static int *sizes;
+static double *cdf;                 /* Zipf: cdf[i] = P(rank <= i) */
+static char *payload;
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static unsigned xorshift(unsigned *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+static int pick_key(unsigned *rng)
+{
+    double u;
+    int lo = 0, hi = nkeys - 1, mid;
+
+    if (!zipf)
+        return xorshift(rng) % nkeys;
+    u = xorshift(rng) / 4294967296.0;
+    while (lo < hi) {                               /* First rank with cdf >= u */
+        mid = (lo + hi) / 2;
+        if (cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void *bench_thread_run(void *vargp)
+{
+    bench_thread *t = vargp;
+    cache_obj *obj;
+    int k;
+
+    while (1) {
+        if ((t->reads + t->writes) % 64 == 0 && now_ns() >= t->end)
+            break;
+        k = pick_key(&t->rng);
+        if ((int)(xorshift(&t->rng) % 100) < read_pct) {
+            t->reads++;
+            if ((obj = cache_get(keys[k])) != NULL) {
+                t->hits++;
+                cache_obj_release(obj);
+            } else
+                cache_uri(keys[k], payload, sizes[k], 0, 0);
+        } else {
+            t->writes++;
+            cache_invalidate(keys[k]);
+            cache_uri(keys[k], payload, sizes[k], 0, 0);
+        }
+    }
+    t->acquires = cache_lock_acquires;
+    t->waits = cache_lock_waits;
+    t->wait_ns = cache_lock_wait_ns;
+    return NULL;
+}
+
+static void run(int nthreads)
+{
+    bench_thread *t = Calloc(nthreads, sizeof(bench_thread));
+    pthread_t *tids = Malloc(nthreads * sizeof(pthread_t));
+    long start, reads = 0, hits = 0, writes = 0, acquires = 0, waits = 0, wait_ns = 0, ops;
+    double secs;
+    int i;
+
+    cache_init();
+    start = now_ns();
+    for (i = 0; i < nthreads; i++) {
+        t[i].id = i;
+        t[i].end = start + (long)duration * NS_PER_SEC;
+        t[i].rng = 2463534242u + 7919 * i;
+        Pthread_create(&tids[i], NULL, bench_thread_run, &t[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        Pthread_join(tids[i], NULL);
+        reads += t[i].reads;
+        hits += t[i].hits;
+        writes += t[i].writes;
+        acquires += t[i].acquires;
+        waits += t[i].waits;
+        wait_ns += t[i].wait_ns;
+    }
+    secs = (now_ns() - start) / 1e9;
+    ops = reads + writes;
+
+    printf("%3d threads  %10.0f ops/s  hit ratio %5.1f%%  lock waits %5.2f%% of %ld acquisitions, "
+           "%.1f ms total, %.0f ns per op\n",
+           nthreads, ops / secs, reads ? 100.0 * hits / reads : 0.0,
+           acquires ? 100.0 * waits / acquires : 0.0, acquires, wait_ns / 1e6,
+           ops ? (double)wait_ns / ops : 0.0);
+    fflush(stdout);
+
+    for (i = 0; i < TOTAL_CACHE_BLOCK_NUM; i++)     /* Empty the cache for the next run */
+        if (!cache.blocks[i].is_empty)
+            cache_obj_release(cache.blocks[i].cache_object);
+    Free(t);
+    Free(tids);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-t <threads,...>] [-d <seconds>] [-k <keys>] [-D uniform|zipf] "
+            "[-z <zipf exponent>] [-s <size>|<min>-<max>] [-r <read percent>]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char threads[MAXLINE] = "1,2,4,8", *tok, *save;
+    int opt, i, n;
+    double sum;
+    unsigned h;
+
+    while ((opt = getopt(argc, argv, "t:d:k:D:z:s:r:")) != -1) {
+        switch (opt) {
+        case 't': snprintf(threads, sizeof(threads), "%s", optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'k': nkeys = atoi(optarg); break;
+        case 'D':
+            if (!strcmp(optarg, "zipf"))
+                zipf = 1;
+            else if (strcmp(optarg, "uniform"))
+                usage(argv[0]);
+            break;
+        case 'z': zipf_s = atof(optarg); break;
+        case 's':
+            if (sscanf(optarg, "%d-%d", &size_min, &size_max) == 1)
+                size_max = size_min;
+            break;
+        case 'r': read_pct = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || duration < 1 || nkeys < 1 || size_min < 1 || size_max < size_min
+        || read_pct < 0 || read_pct > 100)
+        usage(argv[0]);
+
+    keys = Malloc(nkeys * sizeof(char *));
+    sizes = Malloc(nkeys * sizeof(int));
+    for (i = 0; i < nkeys; i++) {
+        keys[i] = Malloc(64);
+        sprintf(keys[i], "http://bench.example:80/object/%d", i);
+        h = 2654435761u * (i + 1);                  /* Size is fixed per key */
+        sizes[i] = size_min + (h >> 8) % (size_max - size_min + 1);
+    }
+    if (zipf) {
+        cdf = Malloc(nkeys * sizeof(double));
+        for (i = 0, sum = 0; i < nkeys; i++)
+            cdf[i] = sum += 1.0 / pow(i + 1, zipf_s);
+        for (i = 0; i < nkeys; i++)
+            cdf[i] /= sum;
+    }
+    payload = Malloc(size_max);
+    memset(payload, 'x', size_max);
+
+    printf("%d blocks, %d keys (%s", TOTAL_CACHE_BLOCK_NUM, nkeys, zipf ? "zipf" : "uniform");
+    if (zipf)
+        printf(" s=%.2f", zipf_s);
+    printf("), objects %d-%d bytes, %d%% reads, %d s per run\n", size_min, size_max, read_pct, duration);
+    for (tok = strtok_r(threads, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if ((n = atoi(tok)) < 1 || n > MAX_THREADS)
+            usage(argv[0]);
+        run(n);
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * httpc.c - minimal blocking HTTP/1.1 client shared by the bench tools
+ */
+#include "csapp.h"
+#include "http_parse.h"
+#include "httpc.h"
+
+/*
+ * httpc_fetch - Send one request with an empty body on fd and read the
+ *     whole response into buf (size bytes at a time). Returns 0, or -1 if
+ *     the connection failed or the response was malformed or cut short.
+ */
+int httpc_fetch(int fd, const char *method, const char *uri, const char *host, int close_conn,
+                char *buf, size_t size, httpc_result *res)
+{
+    char req[MAXLINE];
+    http_response resp;
+    http_chunked chunked;
+    const http_header_view *h;
+    const char *p;
+    long length = 0, n;
+    int len, have = 0, rc, framing, head = !strcmp(method, "HEAD");
+
+    res->keep = 0;
+    len = snprintf(req, sizeof(req), "%s %s HTTP/1.1\r\nHost: %s\r\n%s%s\r\n", method, uri, host,
+                   strcmp(method, "POST") && strcmp(method, "PUT") ? "" : "Content-Length: 0\r\n",
+                   close_conn ? "Connection: close\r\n" : "");
+    if (len >= (int)sizeof(req) || rio_writen(fd, req, len) < 0)
+        return -1;
+
+    http_response_init(&resp);
+    while ((rc = http_parse_response(&resp, buf, have)) == HTTP_PARSE_AGAIN) {
+        if (have == (int)size || (n = read(fd, buf + have, size - have)) <= 0)
+            return -1;
+        have += n;
+    }
+    if (rc != HTTP_PARSE_DONE || (framing = http_response_framing(buf, &resp, head, &length)) < 0)
+        return -1;
+    res->status = resp.status;
+    if ((h = http_find_header_id(resp.headers, resp.nheaders, HTTP_HDR_CONNECTION)) != NULL)
+        res->keep = http_header_has_token(buf, h->value, "keep-alive");
+    else
+        res->keep = http_view_eq(buf, resp.version, "HTTP/1.1");
+    if (framing == HTTP_BODY_CLOSE)
+        res->keep = 0;
+
+    res->bytes = have;
+    p = buf + resp.end;                             /* Body bytes that came with the header */
+    n = have - resp.end;
+    if (framing == HTTP_BODY_CHUNKED)
+        http_chunked_init(&chunked);
+    while (framing != HTTP_BODY_NONE) {
+        if (framing == HTTP_BODY_LENGTH && (length -= n) <= 0)
+            break;
+        if (framing == HTTP_BODY_CHUNKED && n > 0) {
+            if (http_chunked_scan(&chunked, p, n) < 0)
+                return -1;
+            if (chunked.done)
+                break;
+        }
+        if ((n = read(fd, buf, size)) < 0)
+            return -1;
+        if (n == 0) {
+            if (framing == HTTP_BODY_CLOSE)
+                break;
+            return -1;                              /* Cut short */
+        }
+        p = buf;
+        res->bytes += n;
+    }
+    return 0;
+}
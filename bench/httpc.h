@@ -0,0 +1,18 @@
+/*
+ * httpc.h - minimal blocking HTTP/1.1 client shared by the bench tools
+ */
+#ifndef __HTTPC_H__
+#define __HTTPC_H__
+
+#include <stddef.h>
+
+typedef struct {
+    int status;
+    int keep;                       /* The connection can take the next request */
+    long bytes;                     /* Response bytes received, header included */
+} httpc_result;
+
+int httpc_fetch(int fd, const char *method, const char *uri, const char *host, int close_conn,
+                char *buf, size_t size, httpc_result *res);
+
+#endif /* __HTTPC_H__ */
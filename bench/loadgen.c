@@ -0,0 +1,259 @@
+/*
+ * loadgen.c - load generator and latency benchmark for the proxy, with
+ *     tiny as the origin.
+ *
+ * Each of the -c connections is driven by a thread of its own. In
+ * closed-loop mode (the default) a connection sends its next request as
+ * soon as the previous response has been read, so the offered load is
+ * whatever the proxy can take. With -r the load is open-loop: requests
+ * are due at a fixed total rate spread over the connections, and latency
+ * is measured from when a request was due rather than when it went out,
+ * so a stall shows up in the percentiles instead of quietly lowering the
+ * load (coordinated omission).
+ *
+ * Hits cycle over tiny's static files, fetched once before timing so
+ * they are in the proxy's cache. Misses ask cgi-bin/adder with arguments
+ * no earlier request used. Latencies go into a per-thread HDR histogram
+ * (../hdr_hist.c), merged when the run ends.
+ *
+ * usage: loadgen [-c <connections>] [-d <seconds>] [-r <requests/s>]
+ *                [-w hit|miss|mixed|all] [-m <hit percent>] [-C]
+ *                <proxy host> <proxy port> <tiny host:port>
+ *     -w all (the default) runs the hit, miss and mixed workloads in turn.
+ *     -m sets the share of hits in the mixed workload (default 50).
+ *     -C opens a new connection for every request instead of keep-alive.
+ */
+#include "csapp.h"
+#include "hdr_hist.h"
+#include "httpc.h"
+#include <time.h>
+
+#define RESP_BUF_SIZE 65536         /* Per connection receive buffer */
+#define NS_PER_SEC 1000000000L
+
+static const char *hit_paths[] = {
+    "/home.html", "/godzilla.gif", "/godzilla.jpg", "/adder.html",
+};
+#define NHIT (int)(sizeof(hit_paths) / sizeof(hit_paths[0]))
+
+typedef struct {
+    int id;
+    int hit_pct;                    /* Share of requests that go to hit_paths */
+    long start, end;                /* Run window, CLOCK_MONOTONIC ns */
+    unsigned rng;
+    long requests, bytes, errors;
+    hdr_hist hist;                  /* Latency in ns */
+    char buf[RESP_BUF_SIZE];
+} conn_state;
+
+/* Options */
+static int nconns = 4, duration = 10, close_each = 0;
+static double rate = 0;             /* Requests per second over all connections, 0 = closed loop */
+static char *proxy_host, *proxy_port, *origin;
+
+static long miss_seq;               /* Next unused adder argument */
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_until(long t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / NS_PER_SEC;
+    ts.tv_nsec = t % NS_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static unsigned xorshift(unsigned *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+/*
+ * fetch - GET path on fd. Returns the bytes received, or -1 if the
+ *     connection failed or the status was not 2xx. *keep is set to
+ *     whether fd can be reused.
+ */
+static long fetch(int fd, conn_state *c, const char *path, int *keep)
+{
+    char uri[MAXLINE];
+    httpc_result res;
+
+    snprintf(uri, sizeof(uri), "http://%s%s", origin, path);
+    if (httpc_fetch(fd, "GET", uri, origin, close_each, c->buf, RESP_BUF_SIZE, &res) < 0) {
+        *keep = 0;
+        return -1;
+    }
+    *keep = res.keep;
+    if (res.status < 200 || res.status > 299)
+        return -1;
+    return res.bytes;
+}
+
+static void *conn_thread(void *vargp)
+{
+    conn_state *c = vargp;
+    long interval = 0, due, t0, n;
+    int fd = -1, keep, next_hit = c->id;
+    char path[MAXLINE];
+
+    if (rate > 0) {                                 /* Spread the connections over one interval */
+        interval = (long)(NS_PER_SEC * nconns / rate);
+        due = c->start + interval * c->id / nconns;
+    } else
+        due = c->start;
+
+    while (1) {
+        if (rate > 0) {
+            if (due >= c->end)
+                break;
+            sleep_until(due);
+            t0 = due;                               /* Count the time the request spent waiting to be sent */
+            due += interval;
+        } else if ((t0 = now_ns()) >= c->end)
+            break;
+
+        if ((int)(xorshift(&c->rng) % 100) < c->hit_pct)
+            strcpy(path, hit_paths[next_hit++ % NHIT]);
+        else
+            sprintf(path, "/cgi-bin/adder?first=%ld&second=%d",
+                    __atomic_fetch_add(&miss_seq, 1, __ATOMIC_RELAXED), c->id);
+
+        if (fd < 0 && (fd = open_clientfd(proxy_host, proxy_port)) < 0) {
+            c->errors++;
+            continue;
+        }
+        if ((n = fetch(fd, c, path, &keep)) < 0)
+            c->errors++;
+        else {
+            hdr_record(&c->hist, now_ns() - t0);
+            c->requests++;
+            c->bytes += n;
+        }
+        if (n < 0 || !keep) {
+            Close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+        Close(fd);
+    return NULL;
+}
+
+/* Fetch every hit path once so the timed runs find them cached */
+static void warm_up(void)
+{
+    conn_state *c = Malloc(sizeof(conn_state));
+    int i, fd, keep;
+
+    for (i = 0; i < NHIT; i++) {
+        if ((fd = open_clientfd(proxy_host, proxy_port)) < 0) {
+            fprintf(stderr, "loadgen: cannot connect to the proxy at %s:%s\n", proxy_host, proxy_port);
+            exit(1);
+        }
+        if (fetch(fd, c, hit_paths[i], &keep) < 0)
+            fprintf(stderr, "loadgen: warm-up fetch of %s failed\n", hit_paths[i]);
+        Close(fd);
+    }
+    Free(c);
+}
+
+static void run(const char *name, int hit_pct)
+{
+    conn_state **conns = Malloc(nconns * sizeof(conn_state *));
+    pthread_t *tids = Malloc(nconns * sizeof(pthread_t));
+    hdr_hist *all = Malloc(sizeof(hdr_hist));
+    long start, requests = 0, bytes = 0, errors = 0;
+    double secs;
+    int i;
+
+    hdr_init(all);
+    start = now_ns() + NS_PER_SEC / 10;             /* Let every thread get ready first */
+    for (i = 0; i < nconns; i++) {
+        conns[i] = Malloc(sizeof(conn_state));
+        conns[i]->id = i;
+        conns[i]->hit_pct = hit_pct;
+        conns[i]->start = start;
+        conns[i]->end = start + (long)duration * NS_PER_SEC;
+        conns[i]->rng = 2463534242u + 7919 * i;
+        conns[i]->requests = conns[i]->bytes = conns[i]->errors = 0;
+        hdr_init(&conns[i]->hist);
+        Pthread_create(&tids[i], NULL, conn_thread, conns[i]);
+    }
+    for (i = 0; i < nconns; i++) {
+        Pthread_join(tids[i], NULL);
+        hdr_merge(all, &conns[i]->hist);
+        requests += conns[i]->requests;
+        bytes += conns[i]->bytes;
+        errors += conns[i]->errors;
+        Free(conns[i]);
+    }
+    secs = (now_ns() - start) / 1e9;
+
+    printf("%s (%d%% hits): %d connections, ", name, hit_pct, nconns);
+    if (rate > 0)
+        printf("open loop at %.0f requests/s, ", rate);
+    else
+        printf("closed loop, ");
+    printf("%s, %.1f s\n", close_each ? "connection per request" : "keep-alive", secs);
+    printf("  requests %10ld  %10.1f /s   errors %ld\n", requests, requests / secs, errors);
+    printf("  bytes    %10ld  %10.2f MB/s\n", bytes, bytes / secs / 1e6);
+    printf("  latency (us)  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           hdr_mean(all) / 1e3, hdr_percentile(all, 50) / 1e3, hdr_percentile(all, 90) / 1e3,
+           hdr_percentile(all, 99) / 1e3, hdr_percentile(all, 99.9) / 1e3, all->max / 1e3);
+    fflush(stdout);
+
+    Free(conns);
+    Free(tids);
+    Free(all);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-c <connections>] [-d <seconds>] [-r <requests/s>] "
+            "[-w hit|miss|mixed|all] [-m <hit percent>] [-C] <proxy host> <proxy port> <tiny host:port>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *workload = "all";
+    int opt, mixed_pct = 50;
+
+    while ((opt = getopt(argc, argv, "c:d:r:w:m:C")) != -1) {
+        switch (opt) {
+        case 'c': nconns = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'w': workload = optarg; break;
+        case 'm': mixed_pct = atoi(optarg); break;
+        case 'C': close_each = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3 || nconns < 1 || duration < 1)
+        usage(argv[0]);
+    proxy_host = argv[optind];
+    proxy_port = argv[optind + 1];
+    origin = argv[optind + 2];
+    Signal(SIGPIPE, SIG_IGN);
+    miss_seq = now_ns() / 1000;                     /* Unused by earlier runs against the same proxy */
+
+    warm_up();
+    if (!strcmp(workload, "hit") || !strcmp(workload, "all"))
+        run("hit", 100);
+    if (!strcmp(workload, "miss") || !strcmp(workload, "all"))
+        run("miss", 0);
+    if (!strcmp(workload, "mixed") || !strcmp(workload, "all"))
+        run("mixed", mixed_pct);
+    return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * logcat.c - print a binary access log (proxy -b) as text, in the same
+ *     format the proxy writes without -b.
+ *
+ * usage: logcat [<log file>]
+ *     Reads standard input if no file is given.
+ */
+#include "csapp.h"
+#include "alog.h"
+
+int main(int argc, char **argv)
+{
+    FILE *in = stdin;
+    char magic[8], line[ALOG_LINE_MAX];
+    alog_rec rec;
+    size_t n;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [<log file>]\n", argv[0]);
+        exit(1);
+    }
+    if (argc == 2 && (in = fopen(argv[1], "r")) == NULL) {
+        fprintf(stderr, "logcat: %s: %s\n", argv[1], strerror(errno));
+        exit(1);
+    }
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, ALOG_MAGIC, 8) != 0) {
+        fprintf(stderr, "logcat: not a binary proxy log\n");
+        exit(1);
+    }
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        n = alog_format(&rec, line, sizeof(line));
+        fwrite(line, 1, n, stdout);
+    }
+    return 0;
+}
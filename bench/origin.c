@@ -0,0 +1,543 @@
+/*
+ * origin.c - configurable origin server for proxy benchmarks.
+ *
+ * Stands in for the backends the proxy talks to, so a benchmark can
+ * choose what the origin does instead of measuring tiny. Every
+ * connection gets a thread of its own with a small stack and is kept
+ * alive until the client closes it (or sends Connection: close), so
+ * thousands of slow or idle connections cost little.
+ *
+ * What a response looks like is set by a profile:
+ *     size=<spec>        body bytes
+ *     think=<spec>       ms to wait before the response
+ *     framing=length|chunked|close
+ *                        Content-Length, chunked encoding, or no length
+ *                        and the connection closed after the body
+ *     chunk=<n>          chunk size for framing=chunked (default 8192)
+ *     cache=<value>      Cache-Control header, none if empty
+ *     status=<n>         status of a normal response (default 200)
+ *     error=<percent>    share of requests answered with error_status
+ *     error_status=<n>   (default 500)
+ *     reset=<percent>    share of requests whose connection is reset
+ *     reset_at=start|mid before the response or halfway through the body
+ * A <spec> is <n> (fixed), <min>-<max> (uniform), exp:<mean> or
+ * pareto:<min>:<alpha> (heavy tailed). Sizes are drawn from a hash of
+ * the uri, so an object keeps its size from one request to the next and
+ * a proxy cache sees consistent objects; think time, errors and resets
+ * are drawn afresh for every request.
+ *
+ * The -f config file holds key=value lines, one per line, '#' starting
+ * a comment. Lines before any section set the defaults; a "[/prefix]"
+ * line starts a section whose lines apply to paths beginning with that
+ * prefix, the longest matching prefix winning. Query parameters override
+ * both, e.g. /obj/7?size=exp:20000&think=2-10&cache=max-age%3D60.
+ * Other query parameters are ignored, though they still make a uri of
+ * its own; a request with a bad value gets a 400 naming the key.
+ *
+ * usage: origin [-f <config file>] <port>
+ */
+#include "csapp.h"
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <netinet/tcp.h>
+
+#define CONN_STACK_SIZE (128 * 1024)
+#define OUT_BUF_SIZE 16384          /* Headers and body are gathered into writes this big */
+#define MAX_BODY (64L << 20)        /* Heavy tailed sizes are capped here */
+#define MAX_RULES 64
+#define MAX_CACHE_VALUE 256
+
+/* dist kinds */
+#define DIST_FIXED   0
+#define DIST_UNIFORM 1
+#define DIST_EXP     2
+#define DIST_PARETO  3
+
+/* framing */
+#define FRAME_LENGTH  0
+#define FRAME_CHUNKED 1
+#define FRAME_CLOSE   2
+
+/* reset_at */
+#define RESET_START 0
+#define RESET_MID   1
+
+typedef struct {
+    int kind;
+    double a, b;                    /* fixed: a; uniform: a-b; exp: mean a; pareto: min a, alpha b */
+} dist;
+
+typedef struct {
+    dist size;                      /* Body bytes */
+    dist think;                     /* ms */
+    int framing;
+    int chunk;
+    char cache[MAX_CACHE_VALUE];    /* Cache-Control, "" = none */
+    int status;
+    double error_pct;
+    int error_status;
+    double reset_pct;
+    int reset_at;
+} profile;
+
+typedef struct {
+    char prefix[MAXLINE];
+    profile p;
+} rule;
+
+typedef struct {
+    int fd;
+    unsigned rng;
+    char out[OUT_BUF_SIZE];
+    int out_len;
+} conn;
+
+static rule rules[MAX_RULES];       /* rules[0] has prefix "" and holds the defaults */
+static int nrules = 1;
+
+static char pattern[OUT_BUF_SIZE];  /* Body bytes */
+
+static unsigned xorshift(unsigned *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+/* Uniform in (0, 1] */
+static double uniform(unsigned *rng)
+{
+    return (xorshift(rng) + 1.0) / 4294967296.0;
+}
+
+static double dist_draw(const dist *d, unsigned *rng)
+{
+    switch (d->kind) {
+    case DIST_UNIFORM: return d->a + (d->b - d->a) * uniform(rng);
+    case DIST_EXP:     return -d->a * log(uniform(rng));
+    case DIST_PARETO:  return d->a / pow(uniform(rng), 1 / d->b);
+    default:           return d->a;
+    }
+}
+
+/* <n>, <min>-<max>, exp:<mean> or pareto:<min>:<alpha>; -1 if none of those */
+static int dist_parse(dist *d, const char *s)
+{
+    char end;
+
+    if (sscanf(s, "exp:%lf%c", &d->a, &end) == 1 && d->a >= 0)
+        d->kind = DIST_EXP;
+    else if (sscanf(s, "pareto:%lf:%lf%c", &d->a, &d->b, &end) == 2 && d->a >= 0 && d->b > 0)
+        d->kind = DIST_PARETO;
+    else if (sscanf(s, "%lf-%lf%c", &d->a, &d->b, &end) == 2 && d->a >= 0 && d->b >= d->a)
+        d->kind = DIST_UNIFORM;
+    else if (sscanf(s, "%lf%c", &d->a, &end) == 1 && d->a >= 0)
+        d->kind = DIST_FIXED;
+    else
+        return -1;
+    return 0;
+}
+
+/* Set one profile key; -1 if the value is bad, 1 if there is no such key */
+static int profile_set(profile *p, const char *key, const char *val)
+{
+    char *end;
+    double v;
+
+    if (!strcmp(key, "size"))
+        return dist_parse(&p->size, val);
+    if (!strcmp(key, "think"))
+        return dist_parse(&p->think, val);
+    if (!strcmp(key, "cache")) {
+        if (strlen(val) >= sizeof(p->cache) || strpbrk(val, "\r\n"))
+            return -1;
+        strcpy(p->cache, val);
+        return 0;
+    }
+    if (!strcmp(key, "framing")) {
+        if (!strcmp(val, "length")) p->framing = FRAME_LENGTH;
+        else if (!strcmp(val, "chunked")) p->framing = FRAME_CHUNKED;
+        else if (!strcmp(val, "close")) p->framing = FRAME_CLOSE;
+        else return -1;
+        return 0;
+    }
+    if (!strcmp(key, "reset_at")) {
+        if (!strcmp(val, "start")) p->reset_at = RESET_START;
+        else if (!strcmp(val, "mid")) p->reset_at = RESET_MID;
+        else return -1;
+        return 0;
+    }
+
+    if (strcmp(key, "chunk") && strcmp(key, "status") && strcmp(key, "error")
+        && strcmp(key, "error_status") && strcmp(key, "reset"))
+        return 1;
+    v = strtod(val, &end);
+    if (*val == '\0' || *end != '\0')
+        return -1;
+    if (!strcmp(key, "chunk") && v >= 1 && v <= OUT_BUF_SIZE)
+        p->chunk = v;
+    else if (!strcmp(key, "status") && v >= 100 && v <= 599)
+        p->status = v;
+    else if (!strcmp(key, "error") && v >= 0 && v <= 100)
+        p->error_pct = v;
+    else if (!strcmp(key, "error_status") && v >= 100 && v <= 599)
+        p->error_status = v;
+    else if (!strcmp(key, "reset") && v >= 0 && v <= 100)
+        p->reset_pct = v;
+    else
+        return -1;
+    return 0;
+}
+
+static void config_load(const char *path)
+{
+    FILE *fp;
+    char line[MAXLINE], *key, *val, *p;
+    rule *cur = &rules[0];
+    int lineno = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "origin: %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+        for (key = line; isspace((unsigned char)*key); key++)
+            ;
+        for (p = key + strlen(key); p > key && isspace((unsigned char)p[-1]); p--)
+            ;
+        *p = '\0';
+        if (*key == '\0')
+            continue;
+
+        if (*key == '[' && p[-1] == ']') {                 /* [prefix] starts a section */
+            if (nrules == MAX_RULES) {
+                fprintf(stderr, "origin: %s:%d: more than %d sections\n", path, lineno, MAX_RULES - 1);
+                exit(1);
+            }
+            cur = &rules[nrules++];
+            cur->p = rules[0].p;                            /* Sections start from the defaults so far */
+            snprintf(cur->prefix, sizeof(cur->prefix), "%.*s", (int)(p - key - 2), key + 1);
+            continue;
+        }
+        if ((val = strchr(key, '=')) == NULL) {
+            fprintf(stderr, "origin: %s:%d: expected key=value\n", path, lineno);
+            exit(1);
+        }
+        for (p = val; p > key && isspace((unsigned char)p[-1]); p--)
+            ;
+        *p = '\0';
+        for (val++; isspace((unsigned char)*val); val++)
+            ;
+        if (profile_set(&cur->p, key, val) != 0) {
+            fprintf(stderr, "origin: %s:%d: bad %s\n", path, lineno, key);
+            exit(1);
+        }
+    }
+    fclose(fp);
+}
+
+/* Profile of the longest matching prefix */
+static const profile *profile_find(const char *path)
+{
+    int i, best = 0;
+    size_t len;
+
+    for (i = 1; i < nrules; i++) {
+        len = strlen(rules[i].prefix);
+        if (!strncmp(path, rules[i].prefix, len) && len > strlen(rules[best].prefix))
+            best = i;
+    }
+    return &rules[best].p;
+}
+
+/* Decode %xx and '+' in place */
+static void url_decode(char *s)
+{
+    char *d = s;
+    unsigned ch;
+
+    for (; *s; s++) {
+        if (*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+            sscanf(s + 1, "%2x", &ch);
+            *d++ = ch;
+            s += 2;
+        } else
+            *d++ = *s == '+' ? ' ' : *s;
+    }
+    *d = '\0';
+}
+
+/* Apply the query string to p, skipping other parameters; the first bad value's key is left in bad */
+static int query_apply(profile *p, char *query, char *bad, size_t size)
+{
+    char *tok, *save, *val;
+
+    for (tok = strtok_r(query, "&", &save); tok != NULL; tok = strtok_r(NULL, "&", &save)) {
+        if ((val = strchr(tok, '=')) == NULL)
+            val = "";
+        else
+            *val++ = '\0';
+        url_decode(tok);
+        url_decode(val);
+        if (profile_set(p, tok, val) < 0) {
+            snprintf(bad, size, "%s", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static unsigned uri_hash(const char *s)
+{
+    unsigned h = 2166136261u;                               /* FNV-1a */
+
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h ? h : 1;                                       /* xorshift state must not be 0 */
+}
+
+static int out_flush(conn *c)
+{
+    int n = c->out_len;
+
+    c->out_len = 0;
+    return rio_writen(c->fd, c->out, n) == n ? 0 : -1;
+}
+
+static int out_add(conn *c, const char *data, size_t len)
+{
+    size_t n;
+
+    while (len > 0) {
+        if (c->out_len == OUT_BUF_SIZE && out_flush(c) < 0)
+            return -1;
+        n = OUT_BUF_SIZE - c->out_len < len ? OUT_BUF_SIZE - c->out_len : len;
+        memcpy(c->out + c->out_len, data, n);
+        c->out_len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* len bytes of body, as chunks of at most chunk bytes if chunk > 0 */
+static int out_body(conn *c, long len, int chunk)
+{
+    char line[32];
+    long n;
+
+    while (len > 0) {
+        n = len < (chunk > 0 ? chunk : OUT_BUF_SIZE) ? len : (chunk > 0 ? chunk : OUT_BUF_SIZE);
+        if (chunk > 0) {
+            sprintf(line, "%lx\r\n", n);
+            if (out_add(c, line, strlen(line)) < 0)
+                return -1;
+        }
+        if (out_add(c, pattern, n) < 0 || (chunk > 0 && out_add(c, "\r\n", 2) < 0))
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Close with an RST instead of a FIN */
+static void conn_reset(conn *c)
+{
+    struct linger lg = {1, 0};
+
+    setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+}
+
+static const char *reason(int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default:  return "Status";
+    }
+}
+
+/*
+ * Serve one request; returns 1 to keep the connection, 0 to close it
+ * and -1 if it was reset or failed.
+ */
+static int serve(conn *c, rio_t *rp)
+{
+    char line[MAXLINE], method[16], uri[MAXLINE], version[16], hdr[MAXLINE], bad[MAXLINE];
+    char *query, *path, datebuf[64];
+    profile p;
+    unsigned size_rng;
+    long body_len = 0, size, think_ns, n;
+    int keep, status, chunk, head, reset;
+    struct timespec ts;
+    time_t now;
+    struct tm tm;
+
+    if (rio_readlineb(rp, line, MAXLINE) <= 0)
+        return 0;
+    if (sscanf(line, "%15s %8191s %15s", method, uri, version) != 3)
+        return 0;
+    keep = !strcasecmp(version, "HTTP/1.1");
+    while (1) {                                             /* Headers: only framing matters */
+        if (rio_readlineb(rp, line, MAXLINE) <= 0)
+            return 0;
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n"))
+            break;
+        for (path = line; *path; path++)
+            *path = tolower((unsigned char)*path);
+        if (!strncmp(line, "content-length:", 15))
+            body_len = atol(line + 15);
+        else if (!strncmp(line, "connection:", 11))
+            keep = strstr(line + 11, "close") == NULL && (keep || strstr(line + 11, "keep-alive") != NULL);
+    }
+    for (; body_len > 0; body_len -= n)                     /* Request bodies are discarded */
+        if ((n = rio_readnb(rp, line, body_len < MAXLINE ? body_len : MAXLINE)) <= 0)
+            return 0;
+
+    if (!strncmp(uri, "http://", 7)) {                      /* Absolute form: keep the path */
+        if ((path = strchr(uri + 7, '/')) != NULL)
+            memmove(uri, path, strlen(path) + 1);
+        else
+            strcpy(uri, "/");
+    }
+    size_rng = uri_hash(uri);
+    if ((query = strchr(uri, '?')) != NULL)
+        *query++ = '\0';
+    p = *profile_find(uri);
+    if (query != NULL && query_apply(&p, query, bad, sizeof(bad)) < 0) {
+        snprintf(line, sizeof(line), "bad parameter: %.64s\n", bad);
+        snprintf(hdr, sizeof(hdr), "HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\n"
+                 "Content-Length: %zu\r\n%s\r\n", strlen(line), keep ? "" : "Connection: close\r\n");
+        return out_add(c, hdr, strlen(hdr)) == 0 && out_add(c, line, strlen(line)) == 0
+               && out_flush(c) == 0 ? keep : -1;
+    }
+
+    if ((think_ns = dist_draw(&p.think, &c->rng) * 1e6) > 0) {
+        ts.tv_sec = think_ns / 1000000000L;
+        ts.tv_nsec = think_ns % 1000000000L;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+    reset = uniform(&c->rng) * 100 <= p.reset_pct;
+    if (reset && p.reset_at == RESET_START) {
+        conn_reset(c);
+        return -1;
+    }
+
+    status = uniform(&c->rng) * 100 <= p.error_pct ? p.error_status : p.status;
+    head = !strcasecmp(method, "HEAD");
+    size = dist_draw(&p.size, &size_rng);
+    if (size > MAX_BODY)
+        size = MAX_BODY;
+    if (status == 204 || status == 304)
+        size = 0;
+    if (p.framing == FRAME_CLOSE)
+        keep = 0;
+
+    now = time(NULL);
+    gmtime_r(&now, &tm);
+    strftime(datebuf, sizeof(datebuf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %d %s\r\nServer: origin\r\nDate: %s\r\n"
+                 "Content-Type: application/octet-stream\r\n", status, reason(status), datebuf);
+    if (p.cache[0] != '\0')
+        n += snprintf(hdr + n, sizeof(hdr) - n, "Cache-Control: %s\r\n", p.cache);
+    if (p.framing == FRAME_LENGTH)
+        n += snprintf(hdr + n, sizeof(hdr) - n, "Content-Length: %ld\r\n", size);
+    else if (p.framing == FRAME_CHUNKED && status != 204 && status != 304)
+        n += snprintf(hdr + n, sizeof(hdr) - n, "Transfer-Encoding: chunked\r\n");
+    n += snprintf(hdr + n, sizeof(hdr) - n, "%s\r\n", keep ? "" : "Connection: close\r\n");
+    if (out_add(c, hdr, n) < 0)
+        return -1;
+
+    chunk = p.framing == FRAME_CHUNKED ? p.chunk : 0;
+    if (!head && size > 0) {
+        if (reset) {
+            if (out_body(c, size / 2, chunk) == 0)
+                out_flush(c);
+            conn_reset(c);
+            return -1;
+        }
+        if (out_body(c, size, chunk) < 0)
+            return -1;
+    }
+    if (!head && chunk > 0 && status != 204 && status != 304 && out_add(c, "0\r\n\r\n", 5) < 0)
+        return -1;
+    if (out_flush(c) < 0)
+        return -1;
+    return keep;
+}
+
+static void *conn_thread(void *vargp)
+{
+    conn *c = vargp;
+    rio_t rio;
+    int one = 1;
+
+    Pthread_detach(pthread_self());
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    rio_readinitb(&rio, c->fd);
+    while (serve(c, &rio) > 0)
+        ;
+    Close(c->fd);
+    Free(c);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    pthread_attr_t attr;
+    pthread_t tid;
+    conn *c;
+    unsigned seq = 0;
+    int listenfd, opt, i;
+
+    rules[0].p.size.a = 1024;
+    rules[0].p.chunk = 8192;
+    rules[0].p.status = 200;
+    rules[0].p.error_status = 500;
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        switch (opt) {
+        case 'f': config_load(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-f <config file>] <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: %s [-f <config file>] <port>\n", argv[0]);
+        exit(1);
+    }
+    for (i = 0; i < OUT_BUF_SIZE; i++)
+        pattern[i] = 'a' + i % 26;
+    Signal(SIGPIPE, SIG_IGN);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CONN_STACK_SIZE);
+    listenfd = Open_listenfd(argv[optind]);
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        c = Malloc(sizeof(conn));
+        c->fd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        c->rng = 2463534242u + 7919 * ++seq;
+        c->out_len = 0;
+        Pthread_create(&tid, &attr, conn_thread, c);
+    }
+    return 0;
+}
@@ -0,0 +1,298 @@
+/*
+ * replay.c - play a transaction capture (proxy -j) back against the proxy.
+ *
+ * Transactions go out with their captured spacing divided by the -s
+ * speed factor; -s 0 sends each as soon as the one before it on its
+ * connection is done. Every captured connection is mapped to one of the
+ * -c replay connections by its number, so the requests of one original
+ * connection go out in order on the same keep-alive connection, and the
+ * mapping is the same on every run. As in loadgen, latency is measured
+ * from when a request was due, so a stall shows up in the percentiles.
+ *
+ * Request bodies are not captured, so POST and PUT are replayed empty.
+ * CONNECT tunnels and requests the proxy could not parse are skipped.
+ * -o sends the requests to another origin by replacing the host:port of
+ * every absolute uri.
+ *
+ * usage: replay [-s <speed>] [-c <connections>] [-o <host:port>]
+ *               <capture file> <proxy host> <proxy port>
+ */
+#include "csapp.h"
+#include "hdr_hist.h"
+#include "httpc.h"
+#include <time.h>
+
+#define RESP_BUF_SIZE 65536         /* Per connection receive buffer */
+#define NS_PER_SEC 1000000000L
+
+typedef struct {
+    double ts;                      /* Captured time, s */
+    long offset;                    /* ns after the first captured transaction */
+    long conn;
+    char method[8];
+    char *uri;
+    int status;                     /* Captured status, compared with the replayed one */
+    long bytes;
+    long total_us;                  /* Captured latency */
+} txn;
+
+typedef struct {
+    int id;
+    long start;                     /* CLOCK_MONOTONIC ns */
+    long requests, errors, mismatches, bytes;
+    hdr_hist hist;                  /* Latency in ns */
+    char buf[RESP_BUF_SIZE];
+} conn_state;
+
+/* Options */
+static int nconns = 4;
+static double speed = 1;
+static char *proxy_host, *proxy_port, *origin;
+
+static txn *txns;
+static int ntxns, skipped;
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_until(long t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / NS_PER_SEC;
+    ts.tv_nsec = t % NS_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* Value of "key": in line, or NULL */
+static const char *json_find(const char *line, const char *key)
+{
+    char pat[64];
+    const char *p;
+
+    snprintf(pat, sizeof(pat), "\"%s\":", key);
+    return (p = strstr(line, pat)) != NULL ? p + strlen(pat) : NULL;
+}
+
+/* Unescape the JSON string at p into out; -1 if it is not one or does not fit */
+static int json_string(const char *p, char *out, size_t size)
+{
+    size_t n = 0;
+    unsigned ch;
+
+    if (p == NULL || *p++ != '"')
+        return -1;
+    while (*p != '"') {
+        if (*p == '\0' || n + 1 >= size)
+            return -1;
+        if (*p != '\\') {
+            out[n++] = *p++;
+            continue;
+        }
+        p++;
+        if (*p == 'u') {                            /* Only \u00xx is ever written */
+            if (sscanf(p + 1, "%4x", &ch) != 1)
+                return -1;
+            out[n++] = ch;
+            p += 5;
+        } else
+            out[n++] = *p++;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+/* host:port of an absolute http uri into host; the proxy itself for anything else */
+static void uri_host(const char *uri, char *host, size_t size)
+{
+    const char *end;
+
+    if (strncmp(uri, "http://", 7)) {
+        snprintf(host, size, "%s:%s", proxy_host, proxy_port);
+        return;
+    }
+    uri += 7;
+    if ((end = strchr(uri, '/')) == NULL)
+        end = uri + strlen(uri);
+    snprintf(host, size, "%.*s", (int)(end - uri), uri);
+}
+
+/* The proxy writes a capture in batches, not quite in time order */
+static int txn_cmp(const void *a, const void *b)
+{
+    const txn *x = a, *y = b;
+    return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+static void load(const char *path)
+{
+    FILE *fp;
+    char line[4 * MAXLINE], uri[MAXLINE], newuri[MAXLINE];
+    const char *p;
+    txn *t;
+    int cap = 0, i;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "replay: %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (ntxns == cap) {
+            cap = cap ? cap * 2 : 1024;
+            txns = Realloc(txns, cap * sizeof(txn));
+        }
+        t = &txns[ntxns];
+        if ((p = json_find(line, "ts")) == NULL || json_string(json_find(line, "method"), t->method, sizeof(t->method)) <= 0
+            || !strcmp(t->method, "CONNECT")
+            || json_string(json_find(line, "uri"), uri, sizeof(uri)) < 0) {
+            skipped++;
+            continue;
+        }
+        t->ts = atof(p);
+        t->conn = (p = json_find(line, "conn")) != NULL ? atol(p) : 0;
+        t->status = (p = json_find(line, "status")) != NULL ? atoi(p) : 0;
+        t->bytes = (p = json_find(line, "bytes")) != NULL ? atol(p) : 0;
+        t->total_us = (p = json_find(line, "total_us")) != NULL ? atol(p) : 0;
+        if (origin != NULL && !strncmp(uri, "http://", 7)) {
+            p = strchr(uri + 7, '/');
+            snprintf(newuri, sizeof(newuri), "http://%s%s", origin, p != NULL ? p : "/");
+            strcpy(uri, newuri);
+        }
+        t->uri = strdup(uri);
+        ntxns++;
+    }
+    fclose(fp);
+    qsort(txns, ntxns, sizeof(txn), txn_cmp);
+    for (i = 0; i < ntxns; i++)
+        txns[i].offset = (long)((txns[i].ts - txns[0].ts) * NS_PER_SEC);
+}
+
+static void *conn_thread(void *vargp)
+{
+    conn_state *c = vargp;
+    httpc_result res;
+    char host[MAXLINE];
+    txn *t;
+    long due;
+    int i, fd = -1;
+
+    sleep_until(c->start);                          /* Also with -s 0, so the run is timed from start */
+    for (i = 0; i < ntxns; i++) {
+        t = &txns[i];
+        if (t->conn % nconns != c->id)
+            continue;
+        if (speed > 0) {
+            due = c->start + (long)(t->offset / speed);
+            sleep_until(due);
+        } else
+            due = now_ns();
+
+        if (fd < 0 && (fd = open_clientfd(proxy_host, proxy_port)) < 0) {
+            c->errors++;
+            continue;
+        }
+        uri_host(t->uri, host, sizeof(host));
+        if (httpc_fetch(fd, t->method, t->uri, host, 0, c->buf, RESP_BUF_SIZE, &res) < 0) {
+            c->errors++;
+            Close(fd);
+            fd = -1;
+            continue;
+        }
+        hdr_record(&c->hist, now_ns() - due);
+        c->requests++;
+        c->bytes += res.bytes;
+        if (res.status != t->status)
+            c->mismatches++;
+        if (!res.keep) {
+            Close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+        Close(fd);
+    return NULL;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-s <speed>] [-c <connections>] [-o <host:port>] "
+            "<capture file> <proxy host> <proxy port>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    conn_state **conns;
+    pthread_t *tids;
+    hdr_hist *all, *captured;
+    long start, requests = 0, errors = 0, mismatches = 0, bytes = 0, captured_bytes = 0;
+    double secs;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "s:c:o:")) != -1) {
+        switch (opt) {
+        case 's': speed = atof(optarg); break;
+        case 'c': nconns = atoi(optarg); break;
+        case 'o': origin = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3 || nconns < 1 || speed < 0)
+        usage(argv[0]);
+    proxy_host = argv[optind + 1];
+    proxy_port = argv[optind + 2];
+    Signal(SIGPIPE, SIG_IGN);
+
+    load(argv[optind]);
+    captured = Malloc(sizeof(hdr_hist));
+    hdr_init(captured);
+    for (i = 0; i < ntxns; i++) {
+        hdr_record(captured, txns[i].total_us * 1000);
+        captured_bytes += txns[i].bytes;
+    }
+
+    all = Malloc(sizeof(hdr_hist));
+    hdr_init(all);
+    conns = Malloc(nconns * sizeof(conn_state *));
+    tids = Malloc(nconns * sizeof(pthread_t));
+    start = now_ns() + NS_PER_SEC / 10;             /* Let every thread get ready first */
+    for (i = 0; i < nconns; i++) {
+        conns[i] = Calloc(1, sizeof(conn_state));
+        conns[i]->id = i;
+        conns[i]->start = start;
+        hdr_init(&conns[i]->hist);
+        Pthread_create(&tids[i], NULL, conn_thread, conns[i]);
+    }
+    for (i = 0; i < nconns; i++) {
+        Pthread_join(tids[i], NULL);
+        hdr_merge(all, &conns[i]->hist);
+        requests += conns[i]->requests;
+        errors += conns[i]->errors;
+        mismatches += conns[i]->mismatches;
+        bytes += conns[i]->bytes;
+        Free(conns[i]);
+    }
+    secs = (now_ns() - start) / 1e9;
+
+    printf("replayed %d transactions (%d skipped) on %d connections at ", ntxns, skipped, nconns);
+    if (speed > 0)
+        printf("%gx speed", speed);
+    else
+        printf("full speed");
+    printf(", %.1f s\n", secs);
+    printf("  requests %10ld  %10.1f /s   errors %ld   status differs from capture %ld\n",
+           requests, requests / secs, errors, mismatches);
+    printf("  bytes    %10ld  (captured %ld)\n", bytes, captured_bytes);
+    printf("  latency (us)  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           hdr_mean(all) / 1e3, hdr_percentile(all, 50) / 1e3, hdr_percentile(all, 90) / 1e3,
+           hdr_percentile(all, 99) / 1e3, hdr_percentile(all, 99.9) / 1e3, all->max / 1e3);
+    printf("  captured      mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           hdr_mean(captured) / 1e3, hdr_percentile(captured, 50) / 1e3, hdr_percentile(captured, 90) / 1e3,
+           hdr_percentile(captured, 99) / 1e3, hdr_percentile(captured, 99.9) / 1e3, captured->max / 1e3);
+    return errors > 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * cache.c - the proxy's web object cache (see cache.h)
+ *
+ * Lookups scan the blocks in order, taking each block's read lock only
+ * while its uri is compared, and a new object is copied before the
+ * victim block's write lock is taken. Building with -DCACHE_LOCK_STATS
+ * counts, per thread, the lock acquisitions that had to wait and for how
+ * long; bench/cache-bench is built that way.
+ */
+#include "cache.h"
+
+cache_struct cache;
+cache_hooks cache_hook;
+
+#ifdef CACHE_LOCK_STATS
+__thread long cache_lock_acquires, cache_lock_waits, cache_lock_wait_ns;
+
+/** 바로 잡을 수 없을 때만 기다린 시간을 잼 */
+static void cache_lock(sem_t *s) {
+  struct timespec t0, t1;
+
+  cache_lock_acquires++;
+  if (sem_trywait(s) == 0)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  P(s);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  cache_lock_waits++;
+  cache_lock_wait_ns += (t1.tv_sec - t0.tv_sec) * 1000000000L + t1.tv_nsec - t0.tv_nsec;
+}
+#else
+#define cache_lock(s) P(s)
+#endif
+
+/** 쓰기 잠금 안에서: prefetch된 블록이 쓰이지 않고 지워짐 */
+static void cache_prefetch_evicted(int i) {
+  cache.blocks[i].prefetched = 0;
+  if (cache_hook.prefetch_evicted != NULL)
+    cache_hook.prefetch_evicted(cache.blocks[i].cache_object);
+}
+
+/** 캐쉬 블록 초기화 */
+void cache_init() {
+  int i;
+  for (i=0; i<TOTAL_CACHE_BLOCK_NUM; i++) {
+    cache.blocks[i].LRU = 0;        // 초기치 우선순위 없음
+    cache.blocks[i].is_empty = 1;   // empty
+    cache.blocks[i].prefetched = 0;
+    Sem_init(&cache.blocks[i].write_mutex, 0, 1);
+    Sem_init(&cache.blocks[i].read_cnt_mutex, 0, 1);
+    cache.blocks[i].read_cnt = 0;
+  }
+}
+
+int cache_find(char *uri) {
+  int i;
+  for (i=0; i<TOTAL_CACHE_BLOCK_NUM; i++) {
+    read_before(i);
+
+    if ((cache.blocks[i].is_empty == 0) && (strcmp(uri, cache.blocks[i].cache_uri) == 0)) { // cache 되어 있으면
+      read_after(i);
+      return i;
+    }
+    read_after(i);
+  }
+  if (cache_hook.miss != NULL && cache_hook.miss(uri))   // 스냅샷에 있었으면 캐쉬로 옮긴 뒤 다시 찾기
+    return cache_find(uri);
+  return -1;
+}
+
+/** uri의 캐쉬 객체를 참조를 잡아서 반환, 없으면 NULL */
+cache_obj *cache_get(char *uri) {
+  cache_obj *obj = NULL;
+  int i;
+
+  if ((i = cache_find(uri)) == -1)
+    return NULL;
+
+  read_before(i);
+  if (cache.blocks[i].is_empty == 0 && strcmp(uri, cache.blocks[i].cache_uri) == 0) {  // 그 사이에 evict되지 않았으면
+    obj = cache.blocks[i].cache_object;
+    __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+    // reader끼리는 같이 들어오므로 처음 쓴 쓰레드 하나만 알림
+    if (cache.blocks[i].prefetched && __atomic_exchange_n(&cache.blocks[i].prefetched, 0, __ATOMIC_RELAXED)
+        && cache_hook.prefetch_used != NULL)
+      cache_hook.prefetch_used(obj);
+  }
+  read_after(i);
+  return obj;
+}
+
+void cache_obj_release(cache_obj *obj) {
+  if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+    Free(obj);
+}
+
+void cache_uri(char *uri, char *buf, int size, int conn_off, int prefetched) {
+  cache_obj *obj, *old = NULL;
+  int i;
+
+  obj = Malloc(sizeof(cache_obj) + size);     // 잠금을 잡기 전에 복사
+  obj->refcnt = 1;
+  obj->size = size;
+  obj->conn_off = conn_off;
+  memcpy(obj->data, buf, size);
+
+  i = cache_eviction();                       // 빈 캐쉬 혹은 우선순위가 가장 낮은 캐쉬 블록
+
+  write_before(i);
+
+  if (cache.blocks[i].is_empty == 0) {
+    if (cache.blocks[i].prefetched)
+      cache_prefetch_evicted(i);              // 쓰이지 않은 prefetch 블록을 덮어씀
+    old = cache.blocks[i].cache_object;       // 응답 중인 쓰레드가 있으면 그쪽이 마지막에 해제
+  }
+
+  strcpy(cache.blocks[i].cache_uri, uri);     // uri 채우기
+  cache.blocks[i].cache_object = obj;         // 내용 채우기
+  cache.blocks[i].prefetched = prefetched;
+  cache.blocks[i].is_empty = 0;               // 채워진 블록 표시
+  cache.blocks[i].LRU = LRU_MAX_NUMBER;       // 가장 큰 우선순위로 갱신
+
+  write_after(i);
+
+  cache_LRU(i);                               // 다른 캐쉬 블록 내리기 (i를 놓은 뒤에 해야 서로 기다리는 deadlock이 없음)
+  if (old != NULL)
+    cache_obj_release(old);
+}
+
+void cache_LRU(int index) {
+  int i;
+  for (i = 0; i < TOTAL_CACHE_BLOCK_NUM; i++) {
+    if (i == index) continue;             // 자기 자신은 넘기기
+    write_before(i);
+    if (cache.blocks[i].is_empty == 0) {  // 채워져 있으면
+      cache.blocks[i].LRU--;              // 우선순위를 내리기
+    }
+    write_after(i);
+  }
+}
+
+/** uri의 캐쉬 블록을 비움, 응답 중인 쓰레드는 잡고 있는 참조로 마저 보냄 */
+// 스냅샷에 남아 있는 같은 uri도 다시 올리지 않도록 옮긴 것으로 표시
+void cache_invalidate(char *uri) {
+  cache_obj *old;
+  int i;
+
+  if (cache_hook.invalidate != NULL)
+    cache_hook.invalidate(uri);
+
+  for (i = 0; i < TOTAL_CACHE_BLOCK_NUM; i++) {
+    old = NULL;
+    write_before(i);
+    if (cache.blocks[i].is_empty == 0 && strcmp(uri, cache.blocks[i].cache_uri) == 0) {
+      if (cache.blocks[i].prefetched)
+        cache_prefetch_evicted(i);
+      old = cache.blocks[i].cache_object;
+      cache.blocks[i].cache_object = NULL;
+      cache.blocks[i].is_empty = 1;
+      cache.blocks[i].LRU = 0;
+    }
+    write_after(i);
+    if (old != NULL)
+      cache_obj_release(old);
+  }
+}
+
+int cache_eviction() {
+  int min = LRU_MAX_NUMBER;
+  int minindex = 0;
+  int i;
+  for (i=0; i<TOTAL_CACHE_BLOCK_NUM; i++) {
+    read_before(i);
+    if (cache.blocks[i].is_empty == 1) {  // 비어 있으면 저장 가능함
+      minindex = i;
+      read_after(i);
+      break;
+    }
+    if (cache.blocks[i].LRU < min) {    // 우선 순위가 낮은 캐쉬블록으로 갱신
+      minindex = i;
+      min = cache.blocks[i]. LRU;
+    }
+    read_after(i);
+  }
+
+  return minindex;
+}
+
+void read_before(int i) {
+  cache_lock(&cache.blocks[i].read_cnt_mutex);
+  cache.blocks[i].read_cnt++;
+  if (cache.blocks[i].read_cnt == 1)
+    write_before(i);
+  V(&cache.blocks[i].read_cnt_mutex);
+}
+
+void read_after(int i) {
+  cache_lock(&cache.blocks[i].read_cnt_mutex);
+  cache.blocks[i].read_cnt--;
+  if (cache.blocks[i].read_cnt == 0)
+    write_after(i);
+  V(&cache.blocks[i].read_cnt_mutex);
+}
+
+void write_before(int i) {
+  cache_lock(&cache.blocks[i].write_mutex);
+}
+
+void write_after(int i) {
+  V(&cache.blocks[i].write_mutex);
+}
@@ -0,0 +1,77 @@
+/*
+ * cache.h - the proxy's web object cache
+ *
+ * TOTAL_CACHE_BLOCK_NUM blocks, each holding one uri and a reference
+ * counted copy of its response, replaced in LRU order. Every block has
+ * its own readers-writer lock (read_before/read_after,
+ * write_before/write_after), so lookups of different blocks never wait
+ * for each other. A response is handed out with a reference taken, so a
+ * thread can keep sending it after the block is reused.
+ *
+ * The cache itself knows nothing about snapshots or prefetching; the
+ * proxy plugs those in through cache_hook.
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+
+#define TOTAL_CACHE_BLOCK_NUM 10            // cache에 저장 가능한 블록의 총 갯수
+#define LRU_MAX_NUMBER 9999                 // 새로 채운 블록의 초기 우선순위
+
+// 캐쉬 내용은 참조 수를 세는 객체로 따로 할당해서, 블록 잠금을 놓은 뒤에도 응답을 보낼 수 있게 함
+typedef struct {
+  int refcnt;                           // 블록이 가진 참조 1 + 응답 중인 쓰레드 수
+  int size;                             // data 바이트 수 (바이너리 응답도 있으므로 strlen을 쓰지 않음)
+  int conn_off;                         // Connection 헤더를 끼워 넣을 위치 (응답 헤더 끝 빈 줄의 앞)
+  char data[];                          // hop-by-hop 헤더를 뺀 응답 전체
+} cache_obj;
+
+typedef struct {
+  char cache_uri[MAXLINE];              // 캐쉬한 uri
+  cache_obj *cache_object;              // 캐쉬 내용
+  int LRU;                              // 우선순위 (낮은게 오래 전에 추가된 캐쉬 블록)
+  int is_empty;                         // 1: 빈 캐쉬 블록, 0: 채워진 캐쉬 블록
+  int prefetched;                       // 1: prefetch로 채워졌고 아직 클라이언트가 쓰지 않은 블록
+
+  int read_cnt;
+  sem_t read_cnt_mutex;
+  sem_t write_mutex;
+} cache_block;
+
+typedef struct {
+  cache_block blocks[TOTAL_CACHE_BLOCK_NUM];
+} cache_struct;
+
+// 캐쉬 밖의 기능을 끼우는 자리, NULL이면 부르지 않음
+typedef struct {
+  int (*miss)(char *uri);                       // cache_find에서 못 찾음: 다른 곳에서 캐쉬를 채웠으면 1
+  int (*invalidate)(char *uri);                 // uri의 내용이 바뀜 (반환값은 쓰지 않음)
+  void (*prefetch_used)(cache_obj *obj);        // prefetch된 블록이 처음 쓰임
+  void (*prefetch_evicted)(cache_obj *obj);     // prefetch된 블록이 쓰이지 않고 지워짐 (블록 쓰기 잠금 안에서)
+} cache_hooks;
+
+extern cache_struct cache;                  // 전역변수로 캐쉬 선언
+extern cache_hooks cache_hook;
+
+#ifdef CACHE_LOCK_STATS
+// 블록 잠금을 기다린 시간 (바로 잡지 못한 경우만 잼, bench/cache-bench용)
+extern __thread long cache_lock_acquires, cache_lock_waits, cache_lock_wait_ns;
+#endif
+
+void cache_init();                          // cache 초기화
+int cache_find(char *uri);                  // cache에 있는지 찾고 정보를 받아오기
+void cache_uri(char *uri, char *buf, int size, int conn_off, int prefetched); // buf를 새로 cache에 추가
+void cache_LRU(int index);                  // index 이외의 캐쉬의 LRU 값을 내리기
+void cache_invalidate(char *uri);           // uri의 캐쉬 블록을 비우기 (unsafe method)
+int cache_eviction();                       // 비어 있거나 우선순위가 가장 낮은 cache 블록 인덱스 찾기
+
+cache_obj *cache_get(char *uri);            // 찾으면 참조를 하나 늘려서 반환 (다 쓰면 cache_obj_release)
+void cache_obj_release(cache_obj *obj);     // 참조를 하나 줄이고 0이 되면 해제
+
+void read_before(int i);
+void read_after(int i);
+void write_before(int i);
+void write_after(int i);
+
+#endif /* __CACHE_H__ */
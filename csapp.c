@@ -23,6 +23,7 @@
  */
 /* $begin csapp.c */
 #include "csapp.h"
+#include <poll.h>
 
 /************************** 
  * Error-handling functions
@@ -792,6 +793,35 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write all the bytes described by iov (unbuffered).
+ *     The iov array is updated in place as bytes go out.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t nwritten, total = 0;
+
+    while (iovcnt > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX)) <= 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	total += nwritten;
+	while (iovcnt > 0 && nwritten >= iov->iov_len) {  /* Skip finished entries */
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {                                  /* Partially written entry */
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return total;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -893,6 +923,33 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_fillb - Read more bytes into the internal buffer without consuming
+ *     the unread ones, so a parser can work on rp->rio_bufptr in place.
+ *     The unread bytes are moved to the front of the buffer first, which
+ *     keeps offsets taken relative to rio_bufptr valid. Returns the number
+ *     of bytes read, 0 on EOF or if the buffer is already full, -1 on error.
+ */
+ssize_t rio_fillb(rio_t *rp)
+{
+    ssize_t n;
+
+    if (rp->rio_bufptr != rp->rio_buf) {
+	memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+    }
+    if (rp->rio_cnt == sizeof(rp->rio_buf))
+	return 0;
+
+    while ((n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+		     sizeof(rp->rio_buf) - rp->rio_cnt)) < 0) {
+	if (errno != EINTR) /* Interrupted by sig handler return */
+	    return -1;
+    }
+    rp->rio_cnt += n;
+    return n;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -985,6 +1042,70 @@ int open_clientfd(char *hostname, char *port) {
 }
 /* $end open_clientfd */
 
+/*
+ * open_clientfd_timeout - Like open_clientfd, but gives up on an address
+ *     whose connect has not completed within timeout_ms milliseconds and
+ *     tries the next one. The connect runs non-blocking under poll(); the
+ *     returned descriptor is back in blocking mode. Name resolution is
+ *     not covered by the timeout.
+ *
+ *     On error, returns: 
+ *       -2 for getaddrinfo error
+ *       -1 with errno set for other errors (ETIMEDOUT if the last
+ *          address timed out).
+ */
+int open_clientfd_timeout(char *hostname, char *port, int timeout_ms) {
+    int clientfd, rc, flags, err;
+    socklen_t errlen;
+    struct addrinfo hints, *listp, *p;
+    struct pollfd pfd;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
+        return -2;
+    }
+
+    for (p = listp; p; p = p->ai_next) {
+        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
+            continue;
+        flags = fcntl(clientfd, F_GETFL, 0);
+        fcntl(clientfd, F_SETFL, flags | O_NONBLOCK);
+
+        err = 0;
+        if (connect(clientfd, p->ai_addr, p->ai_addrlen) < 0) {
+            err = errno;
+            if (err == EINPROGRESS) {       /* Wait for the handshake */
+                pfd.fd = clientfd;
+                pfd.events = POLLOUT;
+                while ((rc = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR)
+                    ;
+                errlen = sizeof(err);
+                if (rc == 0)
+                    err = ETIMEDOUT;
+                else if (rc < 0)
+                    err = errno;
+                else if (getsockopt(clientfd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+                    err = errno;
+            }
+        }
+        if (err == 0) {
+            fcntl(clientfd, F_SETFL, flags);
+            break; /* Success */
+        }
+        close(clientfd);
+        errno = err;
+    } 
+
+    freeaddrinfo(listp);
+    if (!p) /* All connects failed */
+        return -1;
+    else
+        return clientfd;
+}
+
 /*  
  * open_listenfd - Open and return a listening socket on port. This
  *     function is reentrant and protocol-independent.
@@ -40,6 +40,9 @@ CACHE_LIST="tiny.c
 # The file we will fetch for various tests
 FETCH_FILE="home.html"
 
+# A file that must never be fetched by the pipelining test
+SMUGGLED_FILE="smuggled.html"
+
 #####
 # Helper functions
 #
@@ -400,6 +403,54 @@ wait $proxy_pid 2> /dev/null
 
 echo "cacheScore: $cacheScore/${MAX_CACHE}"
 
+#####
+# Pipelining (not scored)
+#
+# A GET for a cached file that carries a body must not leave the body
+# to be read as the next request on a kept-alive connection: the body
+# here is a whole request for ${SMUGGLED_FILE}, followed by a second,
+# ordinary request. The proxy has to refuse the first with a 400 and
+# close, so neither is answered.
+echo ""
+echo "*** Pipelining (not scored) ***"
+
+tiny_port=$(free_port)
+echo "Starting tiny on port ${tiny_port}"
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+wait_for_port_use "${tiny_port}"
+
+proxy_port=$(free_port)
+echo "Starting proxy on port ${proxy_port}"
+./proxy ${proxy_port} &> /dev/null &
+proxy_pid=$!
+wait_for_port_use "${proxy_port}"
+
+clear_dirs
+echo "Fetching ./tiny/${FETCH_FILE} into ${PROXY_DIR} using the proxy"
+download_proxy $PROXY_DIR ${FETCH_FILE} "http://localhost:${tiny_port}/${FETCH_FILE}" "http://localhost:${proxy_port}"
+
+echo "Pipelining a cache hit with a smuggled request in its body"
+smuggled=$(printf 'GET http://localhost:%s/%s HTTP/1.1\r\nHost: localhost:%s\r\n\r\n' ${tiny_port} ${SMUGGLED_FILE} ${tiny_port})
+responses=$(exec 3<>/dev/tcp/localhost/${proxy_port}
+    printf 'GET http://localhost:%s/%s HTTP/1.1\r\nHost: localhost:%s\r\nContent-Length: %d\r\n\r\n%sGET http://localhost:%s/%s HTTP/1.1\r\nHost: localhost:%s\r\n\r\n' \
+        ${tiny_port} ${FETCH_FILE} ${tiny_port} ${#smuggled} "${smuggled}" ${tiny_port} ${FETCH_FILE} ${tiny_port} >&3
+    timeout ${TIMEOUT} cat <&3)
+if echo "${responses}" | head -1 | grep -q " 400 " && ! echo "${responses}" | grep -q "${SMUGGLED_FILE}" \
+    && [ $(echo "${responses}" | grep -c "^HTTP/") -eq 1 ]; then
+    echo "Success: The request with a body was refused and the connection closed."
+else
+    echo "Failure: The proxy answered a request taken from a request body."
+fi
+
+echo "Killing tiny and proxy"
+kill $tiny_pid 2> /dev/null
+wait $tiny_pid 2> /dev/null
+kill $proxy_pid 2> /dev/null
+wait $proxy_pid 2> /dev/null
+
 # Emit the total score
 totalScore=`expr ${basicScore} + ${cacheScore} + ${concurrencyScore}`
 maxScore=`expr ${MAX_BASIC} + ${MAX_CACHE} + ${MAX_CONCURRENCY}`
@@ -0,0 +1,109 @@
+/*
+ * hdr_hist.c - fixed-size HDR latency histogram (see hdr_hist.h)
+ */
+#include <string.h>
+#include <limits.h>
+#include "hdr_hist.h"
+
+#define HDR_SUB_COUNT (1L << HDR_SUB_BITS)
+
+/* Bucket index of value: the value itself below 2 * HDR_SUB_COUNT, else
+ * (power of two - HDR_SUB_BITS) * HDR_SUB_COUNT + its top HDR_SUB_BITS+1 bits */
+static inline int hdr_index(long value)
+{
+    int shift;
+
+    if (value < 2 * HDR_SUB_COUNT)
+        return value < 0 ? 0 : value;
+    if (value >= 1L << HDR_MAX_BITS)
+        value = (1L << HDR_MAX_BITS) - 1;
+    shift = 63 - __builtin_clzl(value) - HDR_SUB_BITS;
+    return (shift << HDR_SUB_BITS) + (value >> shift);
+}
+
+/* Largest value that lands in bucket index */
+static long hdr_highest(int index)
+{
+    int shift;
+
+    if (index < 2 * HDR_SUB_COUNT)
+        return index;
+    shift = (index >> HDR_SUB_BITS) - 1;
+    return ((long)(index - (shift << HDR_SUB_BITS)) << shift) + (1L << shift) - 1;
+}
+
+void hdr_init(hdr_hist *h)
+{
+    memset(h, 0, sizeof(hdr_hist));
+    h->min = LONG_MAX;
+}
+
+void hdr_record(hdr_hist *h, long value)
+{
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->total++;
+    h->sum += value;
+    h->counts[hdr_index(value)]++;
+}
+
+/* Same as hdr_record, for a histogram other threads record into too */
+void hdr_record_atomic(hdr_hist *h, long value)
+{
+    long cur;
+
+    __atomic_fetch_add(&h->counts[hdr_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > cur && !__atomic_compare_exchange_n(&h->max, &cur, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    cur = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while (value < cur && !__atomic_compare_exchange_n(&h->min, &cur, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void hdr_merge(hdr_hist *dst, const hdr_hist *src)
+{
+    int i;
+
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->total += src->total;
+    dst->sum += src->sum;
+    for (i = 0; i < HDR_COUNTS; i++)
+        dst->counts[i] += src->counts[i];
+}
+
+/*
+ * hdr_percentile - Smallest recorded value (to bucket precision) that
+ *     percentile percent of all values are at or below. Returns 0 for an
+ *     empty histogram.
+ */
+long hdr_percentile(const hdr_hist *h, double percentile)
+{
+    long want, seen = 0, v;
+    int i;
+
+    if (h->total == 0)
+        return 0;
+    want = (long)(h->total * percentile / 100.0 + 0.5);
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < HDR_COUNTS; i++) {
+        if ((seen += h->counts[i]) >= want) {
+            v = hdr_highest(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+double hdr_mean(const hdr_hist *h)
+{
+    return h->total ? (double)h->sum / h->total : 0;
+}
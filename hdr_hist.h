@@ -0,0 +1,35 @@
+/*
+ * hdr_hist.h - fixed-size HDR (high dynamic range) latency histogram
+ *
+ * Values are counted in log-linear buckets: below 2^(HDR_SUB_BITS+1)
+ * every value has its own bucket, above that each power of two is split
+ * into 2^HDR_SUB_BITS equal buckets. So a recorded value is known to
+ * within 1/256 (about 0.4%) of itself anywhere from nanoseconds to
+ * minutes, and recording is a count++ at an index computed with one
+ * bit scan, without allocation or locking. Histograms of the same shape
+ * merge by adding counts, so each thread can keep its own.
+ * hdr_record_atomic() lets several threads share one histogram with
+ * relaxed atomic adds instead.
+ */
+#ifndef __HDR_HIST_H__
+#define __HDR_HIST_H__
+
+#define HDR_SUB_BITS 8              /* 256 buckets per power of two */
+#define HDR_MAX_BITS 40             /* Values up to 2^40 (18 minutes in ns) */
+#define HDR_COUNTS ((HDR_MAX_BITS - HDR_SUB_BITS + 1) << HDR_SUB_BITS)
+
+typedef struct {
+    long total;                     /* Number of recorded values */
+    long min, max;                  /* min is LONG_MAX while empty */
+    long sum;
+    long counts[HDR_COUNTS];
+} hdr_hist;
+
+void hdr_init(hdr_hist *h);
+void hdr_record(hdr_hist *h, long value);
+void hdr_record_atomic(hdr_hist *h, long value);
+void hdr_merge(hdr_hist *dst, const hdr_hist *src);
+long hdr_percentile(const hdr_hist *h, double percentile);  /* 0 < percentile <= 100 */
+double hdr_mean(const hdr_hist *h);
+
+#endif /* __HDR_HIST_H__ */
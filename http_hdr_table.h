@@ -0,0 +1,20 @@
+/* Generated by http_hdrgen. Do not edit. */
+#define HTTP_HDR_HASH_MUL  0x2ffbff17u
+#define HTTP_HDR_HASH_BITS 4
+#define HTTP_HDR_MAX_LEN   17
+
+static const struct {
+    unsigned char len, id;
+    char name[32];
+} http_hdr_table[1 << HTTP_HDR_HASH_BITS] = {
+    [2] = { 4, 1, "host" },
+    [13] = { 10, 2, "connection" },
+    [11] = { 16, 3, "proxy-connection" },
+    [14] = { 10, 4, "keep-alive" },
+    [1] = { 10, 5, "user-agent" },
+    [4] = { 14, 6, "content-length" },
+    [7] = { 17, 7, "transfer-encoding" },
+    [5] = { 12, 8, "content-type" },
+    [3] = { 13, 9, "cache-control" },
+    [9] = { 6, 10, "expect" },
+};
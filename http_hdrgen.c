@@ -0,0 +1,116 @@
+/*
+ * http_hdrgen.c - generate http_hdr_table.h, the perfect hash table
+ *     behind http_header_id().
+ *
+ * The Makefile runs this before compiling http_parse.c. It searches for
+ * a multiplier (and the smallest table) for which HTTP_HDR_HASH() puts
+ * every name below in a slot of its own, so a lookup is one hash, one
+ * length check and one compare. Names are stored lower-cased and padded
+ * to 32 bytes so the compare can load them 16 bytes at a time.
+ *
+ * usage: http_hdrgen > http_hdr_table.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "http_parse.h"
+
+#define MIN_BITS 4
+#define MAX_BITS 10
+#define TRIES    1000000
+
+static const struct {
+    const char *name;
+    int id;
+} names[] = {
+    { "Host",              HTTP_HDR_HOST },
+    { "Connection",        HTTP_HDR_CONNECTION },
+    { "Proxy-Connection",  HTTP_HDR_PROXY_CONNECTION },
+    { "Keep-Alive",        HTTP_HDR_KEEP_ALIVE },
+    { "User-Agent",        HTTP_HDR_USER_AGENT },
+    { "Content-Length",    HTTP_HDR_CONTENT_LENGTH },
+    { "Transfer-Encoding", HTTP_HDR_TRANSFER_ENCODING },
+    { "Content-Type",      HTTP_HDR_CONTENT_TYPE },
+    { "Cache-Control",     HTTP_HDR_CACHE_CONTROL },
+    { "Expect",            HTTP_HDR_EXPECT },
+};
+#define NNAMES (int)(sizeof(names) / sizeof(names[0]))
+
+static unsigned char lower[NNAMES][64];
+
+static unsigned hash(int i, unsigned mul, int bits)
+{
+    int len = strlen(names[i].name);
+    return HTTP_HDR_HASH(len, lower[i][0], lower[i][len / 2], lower[i][len - 1], mul, bits);
+}
+
+/* Does mul put every name in its own slot of a 2^bits table? */
+static int perfect(unsigned mul, int bits)
+{
+    char used[1 << MAX_BITS];
+    unsigned h;
+    int i;
+
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < NNAMES; i++) {
+        h = hash(i, mul, bits);
+        if (used[h])
+            return 0;
+        used[h] = 1;
+    }
+    return 1;
+}
+
+int main(void)
+{
+    unsigned mul = 0, seed = 2463534242u;
+    int i, j, bits, found = 0, maxlen = 0;
+
+    if (NNAMES != HTTP_HDR_COUNT - 1) {
+        fprintf(stderr, "http_hdrgen: %d names but HTTP_HDR_COUNT is %d\n", NNAMES, HTTP_HDR_COUNT);
+        exit(1);
+    }
+    for (i = 0; i < NNAMES; i++) {
+        for (j = 0; names[i].name[j]; j++)
+            lower[i][j] = tolower((unsigned char)names[i].name[j]);
+        if (j > maxlen)
+            maxlen = j;
+    }
+    if (maxlen > 32) {                          /* Table entries hold 32 bytes */
+        fprintf(stderr, "http_hdrgen: names longer than 32 bytes are not supported\n");
+        exit(1);
+    }
+
+    for (bits = MIN_BITS; bits <= MAX_BITS && !found; bits++) {
+        for (i = 0; i < TRIES; i++) {
+            seed ^= seed << 13;                 /* xorshift32 */
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            if (perfect(seed | 1, bits)) {
+                mul = seed | 1;
+                found = 1;
+                break;
+            }
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "http_hdrgen: no perfect hash found\n");
+        exit(1);
+    }
+    bits--;
+
+    printf("/* Generated by http_hdrgen. Do not edit. */\n");
+    printf("#define HTTP_HDR_HASH_MUL  0x%08xu\n", mul);
+    printf("#define HTTP_HDR_HASH_BITS %d\n", bits);
+    printf("#define HTTP_HDR_MAX_LEN   %d\n\n", maxlen);
+    printf("static const struct {\n");
+    printf("    unsigned char len, id;\n");
+    printf("    char name[32];\n");
+    printf("} http_hdr_table[1 << HTTP_HDR_HASH_BITS] = {\n");
+    for (i = 0; i < NNAMES; i++)
+        printf("    [%u] = { %d, %d, \"%s\" },\n",
+               hash(i, mul, bits), (int)strlen(names[i].name), names[i].id, (char *)lower[i]);
+    printf("};\n");
+    return 0;
+}
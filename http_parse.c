@@ -0,0 +1,642 @@
+/*
+ * http_parse.c - incremental, zero-copy HTTP/1.x request/response parser
+ *
+ * The request is scanned one line at a time. The search for '\n' (and
+ * for ':' inside header lines) is the hot loop, so it is done 16 or 32
+ * bytes at a time with SSE2/AVX2 when the CPU has them. The AVX2 path is
+ * picked at startup with __builtin_cpu_supports(), so the binary still
+ * runs on CPUs without AVX2.
+ *
+ * Header names are classified while each line is parsed with a perfect
+ * hash table generated at build time by http_hdrgen, and checked against
+ * the table entry lower-casing 16 (SSE2) or 8 (in a word) bytes at a time.
+ */
+#include <string.h>
+#include <strings.h>
+#include "http_parse.h"
+#include "http_hdr_table.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_X86 1
+#endif
+
+/* Parser states */
+#define STATE_REQUEST_LINE 0
+#define STATE_HEADERS      1
+#define STATE_DONE         2
+
+/*********************************
+ * Vectorized character scanning
+ *********************************/
+static const char *find_char_scalar(const char *p, const char *end, char c)
+{
+    for (; p < end; p++)
+        if (*p == c)
+            return p;
+    return NULL;
+}
+
+#if defined(HTTP_X86) && defined(__SSE2__)
+static const char *find_char_sse2(const char *p, const char *end, char c)
+{
+    __m128i needle = _mm_set1_epi8(c);
+
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_char_scalar(p, end, c);
+}
+#endif
+
+#if defined(HTTP_X86) && defined(__GNUC__)
+__attribute__((target("avx2")))
+static const char *find_char_avx2(const char *p, const char *end, char c)
+{
+    __m256i needle = _mm256_set1_epi8(c);
+
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    if (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(needle)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_char_scalar(p, end, c);
+}
+#endif
+
+static const char *(*find_char_impl)(const char *, const char *, char) = find_char_scalar;
+
+/* Pick the widest implementation the CPU supports before main() runs */
+__attribute__((constructor))
+static void find_char_select(void)
+{
+#if defined(HTTP_X86) && defined(__SSE2__)
+    find_char_impl = find_char_sse2;
+#endif
+#if defined(HTTP_X86) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        find_char_impl = find_char_avx2;
+#endif
+}
+
+/*
+ * http_find_char - Return the first c in [p, end), or NULL
+ */
+const char *http_find_char(const char *p, const char *end, char c)
+{
+    return find_char_impl(p, end, c);
+}
+
+/*********************************
+ * Header name classification
+ *********************************/
+static inline unsigned char lower1(unsigned char c)
+{
+    return (unsigned char)(c - 'A') < 26 ? c | 0x20 : c;
+}
+
+/* Lower-case the ASCII letters in 8 bytes at once (bytes >= 0x80 are left alone) */
+static inline unsigned long long lower8(unsigned long long x)
+{
+    const unsigned long long ones = 0x0101010101010101ULL, high = 0x8080808080808080ULL;
+    unsigned long long low7 = x & ~high;
+    unsigned long long ge_a = low7 + ones * (0x80 - 'A');       /* High bit set if >= 'A' */
+    unsigned long long gt_z = low7 + ones * (0x7f - 'Z');       /* High bit set if > 'Z' */
+
+    return x | (((ge_a ^ gt_z) & ~x & high) >> 2);
+}
+
+/*
+ * name_caseeq - Compare len bytes of name, lower-cased, with the padded
+ *     lower-case table entry lc. Two overlapping loads cover the name
+ *     without reading past its end: 16 bytes with SSE2 for long names,
+ *     8 bytes for medium ones.
+ */
+static int name_caseeq(const char *name, const char *lc, int len)
+{
+    unsigned long long a, b;
+    int i;
+
+#if defined(HTTP_X86) && defined(__SSE2__)
+    if (len >= 16) {
+        const __m128i before_a = _mm_set1_epi8('A' - 1), after_z = _mm_set1_epi8('Z' + 1);
+        const __m128i bit = _mm_set1_epi8(0x20);
+        __m128i x, upper, eq;
+
+        x = _mm_loadu_si128((const __m128i *)name);
+        upper = _mm_and_si128(_mm_cmpgt_epi8(x, before_a), _mm_cmplt_epi8(x, after_z));
+        eq = _mm_cmpeq_epi8(_mm_or_si128(x, _mm_and_si128(upper, bit)), _mm_loadu_si128((const __m128i *)lc));
+        x = _mm_loadu_si128((const __m128i *)(name + len - 16));
+        upper = _mm_and_si128(_mm_cmpgt_epi8(x, before_a), _mm_cmplt_epi8(x, after_z));
+        eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_or_si128(x, _mm_and_si128(upper, bit)),
+                                              _mm_loadu_si128((const __m128i *)(lc + len - 16))));
+        return _mm_movemask_epi8(eq) == 0xffff;
+    }
+#endif
+    if (len >= 8) {
+        for (i = 0; i + 8 < len; i += 8) {
+            memcpy(&a, name + i, 8);
+            memcpy(&b, lc + i, 8);
+            if (lower8(a) != b)
+                return 0;
+        }
+        memcpy(&a, name + len - 8, 8);
+        memcpy(&b, lc + len - 8, 8);
+        return lower8(a) == b;
+    }
+    for (i = 0; i < len; i++)
+        if (lower1(name[i]) != (unsigned char)lc[i])
+            return 0;
+    return 1;
+}
+
+/*
+ * http_header_id - Classify a header name, HTTP_HDR_OTHER if the proxy
+ *     has no use for it
+ */
+int http_header_id(const char *name, int len)
+{
+    unsigned h;
+
+    if (len <= 0 || len > HTTP_HDR_MAX_LEN)
+        return HTTP_HDR_OTHER;
+    h = HTTP_HDR_HASH(len, lower1(name[0]), lower1(name[len / 2]), lower1(name[len - 1]),
+                      HTTP_HDR_HASH_MUL, HTTP_HDR_HASH_BITS);
+    if (http_hdr_table[h].len == len && name_caseeq(name, http_hdr_table[h].name, len))
+        return http_hdr_table[h].id;
+    return HTTP_HDR_OTHER;
+}
+
+/*********************************
+ * View helpers
+ *********************************/
+static http_view make_view(const char *buf, const char *start, const char *end)
+{
+    http_view v;
+    v.off = start - buf;
+    v.len = end - start;
+    return v;
+}
+
+int http_view_eq(const char *buf, http_view v, const char *s)
+{
+    return (int)strlen(s) == v.len && memcmp(buf + v.off, s, v.len) == 0;
+}
+
+int http_view_caseeq(const char *buf, http_view v, const char *s)
+{
+    return (int)strlen(s) == v.len && strncasecmp(buf + v.off, s, v.len) == 0;
+}
+
+/*
+ * http_view_copy - Copy a view into a NUL-terminated string. Returns -1
+ *     if it does not fit in dstlen bytes.
+ */
+int http_view_copy(const char *buf, http_view v, char *dst, int dstlen)
+{
+    if (v.len >= dstlen)
+        return -1;
+    memcpy(dst, buf + v.off, v.len);
+    dst[v.len] = '\0';
+    return v.len;
+}
+
+/*********************************
+ * Request parsing
+ *********************************/
+void http_request_init(http_request *req)
+{
+    memset(req, 0, sizeof(http_request));
+    req->state = STATE_REQUEST_LINE;
+}
+
+/*
+ * http_parse_uri - Split a request target into scheme, host, port and
+ *     path. Accepts origin-form ("/a?b"), absolute-form
+ *     ("http://h:p/a?b") and authority-form ("h:p", used by CONNECT).
+ */
+int http_parse_uri(const char *buf, http_view target, http_uri *uri)
+{
+    const char *p = buf + target.off, *end = p + target.len;
+    const char *colon, *auth_end, *host_end;
+
+    memset(uri, 0, sizeof(http_uri));
+    uri->scheme.off = uri->host.off = uri->port.off = uri->path.off = target.off;
+    if (p == end)
+        return -1;
+
+    if (*p == '/') {                                    /* origin-form */
+        uri->path = make_view(buf, p, end);
+        return 0;
+    }
+
+    colon = http_find_char(p, end, ':');
+    if (colon && end - colon >= 3 && colon[1] == '/' && colon[2] == '/') {
+        uri->scheme = make_view(buf, p, colon);         /* absolute-form */
+        p = colon + 3;
+    }
+
+    for (auth_end = p; auth_end < end && *auth_end != '/' && *auth_end != '?'; auth_end++)
+        ;
+    if (p < auth_end && *p == '[') {                    /* IPv6 literal */
+        const char *rb = http_find_char(p, auth_end, ']');
+        if (rb == NULL)
+            return -1;
+        uri->host = make_view(buf, p + 1, rb);
+        host_end = rb + 1;
+    } else {
+        host_end = http_find_char(p, auth_end, ':');
+        if (host_end == NULL)
+            host_end = auth_end;
+        uri->host = make_view(buf, p, host_end);
+    }
+    if (host_end < auth_end && *host_end == ':')
+        uri->port = make_view(buf, host_end + 1, auth_end);
+    uri->path = make_view(buf, auth_end, end);
+    return 0;
+}
+
+static int parse_request_line(void *msg, const char *buf, const char *line, const char *end)
+{
+    http_request *req = msg;
+    const char *sp1, *sp2;
+
+    if ((sp1 = http_find_char(line, end, ' ')) == NULL || sp1 == line)
+        return -1;
+    if ((sp2 = http_find_char(sp1 + 1, end, ' ')) == NULL || sp2 == sp1 + 1)
+        return -1;
+    if (end - (sp2 + 1) < 8 || memcmp(sp2 + 1, "HTTP/", 5))
+        return -1;
+
+    req->method = make_view(buf, line, sp1);
+    req->target = make_view(buf, sp1 + 1, sp2);
+    req->version = make_view(buf, sp2 + 1, end);
+    return http_parse_uri(buf, req->target, &req->uri);
+}
+
+static int parse_status_line(void *msg, const char *buf, const char *line, const char *end)
+{
+    http_response *resp = msg;
+    const char *p;
+    int status = 0;
+
+    /* "HTTP/1.x ddd reason", the reason phrase may be empty */
+    if (end - line < 12 || memcmp(line, "HTTP/", 5) || line[8] != ' ')
+        return -1;
+    for (p = line + 9; p < line + 12; p++) {
+        if (*p < '0' || *p > '9')
+            return -1;
+        status = status * 10 + (*p - '0');
+    }
+    if (p < end && *p != ' ')
+        return -1;
+
+    resp->version = make_view(buf, line, line + 8);
+    resp->status = status;
+    resp->reason = p < end ? make_view(buf, p + 1, end) : make_view(buf, end, end);
+    return 0;
+}
+
+static int parse_header_line(http_header_view *headers, int *nheaders, const char *buf,
+                             const char *line, const char *end, const char *next)
+{
+    const char *colon, *v, *vend;
+    http_header_view *h;
+
+    if (*line == ' ' || *line == '\t')                  /* Obsolete line folding */
+        return HTTP_PARSE_ERROR;
+    if (*nheaders == HTTP_MAX_HEADERS)
+        return HTTP_PARSE_TOO_LARGE;
+    if ((colon = http_find_char(line, end, ':')) == NULL || colon == line)
+        return HTTP_PARSE_ERROR;
+    if (colon[-1] == ' ' || colon[-1] == '\t')          /* No blanks before ':' */
+        return HTTP_PARSE_ERROR;
+
+    for (v = colon + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+        ;
+    for (vend = end; vend > v && (vend[-1] == ' ' || vend[-1] == '\t'); vend--)
+        ;
+
+    h = &headers[(*nheaders)++];
+    h->name = make_view(buf, line, colon);
+    h->value = make_view(buf, v, vend);
+    h->line = make_view(buf, line, next);
+    h->id = http_header_id(line, colon - line);
+    return HTTP_PARSE_DONE;
+}
+
+/*
+ * parse_head - Line-by-line engine shared by requests and responses.
+ *     first_line() parses the request or status line into msg.
+ */
+static int parse_head(int *state, int *line_start, int *scan,
+                      http_header_view *headers, int *nheaders, int *endp,
+                      const char *buf, int len,
+                      int (*first_line)(void *, const char *, const char *, const char *), void *msg)
+{
+    const char *line, *nl, *end;
+    int rc;
+
+    while (*state != STATE_DONE) {
+        line = buf + *line_start;
+        if ((nl = http_find_char(line + *scan, buf + len, '\n')) == NULL) {
+            *scan = len - *line_start;                  /* Resume here next time */
+            return HTTP_PARSE_AGAIN;
+        }
+        end = (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+
+        if (*state == STATE_REQUEST_LINE) {
+            if (end != line) {                          /* Skip stray CRLFs before the message */
+                if (first_line(msg, buf, line, end) < 0)
+                    return HTTP_PARSE_ERROR;
+                *state = STATE_HEADERS;
+            }
+        } else if (end == line) {                       /* Blank line ends the headers */
+            *endp = nl + 1 - buf;
+            *state = STATE_DONE;
+        } else if ((rc = parse_header_line(headers, nheaders, buf, line, end, nl + 1)) != HTTP_PARSE_DONE) {
+            return rc;
+        }
+        *line_start = nl + 1 - buf;
+        *scan = 0;
+    }
+    return HTTP_PARSE_DONE;
+}
+
+/*
+ * http_parse_request - Parse as much of the request in buf[0..len) as
+ *     possible. buf may grow between calls but bytes already seen must
+ *     not move. Returns HTTP_PARSE_DONE once the blank line ending the
+ *     headers has been seen (req->end is then the request length).
+ */
+int http_parse_request(http_request *req, const char *buf, int len)
+{
+    return parse_head(&req->state, &req->line_start, &req->scan, req->headers, &req->nheaders,
+                      &req->end, buf, len, parse_request_line, req);
+}
+
+void http_response_init(http_response *resp)
+{
+    memset(resp, 0, sizeof(http_response));
+    resp->state = STATE_REQUEST_LINE;
+}
+
+/*
+ * http_parse_response - Same as http_parse_request() for a status line
+ *     and response headers.
+ */
+int http_parse_response(http_response *resp, const char *buf, int len)
+{
+    return parse_head(&resp->state, &resp->line_start, &resp->scan, resp->headers, &resp->nheaders,
+                      &resp->end, buf, len, parse_status_line, resp);
+}
+
+/*********************************
+ * Message body framing
+ *********************************/
+/*
+ * http_find_header - Return the first header called name, or NULL
+ */
+const http_header_view *http_find_header(const char *buf, const http_header_view *headers,
+                                         int nheaders, const char *name)
+{
+    int i;
+
+    for (i = 0; i < nheaders; i++)
+        if (http_view_caseeq(buf, headers[i].name, name))
+            return &headers[i];
+    return NULL;
+}
+
+/*
+ * http_find_header_id - Same as http_find_header() by HTTP_HDR_* id
+ */
+const http_header_view *http_find_header_id(const http_header_view *headers, int nheaders, int id)
+{
+    int i;
+
+    for (i = 0; i < nheaders; i++)
+        if (headers[i].id == id)
+            return &headers[i];
+    return NULL;
+}
+
+/*
+ * http_header_has_token - Does a comma-separated header value contain
+ *     token (case-insensitive)? Used for Connection, Cache-Control and
+ *     Transfer-Encoding.
+ */
+int http_header_has_token(const char *buf, http_view value, const char *token)
+{
+    const char *p = buf + value.off, *end = p + value.len, *tend;
+    int tlen = strlen(token);
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        for (tend = p; tend < end && *tend != ',' && *tend != ';' && *tend != '=' && *tend != ' '; tend++)
+            ;
+        if (tend - p == tlen && strncasecmp(p, token, tlen) == 0)
+            return 1;
+        if ((p = http_find_char(tend, end, ',')) == NULL)
+            break;
+    }
+    return 0;
+}
+
+/*
+ * http_message_framing - Decide how the body after these headers ends.
+ *     Returns HTTP_BODY_CHUNKED, HTTP_BODY_LENGTH (with *length set) or
+ *     HTTP_BODY_CLOSE when neither header is present, -1 if the framing
+ *     headers are invalid or conflicting.
+ */
+int http_message_framing(const char *buf, const http_header_view *headers, int nheaders, long *length)
+{
+    const http_header_view *te = NULL;
+    long cl = -1, v;
+    const char *p;
+    int i;
+
+    for (i = 0; i < nheaders; i++) {
+        if (headers[i].id == HTTP_HDR_TRANSFER_ENCODING) {
+            te = &headers[i];
+        } else if (headers[i].id == HTTP_HDR_CONTENT_LENGTH) {
+            if (headers[i].value.len == 0 || headers[i].value.len > 18)
+                return -1;
+            for (v = 0, p = buf + headers[i].value.off; p < buf + headers[i].value.off + headers[i].value.len; p++) {
+                if (*p < '0' || *p > '9')
+                    return -1;
+                v = v * 10 + (*p - '0');
+            }
+            if (cl >= 0 && cl != v)                     /* Conflicting lengths */
+                return -1;
+            cl = v;
+        }
+    }
+
+    /* Transfer-Encoding wins over Content-Length (RFC 9112 6.3) */
+    if (te != NULL) {
+        const char *last = buf + te->value.off + te->value.len;
+        while (last > buf + te->value.off && last[-1] != ',')
+            last--;
+        while (*last == ' ' || *last == '\t')
+            last++;
+        if (buf + te->value.off + te->value.len - last == 7 && strncasecmp(last, "chunked", 7) == 0)
+            return HTTP_BODY_CHUNKED;
+        return HTTP_BODY_CLOSE;
+    }
+    if (cl >= 0) {
+        *length = cl;
+        return HTTP_BODY_LENGTH;
+    }
+    return HTTP_BODY_CLOSE;
+}
+
+/*
+ * http_response_framing - Framing of a response body, taking into
+ *     account responses that never have one (HEAD, 1xx, 204, 304).
+ */
+int http_response_framing(const char *buf, http_response *resp, int head_request, long *length)
+{
+    if (head_request || (resp->status >= 100 && resp->status < 200)
+        || resp->status == 204 || resp->status == 304)
+        return HTTP_BODY_NONE;
+    return http_message_framing(buf, resp->headers, resp->nheaders, length);
+}
+
+/* Chunked decoder states */
+#define CH_SIZE         0
+#define CH_EXT          1
+#define CH_SIZE_LF      2
+#define CH_DATA         3
+#define CH_DATA_CR      4
+#define CH_DATA_LF      5
+#define CH_TRAILER      6
+#define CH_TRAILER_LINE 7
+#define CH_TRAILER_LF   8
+#define CH_DONE         9
+
+void http_chunked_init(http_chunked *c)
+{
+    memset(c, 0, sizeof(http_chunked));
+    c->state = CH_SIZE;
+}
+
+static int hexval(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * http_chunked_scan - Walk chunked-encoded bytes without copying them.
+ *     Returns how many of the len bytes belong to the body (fewer than
+ *     len only when the body ends inside p), or -1 on a framing error.
+ *     c->done is set once the last chunk and trailers have been seen.
+ */
+int http_chunked_scan(http_chunked *c, const char *p, int len)
+{
+    int i = 0, d;
+    long n;
+    const char *nl;
+
+    while (i < len && c->state != CH_DONE) {
+        switch (c->state) {
+        case CH_SIZE:
+            if ((d = hexval(p[i])) >= 0) {
+                if (c->remaining > (0x7fffffffffffL >> 4))
+                    return -1;                          /* Absurd chunk size */
+                c->remaining = c->remaining * 16 + d;
+                c->digits++;
+                i++;
+            } else if (c->digits == 0) {
+                return -1;
+            } else if (p[i] == '\r') {
+                c->state = CH_SIZE_LF;
+                i++;
+            } else if (p[i] == '\n') {
+                c->state = c->remaining ? CH_DATA : CH_TRAILER;
+                i++;
+            } else if (p[i] == ';' || p[i] == ' ' || p[i] == '\t') {
+                c->state = CH_EXT;
+            } else {
+                return -1;
+            }
+            break;
+        case CH_EXT:                                    /* Ignore chunk extensions */
+            if ((nl = http_find_char(p + i, p + len, '\n')) == NULL) {
+                i = len;
+                break;
+            }
+            i = nl - p + 1;
+            c->state = c->remaining ? CH_DATA : CH_TRAILER;
+            break;
+        case CH_SIZE_LF:
+            if (p[i++] != '\n')
+                return -1;
+            c->state = c->remaining ? CH_DATA : CH_TRAILER;
+            break;
+        case CH_DATA:
+            n = len - i < c->remaining ? len - i : c->remaining;
+            i += n;
+            if ((c->remaining -= n) == 0)
+                c->state = CH_DATA_CR;
+            break;
+        case CH_DATA_CR:
+            if (p[i] == '\r') {
+                c->state = CH_DATA_LF;
+                i++;
+                break;
+            }
+            /* fall through: accept a bare LF */
+        case CH_DATA_LF:
+            if (p[i++] != '\n')
+                return -1;
+            c->state = CH_SIZE;
+            c->digits = 0;
+            break;
+        case CH_TRAILER:                                /* Start of a trailer line */
+            if (p[i] == '\r') {
+                c->state = CH_TRAILER_LF;
+                i++;
+            } else if (p[i] == '\n') {
+                c->state = CH_DONE;
+                i++;
+            } else {
+                c->state = CH_TRAILER_LINE;
+            }
+            break;
+        case CH_TRAILER_LINE:
+            if ((nl = http_find_char(p + i, p + len, '\n')) == NULL) {
+                i = len;
+                break;
+            }
+            i = nl - p + 1;
+            c->state = CH_TRAILER;
+            break;
+        case CH_TRAILER_LF:
+            if (p[i++] != '\n')
+                return -1;
+            c->state = CH_DONE;
+            break;
+        }
+    }
+    c->done = (c->state == CH_DONE);
+    return i;
+}
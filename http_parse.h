@@ -0,0 +1,136 @@
+/*
+ * http_parse.h - incremental, zero-copy HTTP/1.x request/response parser
+ *
+ * The parser never copies: every field is returned as an http_view, an
+ * (offset, length) pair into the caller's buffer (normally the rio_t
+ * buffer of the client connection). When the buffer holds only part of
+ * the request, http_parse_request() returns HTTP_PARSE_AGAIN and can be
+ * called again on the same buffer after more bytes are appended.
+ */
+#ifndef __HTTP_PARSE_H__
+#define __HTTP_PARSE_H__
+
+#define HTTP_MAX_HEADERS 64
+
+/* http_parse_request() return values */
+#define HTTP_PARSE_DONE       0     /* Request line and headers complete */
+#define HTTP_PARSE_AGAIN      1     /* Need more bytes */
+#define HTTP_PARSE_ERROR     -1     /* Malformed request */
+#define HTTP_PARSE_TOO_LARGE -2     /* Too many header lines */
+
+typedef struct {
+    int off;                        /* Offset from the start of the buffer */
+    int len;
+} http_view;
+
+/*
+ * Header names the proxy acts on, from http_header_id(). Every header
+ * line is classified once while it is parsed (http_header_view.id).
+ * Adding a name means adding it here and to the table in http_hdrgen.c.
+ */
+#define HTTP_HDR_OTHER              0
+#define HTTP_HDR_HOST               1
+#define HTTP_HDR_CONNECTION         2
+#define HTTP_HDR_PROXY_CONNECTION   3
+#define HTTP_HDR_KEEP_ALIVE         4
+#define HTTP_HDR_USER_AGENT         5
+#define HTTP_HDR_CONTENT_LENGTH     6
+#define HTTP_HDR_TRANSFER_ENCODING  7
+#define HTTP_HDR_CONTENT_TYPE       8
+#define HTTP_HDR_CACHE_CONTROL      9
+#define HTTP_HDR_EXPECT            10
+#define HTTP_HDR_COUNT             11
+
+/*
+ * Perfect hash over the length and the first, middle (len / 2) and last
+ * bytes of the lower-cased name, packed into a word and multiplied.
+ * http_hdrgen searches for a multiplier that gives every known name its
+ * own slot.
+ */
+#define HTTP_HDR_HASH(len, first, mid, last, mul, bits) \
+    ((((unsigned)(len) | (unsigned)(first) << 8 | (unsigned)(mid) << 16 \
+       | (unsigned)(last) << 24) * (mul)) >> (32 - (bits)))
+
+typedef struct {
+    http_view name;
+    http_view value;                /* Leading/trailing blanks trimmed */
+    http_view line;                 /* Whole line including CRLF */
+    int id;                         /* HTTP_HDR_* */
+} http_header_view;
+
+typedef struct {
+    http_view scheme;               /* "http" in absolute-form, else empty */
+    http_view host;                 /* Empty in origin-form */
+    http_view port;                 /* Empty if not given */
+    http_view path;                 /* Path and query, empty if not given */
+} http_uri;
+
+typedef struct {
+    /* Parser state, private */
+    int state;
+    int line_start;                 /* Start of the line being scanned */
+    int scan;                       /* Bytes of the line already scanned */
+
+    /* Results */
+    http_view method, target, version;
+    http_uri uri;
+    http_header_view headers[HTTP_MAX_HEADERS];
+    int nheaders;
+    int end;                        /* Offset just past the blank line */
+} http_request;
+
+typedef struct {
+    /* Parser state, private */
+    int state;
+    int line_start;
+    int scan;
+
+    /* Results */
+    http_view version, reason;
+    int status;
+    http_header_view headers[HTTP_MAX_HEADERS];
+    int nheaders;
+    int end;                        /* Offset just past the blank line */
+} http_response;
+
+/* Body framing, from http_message_framing()/http_response_framing() */
+#define HTTP_BODY_NONE    0         /* No body (HEAD, 1xx, 204, 304) */
+#define HTTP_BODY_LENGTH  1         /* Exactly Content-Length bytes */
+#define HTTP_BODY_CHUNKED 2         /* Transfer-Encoding: chunked */
+#define HTTP_BODY_CLOSE   3         /* Until the sender closes */
+
+/* Incremental chunked-encoding scanner */
+typedef struct {
+    int state;
+    int digits;                     /* Hex digits seen in the size line */
+    long remaining;                 /* Bytes left in the current chunk */
+    int done;                       /* Last chunk and trailers seen */
+} http_chunked;
+
+void http_request_init(http_request *req);
+int http_parse_request(http_request *req, const char *buf, int len);
+int http_parse_uri(const char *buf, http_view target, http_uri *uri);
+
+void http_response_init(http_response *resp);
+int http_parse_response(http_response *resp, const char *buf, int len);
+
+const http_header_view *http_find_header(const char *buf, const http_header_view *headers,
+                                         int nheaders, const char *name);
+const http_header_view *http_find_header_id(const http_header_view *headers, int nheaders, int id);
+int http_header_id(const char *name, int len);
+int http_header_has_token(const char *buf, http_view value, const char *token);
+int http_message_framing(const char *buf, const http_header_view *headers, int nheaders, long *length);
+int http_response_framing(const char *buf, http_response *resp, int head_request, long *length);
+
+void http_chunked_init(http_chunked *c);
+int http_chunked_scan(http_chunked *c, const char *p, int len);
+
+/* Helpers on views */
+int http_view_eq(const char *buf, http_view v, const char *s);
+int http_view_caseeq(const char *buf, http_view v, const char *s);
+int http_view_copy(const char *buf, http_view v, char *dst, int dstlen);
+
+/* Vectorized scanning primitive, exported for the benchmarks */
+const char *http_find_char(const char *p, const char *end, char c);
+
+#endif /* __HTTP_PARSE_H__ */
@@ -1,240 +1,1352 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <poll.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
+#include "http_parse.h"
+#include "hdr_hist.h"
+#include "alog.h"
+#include "cache.h"
+
+// splice는 _GNU_SOURCE로만 선언되는데, 그러면 csapp.h의 gai_error가 glibc 선언과 충돌해서 직접 선언
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE     1
+#define SPLICE_F_NONBLOCK 2
+ssize_t splice(int fd_in, long *off_in, int fd_out, long *off_out, size_t len, unsigned int flags);
+#endif
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
 /* You won't lose style points for including this long line in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *conn_hdr = "Connection: close\r\n";
-static const char *prox_hdr = "Proxy-Connection: close\r\n";
-static const char *host_hdr_format = "Host: %s\r\n";
-static const char *requestline_hdr_format = "GET %s HTTP/1.0\r\n";
-static const char *endof_hdr = "\r\n";
-
-/* Header search key */
-static const char *host_key = "Host";
-static const char *connection_key = "Connection";
-static const char *proxy_connection_key = "Proxy-Connection";
-static const char *user_agent_key = "User-Agent";
+static const char user_agent_hdr[] = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char conn_hdr[] = "Connection: close\r\n";
+static const char conn_keep_alive_hdr[] = "Connection: keep-alive\r\n";
+static const char prox_hdr[] = "Proxy-Connection: close\r\n";
+static const char endof_hdr[] = "\r\n";
+
+/* iovec으로 보낼 때 쓰는 고정 조각 (요청 줄과 Host 헤더를 client 버퍼의 view 사이에 끼움) */
+static const char requestline_version[] = " HTTP/1.0\r\n";
+static const char requestline_version_11[] = " HTTP/1.1\r\n";   // chunked 본문은 HTTP/1.1로만 보낼 수 있음
+static const char continue_hdr[] = "HTTP/1.1 100 Continue\r\n\r\n";
+static const char connect_established_hdr[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+static const char host_hdr_prefix[] = "Host: ";
+#define MAX_HDR_IOV (HTTP_MAX_HEADERS + 16)         // build_http_header가 만드는 iovec 최대 갯수
 
 /* end server info */
 static const char *end_server_host = "localhost";   // end server의 hostname은 현재 localhost
 static const int end_server_port = 52185;           // proxy 서버의 소켓 번호 +1
 
 /* functions */
-void doit(int fd);
+void doit(int fd, long id, long t_accept);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
-void parse_uri(char *uri, char *host, int *port, char *path);
-void build_http_header(char *http_header, char *hostname, char *path, rio_t *client_rio);
+int read_request(rio_t *rp, http_request *req);
+int parse_uri(const char *buf, http_uri *uri, char *host, int *port, char *path);
+int build_http_header(struct iovec *iov, char *hostname, const char *reqbuf, http_request *req, int chunked);
+
+/** iovec 한 칸 채우기 */
+static inline void iov_push(struct iovec *iov, int *cnt, const void *base, size_t len) {
+  iov[*cnt].iov_base = (void *)base;
+  iov[*cnt].iov_len = len;
+  (*cnt)++;
+}
+
+/* for response relay */
+#define RELAY_BAD_GATEWAY -1                // 응답 헤더를 읽지 못함 (client에 아직 보낸 것 없음)
+#define RELAY_ABORTED     -2                // 본문 도중에 끊기거나 framing 오류
+
+typedef struct {
+  int status;                               // 응답 status code
+  int cacheable;                            // 헤더만 보고 정하고, 너무 크거나 끝까지 못 받으면 0
+  int is_html;                              // Content-Type: text/html
+  int conn_off;                             // cache_buf에서 Connection 헤더를 끼울 위치
+  int hdr_len;                              // cache_buf의 응답 헤더 바이트 수 (본문 시작 위치)
+  long size;                                // cache_buf 기준 응답 전체 바이트 수
+  long first_byte;                          // 응답 첫 바이트를 받은 시각 (stats_now)
+} relay_result;
+
+/* for flow control */
+// 방향마다 고정 크기 버퍼: 받는 쪽이 느려 high watermark까지 쌓이면 보내는 쪽 소켓을 읽지 않고,
+// low watermark 아래로 비워지면 다시 읽음. 연결당 메모리는 client 속도와 상관없이 버퍼 크기로 묶임
+#define FLOW_BUF_SIZE 65536                 // 응답 본문 relay 버퍼, 터널 pipe 용량
+#define FLOW_HIGH_WATER (FLOW_BUF_SIZE * 3 / 4)
+#define FLOW_LOW_WATER (FLOW_BUF_SIZE / 4)
+
+typedef struct {
+  char *data;                               // pool에서 빌린 FLOW_BUF_SIZE 버퍼
+  size_t off, len;                          // 아직 보내지 않은 바이트 [off, off + len)
+  int paused;                               // high watermark를 넘어서 읽기를 멈춤
+} flow_buf;
+
+/* for per-connection memory */
+#define CONN_STACK_SIZE (256 * 1024)        // 연결 쓰레드 스택 (큰 버퍼는 스택에 두지 않음)
+#define POOL_CLASSES 7
+#define POOL_MAX_FREE 256                   // class마다 다시 쓰려고 남겨 두는 버퍼 수
+
+// 버퍼 pool: 크기 class마다 빈 버퍼 목록, 가장 큰 class보다 크면 바로 malloc/free
+typedef struct pool_buf {
+  struct pool_buf *next;
+} pool_buf;
+
+typedef struct {
+  pool_buf *free_list[POOL_CLASSES];
+  int nfree[POOL_CLASSES];
+  sem_t mutex[POOL_CLASSES];
+  long in_use;                              // 빌려 간 바이트 (class 크기 기준)
+  long idle;                                // 빈 목록에 있는 바이트
+} buf_pool;
+
+// 필요할 때 pool에서 빌리고 모자라면 더 큰 class로 옮기는 버퍼
+typedef struct {
+  char *data;
+  size_t cap;                               // 0이면 아직 빌리지 않음
+} grow_buf;
+
+void pool_init();
+void *pool_get(size_t size, size_t *cap);   // size 이상인 class의 버퍼, *cap에 실제 크기
+void pool_put(void *buf, size_t cap);
+void grow_buf_reserve(grow_buf *b, size_t need);  // need 바이트 이상이 되도록 키움 (내용은 유지)
+void grow_buf_release(grow_buf *b);
+void conn_report(void);                     // 연결당 메모리 사용량을 시작할 때 한 번 출력
+
+buf_pool pool;
+long conn_active = 0;                       // 지금 처리 중인 client 연결 수
+
+/* for timeouts */
+// 만료되면 타이머 쓰레드가 소켓을 shutdown해서, 그 소켓에서 막혀 있던 연결 쓰레드가 에러로 깨어나 정리함
+#define HEADER_TIMEOUT 10000                // (ms) 새 연결이나 요청 첫 바이트부터 요청 헤더 끝까지
+#define IDLE_TIMEOUT 15000                  // keep-alive 연결이 다음 요청을 기다리는 시간
+#define LINGER_TIMEOUT 1000                 // (ms) 닫기 전에 client가 더 보낸 바이트를 읽어 버리는 시간 한도
+#define CONNECT_TIMEOUT 5000                // end server 연결 (주소마다)
+#define FIRST_BYTE_TIMEOUT 30000            // end server에 요청을 보내고 응답 헤더가 다 올 때까지
+#define TRANSFER_TIMEOUT 300000             // 요청 본문 또는 응답 본문 전체를 주고받는 시간
+
+#define TIMER_TICK_MS 100                   // 타이머 휠 한 칸의 시간
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS) // 단계마다 칸 수
+#define TIMER_LEVELS 4                      // 단계 l의 칸 하나는 64^l tick (최대 약 19일)
+
+typedef struct timer_node {
+  struct timer_node *next, *prev;           // 칸마다 원형 이중 연결 리스트 (next가 NULL이면 걸려 있지 않음)
+  unsigned long expires;                    // 만료 tick
+  int fd;                                   // 만료되면 shutdown할 소켓
+  int how;                                  // SHUT_RD: 읽기만 깨움 (에러 응답은 보낼 수 있음), SHUT_RDWR: 쓰기도
+  int fired;                                // 만료되어 shutdown함
+  const char *what;                         // 만료 로그에 쓸 이름
+} timer_node;
+
+typedef struct {
+  timer_node slots[TIMER_LEVELS][TIMER_SLOTS]; // 칸마다 리스트 머리
+  unsigned long now;                        // 다음에 처리할 tick
+  long expired;                             // 만료된 타이머 수
+  sem_t mutex;
+} timer_wheel;
+
+void timer_init();                          // 타이머 휠과 tick 쓰레드 생성
+void timer_arm(timer_node *t, int fd, int how, int ms, const char *what); // ms 뒤에 fd를 shutdown (이미 걸려 있으면 다시 검)
+int timer_cancel(timer_node *t);            // 만료되었으면 1, 돌아온 뒤에는 fd를 건드리지 않으므로 닫아도 됨
+int timer_fired(timer_node *t);             // 이미 만료되어 shutdown했으면 1 (걸어 둔 채로)
+void timer_add(timer_node *t);              // mutex를 잡고 호출
+void timer_tick();
+void *timer_thread(void *vargp);
+
+timer_wheel wheel;
+
+int relay_response(rio_t *srv, int clientfd, int head_request, int *keep_alive, grow_buf *cache_buf, relay_result *res, timer_node *timer);
+static long relay_body_take(const char *p, long n, int framing, long *length, http_chunked *chunked, int *done);
 int connect_endServer(char *hostname, int port);
 // for thread
 void *thread(void *vargp);
 
-/* for cache */
-#define TOTAL_CACHE_BLOCK_NUM 10            // cache에 저장 가능한 블록의 총 갯수
-#define LRU_MAX_NUMBER 9999                 // 새로 채운 블록의 초기 우선순위
+/* for pipelining */
+#define MAX_PIPELINE 16                    // 한 번에 받아서 처리하는 pipelined 요청의 최대 수
 
-void cache_init();                          // cache 초기화
-int cache_find(char *uri);                  // cache에 있는지 찾고 정보를 받아오기
-void cache_uri(char *uri, char *buf);       // buf를 새로 cache에 추가 
-void cache_LRU(int index);                  // index 이외의 캐쉬의 LRU 값을 내리기
-int cache_eviction();                       // 비어 있거나 우선순위가 가장 낮은 cache 블록 인덱스 찾기
+/* 처리하는 method */
+#define METHOD_GET  0
+#define METHOD_HEAD 1                       // 캐쉬에 있으면 저장된 응답 헤더만 보냄
+#define METHOD_POST 2                       // 본문을 end server로 흘려보내고 캐쉬를 지움
+#define METHOD_PUT  3
+#define METHOD_CONNECT 4                    // 이후 연결은 end server와 양방향 터널
 
-void read_before(int i);
-void read_after(int i);
-void write_before(int i);
-void write_after(int i);
+typedef struct {
+  const char *base;                         // req의 view 기준 위치 (client rio 버퍼 안)
+  char *uri;                                // 캐쉬 key (에러 응답이면 에러 원인)
+  int method;
+  int keep_alive;                           // 응답 후 client 연결을 유지할지
+  int body_framing;                         // 요청 본문 framing (HTTP_BODY_NONE/LENGTH/CHUNKED)
+  long body_length;                         // HTTP_BODY_LENGTH일 때 본문 바이트 수
+  int expect_continue;                      // client가 "Expect: 100-continue"를 보냄
+  int stats;                                // STATS_PATH 요청 (end server로 보내지 않음)
+  long t_lookup, t_connected;               // 캐쉬 조회, end server 연결과 요청 전송이 끝난 시각
+  cache_obj *hit;                           // 캐쉬 적중이면 참조를 잡아둔 객체
+  int endserver_fd;                         // 캐쉬 미스면 요청을 이미 보낸 end server 연결
+  rio_t *endserver_rio;
+  char *errnum, *shortmsg, *longmsg;        // 처리할 수 없으면 보낼 에러
+  http_request req;                         // 여기부터는 파싱할 때 초기화
+} pipeline_req;
 
+// 연결 하나의 상태: 쉬는 keep-alive 연결은 버퍼를 모두 pool에 돌려주고 이 구조체만 남음
 typedef struct {
-  char cache_uri[MAXLINE];              // 캐쉬한 uri
-  char cache_object[MAX_OBJECT_SIZE];   // 캐쉬 내용
-  int LRU;                              // 우선순위 (낮은게 오래 전에 추가된 캐쉬 블록)
-  int is_empty;                         // 1: 빈 캐쉬 블록, 0: 채워진 캐쉬 블록
+  int fd;
+  rio_t *rio;                               // 요청이 오면 pool에서 빌리고, 버퍼가 비면 돌려줌
+  size_t rio_cap;
+  pipeline_req *batch;                      // 한 번에 온 요청 수만큼 늘림 (최대 MAX_PIPELINE)
+  size_t batch_cap;
+  int batch_max;                            // batch에 들어가는 요청 수
+  timer_node timer;                         // client 소켓: 요청 헤더, keep-alive 대기, 본문과 응답 전송
+  timer_node origin_timer;                  // 지금 본문을 보내거나 응답을 받는 end server 소켓
+  long id;                                  // 연결 번호 (로그)
+  int shard;                                // 통계를 기록할 stats shard
+  long t_start;                             // 이번 batch의 첫 바이트가 온 시각 (새 연결이면 accept)
+  long t_parsed;                            // 이번 batch의 헤더 파싱이 끝난 시각
+} client_conn;
+
+int read_pipeline(client_conn *c);                      // 버퍼에 와 있는 요청들을 파싱
+int request_framing(const char *base, http_request *req, long *length);
+int request_has_body(const char *base, http_request *req);
+int request_ends_batch(const char *base, http_request *req); // 이 요청 뒤의 바이트는 바로 파싱할 수 없음
+int client_keep_alive(const char *base, http_request *req);
+void dispatch_request(pipeline_req *p);                 // 캐쉬 조회 또는 end server에 요청 전송
+int forward_request_body(rio_t *rp, pipeline_req *p, int send_continue); // 요청 본문을 고정 크기 버퍼로 전달
+int respond_pipeline(client_conn *c, int n);            // 요청 순서대로 응답
+
+/* for stats */
+#define STATS_PATH "/__proxy/metrics"       // 이 경로의 GET은 end server로 보내지 않고 통계를 Prometheus text 형식으로 답함
+#define STATS_SHARDS 8                      // 연결마다 하나를 골라 atomic 더하기로만 기록 (lock 없음)
+
+// 요청 하나의 구간, 시각은 모두 CLOCK_MONOTONIC ns
+#define PHASE_PARSE 0                       // 첫 바이트(새 연결이면 accept)부터 헤더 파싱까지, pipelined batch마다 한 번
+#define PHASE_LOOKUP 1                      // 파싱 후 캐쉬 조회까지
+#define PHASE_CONNECT 2                     // 캐쉬 조회 후 end server 연결과 요청 전송까지
+#define PHASE_FIRST_BYTE 3                  // 요청 전송 후 응답 첫 바이트를 읽을 때까지 (앞 요청의 응답을 보내는 시간 포함)
+#define PHASE_TRANSFER 4                    // 응답 첫 바이트부터 client에 마지막 바이트를 쓸 때까지
+#define PHASE_TOTAL_HIT 5                   // 첫 바이트부터 응답 마지막 바이트까지
+#define PHASE_TOTAL_MISS 6
+#define PHASES 7
 
-  int read_cnt;
-  sem_t read_cnt_mutex;
-  sem_t write_mutex;
-} cache_block;
+typedef struct {
+  long hits, misses, errors;                // 끝까지 응답한 요청 수, proxy가 보낸 에러 응답 수
+  long bytes;                               // client에 보낸 응답 바이트
+  long connections;                         // 받은 연결 수
+  hdr_hist phase[PHASES];
+} stats_shard;
 
 typedef struct {
-  cache_block blocks[TOTAL_CACHE_BLOCK_NUM];
-} cache_struct;
+  int fd;
+  long id;
+  long t_accept;
+} conn_arg;                                 // main이 연결 쓰레드에 넘기는 값
+
+#define STATS_ADD(shard, field, n) __atomic_fetch_add(&stats[shard].field, (n), __ATOMIC_RELAXED)
+
+void stats_init();
+static inline long stats_now() {            // vDSO라서 시스템 콜 없음
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+// 요청이 끝나면 구간을 기록하고 access log에 남김
+void stats_hits(client_conn *c, int from, int to); // writev로 보낸 캐쉬 적중 batch[from, to)
+void stats_miss(client_conn *c, pipeline_req *p, relay_result *res); // end server 응답을 끝까지 보낸 요청
+void stats_error(client_conn *c, pipeline_req *p, const char *errnum); // proxy가 보낸 에러 응답
+static void stats_log(client_conn *c, pipeline_req *p, int level, int event, int status, long bytes, long now, relay_result *res);
+int respond_stats(int fd, int keep_alive);  // 모든 shard를 합쳐서 응답
+
+stats_shard stats[STATS_SHARDS];
+long conn_seq = 0;                          // 다음 연결 번호, main만 씀
 
-cache_struct cache;                         // 전역변수로 캐쉬 선언
+/* for CONNECT tunnel */
+#define TUNNEL_IDLE_TIMEOUT 60              // 양쪽 모두 이 시간(초) 동안 오가는 바이트가 없으면 터널을 닫음
+#define TUNNEL_PIPE_SIZE FLOW_BUF_SIZE      // 방향마다 pipe에 담아둘 최대 바이트 (pipe 기본 용량)
+
+typedef struct {
+  int from, to;                             // from에서 읽어서 to로 씀
+  int pipefd[2];                            // splice로 커널 안에서만 옮기는 중간 pipe
+  size_t pending;                           // pipe에 들어 있는 바이트
+  int paused;                               // pending이 FLOW_HIGH_WATER를 넘어서 from을 읽지 않음
+  long bytes;                               // 전달한 바이트 합
+  int eof;                                  // from에서 EOF를 받음
+  int done;                                 // pipe를 비우고 to 쪽 쓰기를 닫음 (half-close)
+} tunnel_dir;
+
+void tunnel(rio_t *rp, int serverfd, long id, const char *host); // client 버퍼에 남은 바이트를 보내고 양방향 relay
+int tunnel_pump(tunnel_dir *d);             // 한 방향으로 옮길 수 있는 만큼 splice
+
+/* for prefetch */
+#define PREFETCH_QUEUE_SIZE 64                        // 대기할 수 있는 prefetch 요청의 최대 갯수
+#define PREFETCH_DEFAULT_WORKERS 2                    // 동시에 진행하는 prefetch 수의 기본값
+#define PREFETCH_DEFAULT_BUDGET (MAX_CACHE_SIZE / 2)  // 아직 쓰이지 않은 prefetch 객체가 차지할 수 있는 바이트 수의 기본값
+
+void prefetch_init(int workers, long budget);         // prefetch 큐와 worker 쓰레드 생성
+void prefetch_scan(char *uri, char *body, int len);   // html 본문에서 같은 origin의 src/href를 찾아 큐에 넣기
+int prefetch_resolve(char *base, char *ref, char *out); // base uri 기준으로 ref를 절대 uri로 바꾸기 (다른 origin이면 0)
+void prefetch_enqueue(char *uri);                     // 큐가 차 있으면 버리고 돌아옴
+void prefetch_fetch(char *uri);                       // end server에서 받아와 캐쉬에 채우기
+void prefetch_used(cache_obj *obj);                   // prefetch된 블록이 처음 쓰였을 때 (cache_hook)
+void prefetch_evicted(cache_obj *obj);                // prefetch된 블록이 쓰이지 않고 지워질 때 (cache_hook)
+void prefetch_report(grow_buf *body, size_t *len);  // prefetch 통계를 metrics 응답에 덧붙임
+void *prefetch_thread(void *vargp);
+
+typedef struct {
+  char *items[PREFETCH_QUEUE_SIZE];     // prefetch할 uri (원형 큐)
+  int front, rear;
+  sem_t mutex, slots, items_cnt;
+} prefetch_queue;
+
+typedef struct {
+  long issued;                          // 큐에 넣은 요청 수
+  long dropped;                         // 큐나 예산이 부족해서 버린 요청 수
+  long fetched;                         // 캐쉬에 채운 객체 수
+  long hits;                            // prefetch된 객체가 클라이언트 요청에 쓰인 수
+  long wasted;                          // 한 번도 쓰이지 않고 evict된 객체 수
+  long bytes;                           // prefetch로 받아온 총 바이트
+  long outstanding;                     // 아직 쓰이지 않은 prefetch 객체의 바이트 (예산과 비교)
+  long budget;
+  sem_t mutex;
+} prefetch_stats;
+
+int prefetch_enabled = 0;
+prefetch_queue pf_queue;
+prefetch_stats pf_stats;
+
+/* for cache snapshot */
+#define SNAPSHOT_MAGIC "PXYSNAP2"           // 스냅샷 파일 맨 앞 8바이트 (객체 형식이 바뀌면 번호를 올림)
+#define SNAPSHOT_SIGNAL SIGUSR1             // 이 시그널을 받으면 스냅샷 저장
+
+// 파일 구조: snapshot_header, 이어서 블록마다 snapshot_entry + uri + object
+typedef struct {
+  char magic[8];
+  unsigned int count;                   // entry 갯수
+  unsigned int reserved;
+} snapshot_header;
+
+typedef struct {
+  unsigned int uri_len;
+  unsigned int size;                    // object 바이트 수
+  unsigned int conn_off;                // cache_obj의 conn_off
+} snapshot_entry;
+
+typedef struct {
+  char *uri;                            // mmap된 파일 안을 가리킴 ('\0'으로 끝나지 않음)
+  unsigned int uri_len;
+  char *object;
+  unsigned int size;
+  unsigned int conn_off;
+  int restored;                         // 1: 이미 캐쉬로 옮겼거나 옮기는 중
+} snapshot_index;
+
+void snapshot_block_signal();               // 모든 쓰레드에서 SNAPSHOT_SIGNAL을 막기 (main 맨 처음, 쓰레드 생성 전에 호출)
+void snapshot_start(char *path);            // 시그널을 기다리는 스냅샷 쓰레드 생성
+int snapshot_save(char *path);              // 캐쉬 인덱스와 객체를 파일로 저장
+int snapshot_load(char *path);              // 스냅샷 파일을 mmap (인덱스는 처음 찾을 때 만듦)
+void snapshot_build_index();
+int snapshot_take(char *uri);               // 아직 옮기지 않은 uri의 entry를 옮긴 것으로 표시하고 index 반환
+int snapshot_restore(char *uri);            // 스냅샷에 있는 uri면 캐쉬로 옮기고 1
+void *snapshot_thread(void *vargp);
+
+char *snap_map = NULL;                      // mmap된 스냅샷 파일
+size_t snap_map_size;
+snapshot_index *snap_index;
+int snap_count;
+pthread_once_t snap_index_once = PTHREAD_ONCE_INIT;
+sem_t snap_mutex;
 
 
 int main(int argc, char **argv) {
-    int listenfd, *connfdp;
+    int listenfd;
+    conn_arg *arg;
     socklen_t clientlen;
-    char clienthost[MAXLINE], clientport[MAXLINE];
+    char clienthost[MAXLINE], clientport[MAXLINE], clientname[2 * MAXLINE];
     struct sockaddr_storage clientaddr;
     pthread_t tid;
+    pthread_attr_t attr;
+    int opt, prefetch_workers = 0, log_level = ALOG_INFO, log_sample = 1, log_binary = 0, log_fd = STDOUT_FILENO, capture_fd = -1;
+    long prefetch_budget = PREFETCH_DEFAULT_BUDGET;
+    char *snapshot_path = NULL;
 
+    snapshot_block_signal();                                            // 어떤 쓰레드보다 먼저 (timer, alog 쓰레드도 막힌 mask를 물려받아야 SIGUSR1에 죽지 않음)
     cache_init();
+    pool_init();
+    timer_init();
+    stats_init();
+    Signal(SIGPIPE, SIG_IGN);                                           // 끊긴 client에 쓰면 종료하지 않고 EPIPE
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "P:B:s:L:S:l:bj:")) != -1) {
+        switch (opt) {
+        case 's':                                                       // 캐쉬 스냅샷 파일
+            snapshot_path = optarg;
+            break;
+        case 'P':                                                       // 동시 prefetch 수 (0이면 끔)
+            prefetch_workers = atoi(optarg);
+            break;
+        case 'B':                                                       // prefetch 바이트 예산
+            prefetch_budget = atol(optarg);
+            break;
+        case 'L':                                                       // 이 level까지만 로그
+            if ((log_level = alog_parse_level(optarg)) < 0) {
+                fprintf(stderr, "%s: unknown log level %s\n", argv[0], optarg);
+                exit(1);
+            }
+            break;
+        case 'S':                                                       // 요청 로그(INFO)는 n개 중 하나만
+            log_sample = atoi(optarg);
+            break;
+        case 'l':                                                       // 로그 파일 (기본은 stdout)
+            if ((log_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+                fprintf(stderr, "%s: %s: %s\n", argv[0], optarg, strerror(errno));
+                exit(1);
+            }
+            break;
+        case 'b':                                                       // 로그를 형식화하지 않고 alog_rec 그대로 (bench/logcat으로 읽음)
+            log_binary = 1;
+            break;
+        case 'j':                                                       // 요청마다 JSON 한 줄 (bench/replay로 재생)
+            if ((capture_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+                fprintf(stderr, "%s: %s: %s\n", argv[0], optarg, strerror(errno));
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-P <prefetch workers>] [-B <prefetch bytes>] [-s <snapshot file>] "
+                    "[-L error|warn|info|debug] [-S <log 1 in n requests>] [-l <log file>] [-b] [-j <capture file>] <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: %s [-P <prefetch workers>] [-B <prefetch bytes>] [-s <snapshot file>] "
+                    "[-L error|warn|info|debug] [-S <log 1 in n requests>] [-l <log file>] [-b] [-j <capture file>] <port>\n", argv[0]);
         exit(1);
     }
 
-    listenfd = Open_listenfd(argv[1]);                                  // 지정한 포트 번호로 듣기 식별자 생성
+    alog_init(log_level, log_sample, log_binary, log_fd, capture_fd);
+
+    if (snapshot_path != NULL) {                                        // 듣기 전에 이전 스냅샷을 올려두기
+        if (snapshot_load(snapshot_path) == 0) {
+            printf("Loaded cache snapshot %s (%lu bytes)\n", snapshot_path, (unsigned long)snap_map_size);
+            cache_hook.miss = snapshot_restore;                         // 캐쉬에 없으면 스냅샷에서 옮겨옴
+            cache_hook.invalidate = snapshot_take;                      // 바뀐 uri는 스냅샷에서도 다시 올리지 않음
+        }
+        snapshot_start(snapshot_path);
+    }
+
+    if (prefetch_workers > 0)
+        prefetch_init(prefetch_workers, prefetch_budget);
+
+    // 연결 쓰레드는 작은 스택으로 (기본 8MB는 연결이 많으면 주소 공간과 커밋 한도를 다 씀)
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CONN_STACK_SIZE);
+    conn_report();
+
+    listenfd = Open_listenfd(argv[optind]);                             // 지정한 포트 번호로 듣기 식별자 생성
     
     while (1) {
         clientlen = sizeof(clientaddr);
-        connfdp = Malloc(sizeof(int));                                  // 경쟁상태 회피하기 위해 동적 할당
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        
-        Getnameinfo((SA *)&clientaddr, clientlen, clienthost, MAXLINE, clientport, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", clienthost, clientport);
+        arg = Malloc(sizeof(conn_arg));                                 // 경쟁상태 회피하기 위해 동적 할당
+        arg->fd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        arg->id = conn_seq++;
+        arg->t_accept = stats_now();
+
+        if (alog_enabled(ALOG_DEBUG)) {                                 // 이름 조회(DNS)는 하지 않음
+            Getnameinfo((SA *)&clientaddr, clientlen, clienthost, MAXLINE, clientport, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV);
+            snprintf(clientname, sizeof(clientname), "%s:%s", clienthost, clientport);
+            alog_write(ALOG_DEBUG, ALOG_EV_ACCEPT, arg->id, 0, 0, 0, 0, clientname);
+        }
 
-        Pthread_create(&tid, NULL, thread, connfdp);
+        Pthread_create(&tid, &attr, thread, arg);
     }
     return 0;
 }
 
 /** 쓰레드 루틴 */
 void *thread(void *vargp) {
-    int connfd = *(int *)vargp;
+    int connfd = ((conn_arg *)vargp)->fd, one = 1;
+    long id = ((conn_arg *)vargp)->id, t_accept = ((conn_arg *)vargp)->t_accept;
     Pthread_detach(pthread_self());
     Free(vargp);
-    doit(connfd);
+
+    // 응답은 헤더와 본문을 따로 쓰므로, Nagle이 켜져 있으면 keep-alive client의 delayed ACK(약 40ms)를 기다리게 됨
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    __atomic_add_fetch(&conn_active, 1, __ATOMIC_RELAXED);          // 지금 쓰는 버퍼와 함께 /__proxy/metrics에서 봄
+    doit(connfd, id, t_accept);
+    __atomic_sub_fetch(&conn_active, 1, __ATOMIC_RELAXED);
     Close(connfd);
     return NULL;
 }
 
-/** 한 개의 HTTP 트랜잭션을 처리 */
-void doit(int fd) {
-    int endserver_fd;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char endserver_http_header[MAXLINE];
-    char hostname[MAXLINE], path[MAXLINE];
-    int port;
+static void conn_linger(int fd);
+
+/** client 연결 하나의 HTTP 트랜잭션들을 처리 (keep-alive, pipelining) */
+// 버퍼에 이미 와 있는 요청들을 한꺼번에 파싱해서 캐쉬 조회와 end server 요청을 모두 먼저 시작하고,
+// 응답은 요청 순서대로 보냄. 연속된 캐쉬 적중은 writev 한 번으로 보냄
+// 요청을 기다리는 동안에는 poll로만 기다리고 rio 버퍼와 batch는 pool에 돌려줌
+// client 소켓에는 항상 타이머 하나: 기다리는 동안 HEADER/IDLE_TIMEOUT, 첫 바이트부터 HEADER_TIMEOUT,
+// 요청 헤더를 다 받으면 TRANSFER_TIMEOUT. 헤더를 조금씩 보내며 버티는 client도 HEADER_TIMEOUT에 끊김
+void doit(int fd, long id, long t_accept) {
+    client_conn c;
+    pipeline_req *batch;
+    struct pollfd pfd;
+    int i, n, consumed, keep_alive = 1;
+
+    memset(&c, 0, sizeof(c));
+    c.fd = fd;
+    c.id = id;
+    c.shard = id % STATS_SHARDS;
+    c.t_start = t_accept;
+    STATS_ADD(c.shard, connections, 1);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    timer_arm(&c.timer, fd, SHUT_RD, HEADER_TIMEOUT, "request header");
+
+    while (keep_alive) {
+        if (c.rio == NULL) {                                        // 쉬던 연결: 바이트가 올 때 버퍼를 빌림
+            while (poll(&pfd, 1, -1) < 0)
+                if (errno != EINTR)
+                    goto done;
+            if (timer_cancel(&c.timer))                             // 기다리다 만료 (shutdown으로 깨어남)
+                break;
+            timer_arm(&c.timer, fd, SHUT_RD, HEADER_TIMEOUT, "request header");
+            if (c.t_start == 0)
+                c.t_start = stats_now();
+            c.rio = pool_get(sizeof(rio_t), &c.rio_cap);
+            Rio_readinitb(c.rio, fd);
+        }
+        if ((n = read_pipeline(&c)) == 0)
+            break;
+        c.t_parsed = stats_now();
+        hdr_record_atomic(&stats[c.shard].phase[PHASE_PARSE], c.t_parsed - c.t_start);
+        timer_arm(&c.timer, fd, SHUT_RDWR, TRANSFER_TIMEOUT, "client transfer");
+        batch = c.batch;
+        for (i = 0; i < n; i++)                                     // 캐쉬 조회, end server 연결과 요청 전송
+            dispatch_request(&batch[i]);
+
+        consumed = batch[n - 1].base + batch[n - 1].req.end - c.rio->rio_bufptr;
+        c.rio->rio_bufptr += consumed;                              // 요청 헤더들을 버퍼에서 소비 (view는 더 쓰지 않음)
+        c.rio->rio_cnt -= consumed;
+
+        // 본문이 있는 요청은 항상 batch의 마지막, 앞 요청의 응답이 있으면 100 Continue를 먼저 보낼 수 없음
+        if (batch[n - 1].body_framing != HTTP_BODY_NONE && batch[n - 1].errnum == NULL) {
+            timer_arm(&c.origin_timer, batch[n - 1].endserver_fd, SHUT_RDWR, TRANSFER_TIMEOUT, "request body");
+            forward_request_body(c.rio, &batch[n - 1], n == 1);
+            timer_cancel(&c.origin_timer);
+        }
+
+        keep_alive = respond_pipeline(&c, n);                       // 요청 순서대로 응답
+
+        if (c.rio->rio_cnt == 0) {                                  // 다음 요청이 아직 오지 않았으면 버퍼를 돌려줌
+            pool_put(c.rio, c.rio_cap);
+            pool_put(c.batch, c.batch_cap);
+            c.rio = NULL;
+            c.batch = NULL;
+            c.batch_max = 0;
+            c.t_start = 0;                                          // 다음 요청의 첫 바이트가 오면 잼
+            timer_arm(&c.timer, fd, SHUT_RD, IDLE_TIMEOUT, "keep-alive idle");
+        } else {
+            c.t_start = stats_now();                                // 다음 요청이 이미 버퍼에 와 있음
+            timer_arm(&c.timer, fd, SHUT_RD, HEADER_TIMEOUT, "request header");
+        }
+    }
+    if (!keep_alive)                                                // proxy가 닫기로 함 (에러 응답 등)
+        conn_linger(fd);
+done:
+    timer_cancel(&c.timer);                                         // thread가 fd를 닫기 전에
+    if (c.rio != NULL)
+        pool_put(c.rio, c.rio_cap);
+    if (c.batch != NULL)
+        pool_put(c.batch, c.batch_cap);
+}
 
-    rio_t rio, endserver_rio;
+/** 쓰기만 닫고 client가 이미 보낸 바이트를 LINGER_TIMEOUT 동안 읽어 버림 */
+// 읽지 않은 바이트가 남은 채로 닫으면 커널이 RST를 보내고, client는 아직 읽지 않은 마지막 응답(400 등)을 잃음
+static void conn_linger(int fd) {
+    char buf[4096];
+    struct pollfd pfd;
+    long n, left, deadline = stats_now() + LINGER_TIMEOUT * 1000000L;
 
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
-        
-    if (strcasecmp(method, "GET")) {                // GET method만 처리
-        clienterror(fd, method, "501", "Not implemented", "Proxy does not implement this method");
+    if (shutdown(fd, SHUT_WR) < 0)
         return;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while ((left = (deadline - stats_now()) / 1000000L) > 0) {
+        if ((n = poll(&pfd, 1, left)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        if ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+            break;                                                  // client도 닫았거나 연결 에러
+    }
+}
+
+/** batch에 요청 하나가 더 들어가도록 키움 */
+static void conn_grow_batch(client_conn *c) {
+    size_t cap, want = (c->batch_max ? 2 * c->batch_max : 1) * sizeof(pipeline_req);
+    pipeline_req *batch = pool_get(want, &cap);
+
+    if (c->batch != NULL) {
+        memcpy(batch, c->batch, c->batch_max * sizeof(pipeline_req));
+        pool_put(c->batch, c->batch_cap);
     }
+    c->batch = batch;
+    c->batch_cap = cap;
+    c->batch_max = cap / sizeof(pipeline_req);
+}
+
+/** 첫 요청은 다 올 때까지 읽고, 그 뒤로 버퍼에 이미 와 있는 요청만큼 이어서 파싱 */
+// 반환값: 파싱한 요청 수 (0이면 연결 종료). 파싱 오류는 에러 응답을 보낼 요청으로 반환
+int read_pipeline(client_conn *c) {
+    rio_t *rp = c->rio;
+    pipeline_req *batch;
+    int n = 0, off, rc;
+
+    if (c->batch_max == 0)
+        conn_grow_batch(c);
+    batch = c->batch;
 
-    // 캐쉬 확인 절차
-    char uri_copy[100];
-    strcpy(uri_copy, uri);
+    memset(&batch[0], 0, offsetof(pipeline_req, req));
+    batch[0].endserver_fd = -1;
+    if ((rc = read_request(rp, &batch[0].req)) == 0)
+        return 0;
+    batch[0].base = rp->rio_bufptr;
+    if (rc < 0 && timer_cancel(&c->timer)) {                        // 헤더를 HEADER_TIMEOUT 안에 다 보내지 않음 (읽기만 닫혔음)
+        batch[0].errnum = "408";
+        batch[0].shortmsg = "Request Timeout";
+        batch[0].longmsg = "Proxy timed out waiting for the request header";
+        batch[0].req.end = rp->rio_cnt;
+        return 1;
+    }
+    if (rc < 0) {                                                   // 이후 바이트는 믿을 수 없으므로 응답 후 닫음
+        batch[0].errnum = rc == HTTP_PARSE_TOO_LARGE ? "431" : "400";
+        batch[0].shortmsg = rc == HTTP_PARSE_TOO_LARGE ? "Request Header Fields Too Large" : "Bad Request";
+        batch[0].longmsg = "Proxy could not parse the request";
+        batch[0].req.end = rp->rio_cnt;
+        return 1;
+    }
+    off = batch[0].req.end;
+    n = 1;
 
-    int cache_idx;
-    if ((cache_idx = cache_find(uri_copy)) != -1) { // 해당 uri의 cache를 찾은 경우
-      read_before(cache_idx);
-      Rio_writen(fd, cache.blocks[cache_idx].cache_object, strlen(cache.blocks[cache_idx].cache_object)); // cache에 저장되어 있으면 그대로 보냄
-      printf("Proxy sent cached data\n");   // 확인용
-      read_after(cache_idx);
-      return;
+    // 본문이 있는 요청이나 CONNECT 뒤는 요청이 아니므로 여기서 멈춤
+    while (n < MAX_PIPELINE && off < rp->rio_cnt && !request_ends_batch(batch[n - 1].base, &batch[n - 1].req)) {
+        if (n == c->batch_max) {
+            conn_grow_batch(c);
+            batch = c->batch;
+        }
+        memset(&batch[n], 0, offsetof(pipeline_req, req));
+        batch[n].endserver_fd = -1;
+        http_request_init(&batch[n].req);
+        if (http_parse_request(&batch[n].req, rp->rio_bufptr + off, rp->rio_cnt - off) != HTTP_PARSE_DONE)
+            break;                                                  // 덜 온 요청은 다음 차례에 다시 파싱
+        batch[n].base = rp->rio_bufptr + off;
+        off += batch[n].req.end;
+        n++;
+    }
+    return n;
+}
+
+/** 요청 본문의 framing, 길이를 알 수 없으면 -1 */
+// 요청에는 연결 종료로 끝나는 본문이 없으므로 길이 헤더가 없으면 본문이 없는 것
+int request_framing(const char *base, http_request *req, long *length) {
+    int framing = http_message_framing(base, req->headers, req->nheaders, length);
+
+    if (framing == HTTP_BODY_CLOSE)                                 // chunked로 끝나지 않는 Transfer-Encoding
+        return http_find_header_id(req->headers, req->nheaders, HTTP_HDR_TRANSFER_ENCODING) != NULL ? -1 : HTTP_BODY_NONE;
+    if (framing == HTTP_BODY_LENGTH && *length == 0)
+        return HTTP_BODY_NONE;
+    return framing;
+}
+
+/** 요청 본문이 있는지 (Content-Length > 0 또는 chunked, 잘못된 framing 포함) */
+int request_has_body(const char *base, http_request *req) {
+    long length = 0;
+    return request_framing(base, req, &length) != HTTP_BODY_NONE;
+}
+
+/** 요청 본문이 있거나 CONNECT면 1 */
+int request_ends_batch(const char *base, http_request *req) {
+    return request_has_body(base, req) || http_view_eq(base, req->method, "CONNECT");
+}
+
+/** client가 연결 유지를 원하는지 (HTTP/1.1은 기본 유지, HTTP/1.0은 keep-alive를 보내야 유지) */
+int client_keep_alive(const char *base, http_request *req) {
+    const http_header_view *h;
+    int keep = http_view_eq(base, req->version, "HTTP/1.1");
+
+    if ((h = http_find_header_id(req->headers, req->nheaders, HTTP_HDR_CONNECTION)) == NULL)
+        h = http_find_header_id(req->headers, req->nheaders, HTTP_HDR_PROXY_CONNECTION);
+    if (h != NULL) {
+        if (http_header_has_token(base, h->value, "close"))
+            keep = 0;
+        else if (http_header_has_token(base, h->value, "keep-alive"))
+            keep = 1;
+    }
+    return keep;
+}
+
+/** 요청 하나의 응답 준비: 캐쉬에 있으면 참조를 잡고, 없으면 end server에 요청을 보내 둠 */
+void dispatch_request(pipeline_req *p) {
+    const char *base = p->base;
+    http_request *req = &p->req;
+    const http_header_view *h;
+    struct iovec endserver_iov[MAX_HDR_IOV];
+    int endserver_iovcnt, port;
+    char hostname[MAXLINE];
+
+    if (p->errnum != NULL)                                          // 파싱 오류
+        return;
+    p->keep_alive = client_keep_alive(base, req);
+
+    if (http_view_eq(base, req->method, "GET")) p->method = METHOD_GET;
+    else if (http_view_eq(base, req->method, "HEAD")) p->method = METHOD_HEAD;
+    else if (http_view_eq(base, req->method, "POST")) p->method = METHOD_POST;
+    else if (http_view_eq(base, req->method, "PUT")) p->method = METHOD_PUT;
+    else if (http_view_eq(base, req->method, "CONNECT")) p->method = METHOD_CONNECT;
+    else {
+        p->uri = Malloc(req->method.len + 1);
+        http_view_copy(base, req->method, p->uri, req->method.len + 1);
+        p->errnum = "501";
+        p->shortmsg = "Not implemented";
+        p->longmsg = "Proxy does not implement this method";
+        return;
+    }
+
+    p->uri = Malloc(req->target.len + 1);
+    http_view_copy(base, req->target, p->uri, req->target.len + 1);
+
+    // 본문이 있는 GET/HEAD는 캐쉬 적중이나 통계 응답이어도 거절 (본문을 건너뛸 수 없고, 연결을 유지하면 본문이 다음 요청으로 읽힘)
+    if ((p->method == METHOD_GET || p->method == METHOD_HEAD) && request_has_body(base, req)) {
+        p->errnum = "400";
+        p->shortmsg = "Bad Request";
+        p->longmsg = "Proxy does not accept a body with GET or HEAD";
+        return;
+    }
+
+    if (p->method == METHOD_GET && !strcmp(p->uri, STATS_PATH)) {  // proxy 자신에게 온 통계 요청
+        p->stats = 1;
+        return;
+    }
+
+    if (p->method == METHOD_CONNECT) {                              // "host:port"로 연결만 해 둠
+        p->keep_alive = 0;
+        if (req->uri.host.len == 0 || req->uri.port.len == 0 || parse_uri(base, &req->uri, hostname, &port, NULL) < 0) {
+            p->errnum = "400";
+            p->shortmsg = "Bad Request";
+            p->longmsg = "Proxy needs host:port to CONNECT";
+        } else if ((p->endserver_fd = connect_endServer(hostname, port)) < 0) {
+            p->errnum = "502";
+            p->shortmsg = "Bad Gateway";
+            p->longmsg = "Proxy could not reach the end server";
+        }
+        return;
+    }
+
+    if (p->method == METHOD_GET || p->method == METHOD_HEAD) {
+        // 캐쉬 확인 절차 (HEAD도 GET으로 캐쉬된 응답의 헤더로 답함)
+        p->hit = cache_get(p->uri);
+        p->t_lookup = stats_now();
+        if (p->hit != NULL)                                         // 해당 uri의 cache를 찾은 경우
+            return;
+    } else {
+        cache_invalidate(p->uri);                                   // 이 요청으로 바뀔 수 있는 응답은 더 이상 쓰지 않음
+        p->t_lookup = stats_now();
+        if ((p->body_framing = request_framing(base, req, &p->body_length)) < 0) {
+            p->errnum = "400";
+            p->shortmsg = "Bad Request";
+            p->longmsg = "Proxy could not determine the request body length";
+            return;
+        }
+        h = http_find_header_id(req->headers, req->nheaders, HTTP_HDR_EXPECT);
+        p->expect_continue = h != NULL && http_header_has_token(base, h->value, "100-continue");
     }
 
     // uri 분석
-    parse_uri(uri, hostname, &port, path);
+    if (parse_uri(base, &req->uri, hostname, &port, NULL) < 0) {
+        p->errnum = "400";
+        p->shortmsg = "Bad Request";
+        p->longmsg = "Proxy could not parse the uri";
+        return;
+    }
 
-    // 서버에 보낼 헤더 작성
-    build_http_header(endserver_http_header, hostname, path, &rio);
+    // 서버에 보낼 헤더 작성 (client 버퍼를 가리키는 iovec, 복사 없음)
+    endserver_iovcnt = build_http_header(endserver_iov, hostname, base, req, p->body_framing == HTTP_BODY_CHUNKED);
 
-    // 서버 연결
-    endserver_fd = connect_endServer(hostname, port);
-    if (endserver_fd < 0) {                                                           // 연결 실패
-      printf("connection failed\n");
-      return;
+    // 서버 연결, 요청은 바로 보내서 앞 요청의 응답을 보내는 동안 end server가 처리하게 함
+    if ((p->endserver_fd = connect_endServer(hostname, port)) < 0
+        || rio_writev(p->endserver_fd, endserver_iov, endserver_iovcnt) < 0) {
+        if (p->endserver_fd >= 0)
+            Close(p->endserver_fd);
+        p->endserver_fd = -1;
+        p->errnum = "502";
+        p->shortmsg = "Bad Gateway";
+        p->longmsg = "Proxy could not reach the end server";
+        return;
     }
+    p->t_connected = stats_now();
+    p->endserver_rio = pool_get(sizeof(rio_t), NULL);
+    Rio_readinitb(p->endserver_rio, p->endserver_fd);
+}
 
-    Rio_readinitb(&endserver_rio, endserver_fd);
-    Rio_writen(endserver_fd, endserver_http_header, strlen(endserver_http_header));   // end server에 요청 전달
+/** 요청 본문을 Content-Length만큼 또는 chunked 끝까지 client rio 버퍼를 거쳐 end server로 전달 */
+// 본문 크기와 상관없이 rio 버퍼 하나만 씀. end server가 먼저 닫아도 다음 요청을 찾을 수 있게 본문은 끝까지 읽음
+// 반환값: 0 완료, -1 client에서 본문을 다 읽지 못함 (에러 응답 후 닫음, end server 연결은 respond_pipeline이 닫음)
+int forward_request_body(rio_t *rp, pipeline_req *p, int send_continue) {
+    http_chunked chunked;
+    long remaining = p->body_length;
+    ssize_t n;
+    int to_server = 1;
 
-    char cache_buf[MAX_OBJECT_SIZE];
-    int size_buf = 0;
-    
-    size_t n;
-    while ((n = Rio_readlineb(&endserver_rio, buf, MAXLINE)) != 0) {          // end server의 응답을 buf에 받기
-        size_buf += n;
-        if (size_buf < MAX_OBJECT_SIZE)
-          strcat(cache_buf, buf);                                             // 보낼 내용을 버퍼에 저장
-        Rio_writen(fd, buf, n);                                               // client에 end server response를 출력
+    if (p->expect_continue && send_continue                        // end server에는 Expect를 보내지 않았으므로 proxy가 답함
+        && rio_writen(rp->rio_fd, (void *)continue_hdr, sizeof(continue_hdr) - 1) < 0)
+        return -1;
+    if (p->body_framing == HTTP_BODY_CHUNKED)
+        http_chunked_init(&chunked);
+
+    while (p->body_framing == HTTP_BODY_CHUNKED ? !chunked.done : remaining > 0) {
+        if (rp->rio_cnt == 0 && rio_fillb(rp) <= 0)
+            break;
+        n = rp->rio_cnt;
+        if (p->body_framing == HTTP_BODY_LENGTH && n > remaining)
+            n = remaining;
+        else if (p->body_framing == HTTP_BODY_CHUNKED && (n = http_chunked_scan(&chunked, rp->rio_bufptr, n)) < 0)
+            break;
+
+        if (to_server && rio_writen(p->endserver_fd, rp->rio_bufptr, n) < 0)
+            to_server = 0;                                          // 응답은 이미 와 있을 수 있으므로 계속 읽기만 함
+        rp->rio_bufptr += n;
+        rp->rio_cnt -= n;
+        remaining -= n;
     }
-    printf("Proxy received %ld bytes and sent\n", size_buf);                  // proxy에 end server에서 받고 client에 보낸 문자수를 출력
 
-    Close(endserver_fd);
+    if (p->body_framing == HTTP_BODY_CHUNKED ? chunked.done : remaining == 0)
+        return 0;
+    p->errnum = "400";
+    p->shortmsg = "Bad Request";
+    p->longmsg = "Proxy could not read the request body";
+    return -1;
+}
+
+/** 캐쉬된 응답 하나를 iovec 3칸으로: hop-by-hop을 뺀 헤더 + Connection 헤더 + 빈 줄과 본문 */
+// HEAD면 본문 없이 빈 줄까지만
+static inline int iov_cached(struct iovec *iov, cache_obj *obj, int keep_alive, int head_only) {
+    const char *conn = keep_alive ? conn_keep_alive_hdr : conn_hdr;
+
+    iov[0].iov_base = obj->data;
+    iov[0].iov_len = obj->conn_off;
+    iov[1].iov_base = (void *)conn;
+    iov[1].iov_len = strlen(conn);
+    iov[2].iov_base = obj->data + obj->conn_off;
+    iov[2].iov_len = head_only ? 2 : obj->size - obj->conn_off;
+    return 3;
+}
+
+/** 요청 순서대로 응답을 보내고 자원을 정리, 연결을 유지할 수 있으면 1 */
+int respond_pipeline(client_conn *c, int n) {
+    struct iovec iov[MAX_PIPELINE * 3];
+    grow_buf cache_buf = { NULL, 0 };                               // 캐쉬할 응답을 받을 때만 빌림
+    relay_result res;
+    pipeline_req *batch = c->batch, *p;
+    int i, rc, timed_out, fd = c->fd, iovcnt = 0, hits_from = 0, alive = 1;
+
+    for (i = 0; i < n; i++) {
+        p = &batch[i];
+        if (!alive)
+            break;
+
+        if (p->hit != NULL) {                                       // 캐쉬 적중은 모아서 한 번에 보냄
+            if (iovcnt == 0)
+                hits_from = i;
+            iovcnt += iov_cached(iov + iovcnt, p->hit, p->keep_alive, p->method == METHOD_HEAD);
+            alive = p->keep_alive;
+            continue;
+        }
+
+        if (iovcnt > 0) {                                           // 앞에 모인 캐쉬 적중부터 보냄
+            if (rio_writev(fd, iov, iovcnt) < 0)
+                alive = 0;
+            else
+                stats_hits(c, hits_from, i);
+            iovcnt = 0;
+            if (!alive)
+                break;
+        }
+
+        if (p->errnum != NULL) {                                    // 에러 응답 뒤에는 연결을 닫음
+            clienterror(fd, p->uri != NULL ? p->uri : "request", p->errnum, p->shortmsg, p->longmsg);
+            stats_error(c, p, p->errnum);
+            alive = 0;
+            break;
+        }
 
-    if (size_buf < MAX_OBJECT_SIZE) {                                         // cache_object의 사이즈에 들어갈 수 있는 크기이면 저장
-      cache_uri(uri_copy, cache_buf);
+        if (p->stats) {                                             // 예약된 통계 경로
+            alive = respond_stats(fd, p->keep_alive) == 0 && p->keep_alive;
+            continue;
+        }
+
+        if (p->method == METHOD_CONNECT) {                          // 항상 batch의 마지막, 터널이 끝나면 연결도 닫음
+            timer_cancel(&c->timer);                                // 터널은 TUNNEL_IDLE_TIMEOUT으로만 끝남
+            if (rio_writen(fd, (void *)connect_established_hdr, sizeof(connect_established_hdr) - 1) >= 0)
+                tunnel(c->rio, p->endserver_fd, c->id, p->uri);
+            alive = 0;
+            break;
+        }
+
+        // 응답 framing대로 끝까지 전달, 헤더까지는 FIRST_BYTE_TIMEOUT이고 relay_response가 본문 시간으로 바꿈
+        timer_arm(&c->origin_timer, p->endserver_fd, SHUT_RDWR, FIRST_BYTE_TIMEOUT, "end server response");
+        rc = relay_response(p->endserver_rio, fd, p->method == METHOD_HEAD, &p->keep_alive, &cache_buf, &res, &c->origin_timer);
+        timed_out = timer_cancel(&c->origin_timer);
+        if (rc == 0 && timed_out)                                   // 끝을 본 직후에 만료되었어도 잘렸을 수 있으니 캐쉬하지 않음
+            rc = RELAY_ABORTED;
+        Close(p->endserver_fd);
+        p->endserver_fd = -1;
+        if (p->method == METHOD_POST || p->method == METHOD_PUT)
+            cache_invalidate(p->uri);                               // 요청을 보내는 사이에 GET이 이전 응답을 다시 채웠을 수 있음
+        if (rc == RELAY_BAD_GATEWAY && timed_out) {
+            clienterror(fd, p->uri, "504", "Gateway Timeout", "Proxy timed out waiting for the end server");
+            stats_error(c, p, "504");
+            alive = 0;
+            break;
+        }
+        if (rc == RELAY_BAD_GATEWAY) {
+            clienterror(fd, p->uri, "502", "Bad Gateway", "Proxy got an invalid response from the end server");
+            stats_error(c, p, "502");
+            alive = 0;
+            break;
+        }
+        alive = rc == 0 && p->keep_alive;
+        if (rc == 0)
+            stats_miss(c, p, &res);
+
+        if (rc == 0 && res.cacheable && p->method == METHOD_GET) {  // 끝까지 받았고 cache_object에 들어가는 크기이면 저장
+            cache_uri(p->uri, cache_buf.data, res.size, res.conn_off, 0);
+            if (prefetch_enabled && res.is_html) {                  // html이면 포함된 리소스를 미리 받아두기
+                cache_buf.data[res.size] = '\0';                   // relay_response가 자리를 남겨 둠
+                prefetch_scan(p->uri, cache_buf.data + res.hdr_len, res.size - res.hdr_len);
+            }
+        }
     }
+    if (iovcnt > 0) {
+        if (rio_writev(fd, iov, iovcnt) < 0)
+            alive = 0;
+        else
+            stats_hits(c, hits_from, i);
+    }
+    grow_buf_release(&cache_buf);
 
-    return;
+    for (i = 0; i < n; i++) {                                       // 보내지 못한 요청까지 모두 정리
+        p = &batch[i];
+        if (p->hit != NULL)
+            cache_obj_release(p->hit);
+        if (p->endserver_fd >= 0)
+            Close(p->endserver_fd);
+        if (p->endserver_rio != NULL)
+            pool_put(p->endserver_rio, sizeof(rio_t));
+        if (p->uri != NULL)
+            Free(p->uri);
+    }
+    return alive;
+}
+
+/** CONNECT 터널: 한 쓰레드가 poll로 양쪽을 보면서 방향마다 pipe를 거쳐 splice */
+// 바이트는 user 공간으로 복사되지 않음. 한쪽이 EOF를 보내면 반대쪽 쓰기만 닫고(half-close) 다른 방향은 계속,
+// 양쪽 다 끝나거나 에러, TUNNEL_IDLE_TIMEOUT 동안 아무것도 오가지 않으면 끝
+void tunnel(rio_t *rp, int serverfd, long id, const char *host) {
+    tunnel_dir dir[2];
+    struct pollfd pfd[2];
+    int i, rc, clientfd = rp->rio_fd;
+
+    memset(dir, 0, sizeof(dir));
+
+    // CONNECT 요청과 같이 와서 client 버퍼에 남은 바이트부터 보냄
+    if (rp->rio_cnt > 0 && rio_writen(serverfd, rp->rio_bufptr, rp->rio_cnt) < 0)
+        return;
+    dir[0].bytes = rp->rio_cnt;
+    rp->rio_cnt = 0;
+
+    dir[0].from = clientfd;
+    dir[0].to = serverfd;
+    dir[1].from = serverfd;
+    dir[1].to = clientfd;
+    if (pipe(dir[0].pipefd) < 0)
+        return;
+    if (pipe(dir[1].pipefd) < 0) {
+        Close(dir[0].pipefd[0]);
+        Close(dir[0].pipefd[1]);
+        return;
+    }
+    fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(serverfd, F_SETFL, fcntl(serverfd, F_GETFL, 0) | O_NONBLOCK);
+
+    while (!(dir[0].done && dir[1].done)) {
+        // fd마다: 읽을 방향의 pipe에 자리가 있으면 POLLIN, 쓸 방향의 pipe에 바이트가 있으면 POLLOUT
+        for (i = 0; i < 2; i++) {
+            pfd[i].fd = dir[i].from;
+            pfd[i].events = 0;
+            if (!dir[i].eof && !dir[i].paused)
+                pfd[i].events |= POLLIN;
+            if (dir[1 - i].pending > 0)
+                pfd[i].events |= POLLOUT;
+        }
+        if ((rc = poll(pfd, 2, TUNNEL_IDLE_TIMEOUT * 1000)) == 0)
+            break;
+        if (rc < 0 && errno != EINTR)
+            break;
+        if (tunnel_pump(&dir[0]) < 0 || tunnel_pump(&dir[1]) < 0)
+            break;
+    }
+    alog_write(ALOG_INFO, ALOG_EV_TUNNEL, id, 0, dir[0].bytes, dir[1].bytes, 0, host);
+
+    for (i = 0; i < 2; i++) {
+        Close(dir[i].pipefd[0]);
+        Close(dir[i].pipefd[1]);
+    }
+}
+
+/** from -> pipe -> to 방향으로 지금 막히지 않고 옮길 수 있는 만큼 옮김, 에러면 -1 */
+int tunnel_pump(tunnel_dir *d) {
+    ssize_t n;
+
+    if (!d->eof && !d->paused) {
+        n = splice(d->from, NULL, d->pipefd[1], NULL, TUNNEL_PIPE_SIZE - d->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            d->pending += n;
+            if (d->pending >= FLOW_HIGH_WATER)
+                d->paused = 1;
+        } else if (n == 0)
+            d->eof = 1;
+        else if (errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+    if (d->pending > 0) {
+        n = splice(d->pipefd[0], NULL, d->to, NULL, d->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            d->pending -= n;
+            d->bytes += n;
+            if (d->paused && d->pending <= FLOW_LOW_WATER)
+                d->paused = 0;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+    if (d->eof && d->pending == 0 && !d->done) {                    // 받은 만큼 다 보냈으면 반대쪽에 EOF 전달
+        shutdown(d->to, SHUT_WR);
+        d->done = 1;
+    }
+    return 0;
+}
+
+/** hop-by-hop 헤더인지 (end server와 proxy 사이에서만 의미가 있어서 client에 전달하지 않음) */
+static int is_hop_by_hop(const char *buf, const http_header_view *h, const http_header_view *conn) {
+    char token[64];
+
+    switch (h->id) {
+    case HTTP_HDR_CONNECTION:
+    case HTTP_HDR_PROXY_CONNECTION:
+    case HTTP_HDR_KEEP_ALIVE:
+        return 1;
+    }
+    if (conn != NULL && h->name.len < sizeof(token)) {              // "Connection: X-Foo"로 지정된 헤더
+        http_view_copy(buf, h->name, token, sizeof(token));
+        return http_header_has_token(buf, conn->value, token);
+    }
+    return 0;
+}
+
+/** end server 응답을 헤더가 정한 framing대로 정확히 끝까지 읽으며 client에 전달 */
+// clientfd < 0이면 전달하지 않고 cache_buf에만 받음 (prefetch)
+// 응답 헤더에서 hop-by-hop 헤더를 빼고 proxy의 Connection 헤더를 넣음. *keep_alive는 client가 원하는지를 받아서,
+// 응답이 연결 종료로 끝나면 0으로 바꿈
+// 캐쉬 여부는 본문이 오기 전에 헤더만 보고 정하고, 끝까지 받지 못하면 취소
+// 본문은 FLOW_BUF_SIZE 버퍼 하나로 전달해서 client가 느려도 그 이상 쌓이지 않음
+// timer는 응답 헤더를 기다리는 동안 srv에 걸려 있고, 헤더를 받으면 TRANSFER_TIMEOUT으로 다시 검
+// 반환값: 0 완료, RELAY_BAD_GATEWAY 응답 헤더가 잘못됨 (client에 보낸 것 없음), RELAY_ABORTED 본문 도중 실패
+int relay_response(rio_t *srv, int clientfd, int head_request, int *keep_alive, grow_buf *cache_buf, relay_result *res, timer_node *timer) {
+    http_response resp;
+    http_chunked chunked;
+    const http_header_view *h, *conn;
+    struct iovec iov[HTTP_MAX_HEADERS + 4];
+    const char *hdrbuf, *conn_line;
+    struct pollfd pfd[2];
+    flow_buf fb;
+    long length = 0, n, sent;
+    int i, rc, framing, done, progress, iovcnt = 0, run_start, run_end;
+
+    memset(res, 0, sizeof(relay_result));
+    http_response_init(&resp);
+    while ((rc = http_parse_response(&resp, srv->rio_bufptr, srv->rio_cnt)) == HTTP_PARSE_AGAIN) {
+        if (srv->rio_cnt == RIO_BUFSIZE || rio_fillb(srv) <= 0)
+            return RELAY_BAD_GATEWAY;
+        if (res->first_byte == 0)
+            res->first_byte = stats_now();
+    }
+    if (rc != HTTP_PARSE_DONE)
+        return RELAY_BAD_GATEWAY;
+    timer_arm(timer, srv->rio_fd, SHUT_RDWR, TRANSFER_TIMEOUT, "end server transfer");
+    hdrbuf = srv->rio_bufptr;
+    if ((framing = http_response_framing(hdrbuf, &resp, head_request, &length)) < 0)
+        return RELAY_BAD_GATEWAY;
+
+    // 본문이 오기 전에 캐쉬할지 결정
+    res->status = resp.status;
+    res->cacheable = resp.status == 200 && !head_request
+        && (framing != HTTP_BODY_LENGTH || resp.end + length < MAX_OBJECT_SIZE);
+    if ((h = http_find_header_id(resp.headers, resp.nheaders, HTTP_HDR_CACHE_CONTROL)) != NULL
+        && (http_header_has_token(hdrbuf, h->value, "no-store") || http_header_has_token(hdrbuf, h->value, "private")))
+        res->cacheable = 0;
+    if ((h = http_find_header_id(resp.headers, resp.nheaders, HTTP_HDR_CONTENT_TYPE)) != NULL
+        && h->value.len >= 9 && !strncasecmp(hdrbuf + h->value.off, "text/html", 9))
+        res->is_html = 1;
+    if (res->cacheable)                     // 헤더와 알려진 본문 길이만큼 미리 (끝에 '\0' 붙일 자리까지)
+        grow_buf_reserve(cache_buf, resp.end + (framing == HTTP_BODY_LENGTH ? length : 0) + 1);
+
+    // 응답 헤더: status line부터 hop-by-hop이 아닌 줄을 이어진 만큼 묶어서 iovec으로
+    conn = http_find_header_id(resp.headers, resp.nheaders, HTTP_HDR_CONNECTION);
+    run_start = resp.version.off;
+    run_end = resp.nheaders > 0 ? resp.headers[0].line.off : resp.end - 2;
+    for (i = 0; i < resp.nheaders; i++) {
+        h = &resp.headers[i];
+        if (!is_hop_by_hop(hdrbuf, h, conn)) {
+            if (h->line.off == run_end) {
+                run_end += h->line.len;
+                continue;
+            }
+            if (run_end > run_start)
+                iov_push(iov, &iovcnt, hdrbuf + run_start, run_end - run_start);
+            run_start = h->line.off;
+            run_end = h->line.off + h->line.len;
+        }
+    }
+    if (run_end > run_start)
+        iov_push(iov, &iovcnt, hdrbuf + run_start, run_end - run_start);
+
+    if (framing == HTTP_BODY_CLOSE && keep_alive != NULL)           // 연결 종료로 끝나는 응답이면 client도 닫아야 함
+        *keep_alive = 0;
+    conn_line = keep_alive != NULL && *keep_alive ? conn_keep_alive_hdr : conn_hdr;
+
+    // 캐쉬에는 Connection 헤더 없이 저장하고 끼울 위치만 기억
+    for (i = 0; i < iovcnt; i++) {
+        if (res->cacheable)
+            memcpy(cache_buf->data + res->conn_off, iov[i].iov_base, iov[i].iov_len);
+        res->conn_off += iov[i].iov_len;
+    }
+    if (res->cacheable)
+        memcpy(cache_buf->data + res->conn_off, endof_hdr, 2);
+    res->hdr_len = res->size = res->conn_off + 2;
+
+    iov_push(iov, &iovcnt, conn_line, strlen(conn_line));
+    iov_push(iov, &iovcnt, endof_hdr, 2);
+    if (clientfd >= 0 && rio_writev(clientfd, iov, iovcnt) < 0)
+        return RELAY_ABORTED;
+    srv->rio_bufptr += resp.end;
+    srv->rio_cnt -= resp.end;
+
+    if (framing == HTTP_BODY_CHUNKED)
+        http_chunked_init(&chunked);
+    done = framing == HTTP_BODY_NONE || (framing == HTTP_BODY_LENGTH && length == 0);
+    if (done)
+        return 0;
+
+    // 본문은 flow 버퍼를 거쳐 전달 (Content-Length만큼, chunked 끝까지, 또는 연결 종료까지)
+    // end server와 client를 따로 poll해서, client가 느리면 버퍼가 찰 때까지만 end server에서 미리 받아 둠
+    fb.data = pool_get(FLOW_BUF_SIZE, NULL);
+    fb.off = fb.len = 0;
+    fb.paused = 0;
+    memcpy(fb.data, srv->rio_bufptr, srv->rio_cnt);                 // 헤더와 같이 온 본문
+    n = srv->rio_cnt;
+    srv->rio_cnt = 0;
+    pfd[0].events = POLLIN;
+    pfd[1].events = POLLOUT;
+    rc = 0;
+
+    while (1) {
+        if (n > 0) {                                                // 새로 받은 n 바이트 중 본문만 flow 버퍼에 넣음
+            if ((n = relay_body_take(fb.data + fb.off + fb.len, n, framing, &length, &chunked, &done)) < 0) {
+                rc = RELAY_ABORTED;
+                break;
+            }
+            if (res->cacheable && res->size + n < MAX_OBJECT_SIZE) {
+                grow_buf_reserve(cache_buf, res->size + n + 1);
+                memcpy(cache_buf->data + res->size, fb.data + fb.off + fb.len, n);
+            } else
+                res->cacheable = 0;                   // chunked나 close로 온 응답이 너무 큼
+            res->size += n;
+            if (clientfd >= 0 && (fb.len += n) >= FLOW_HIGH_WATER)
+                fb.paused = 1;
+            n = 0;
+        }
+        if (done && fb.len == 0)
+            break;
+
+        progress = 0;
+        if (fb.len > 0) {                                           // client로 막히지 않는 만큼 보냄
+            if ((sent = send(clientfd, fb.data + fb.off, fb.len, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    rc = RELAY_ABORTED;
+                    break;
+                }
+            } else if (sent > 0) {
+                fb.off += sent;
+                fb.len -= sent;
+                if (fb.len == 0)
+                    fb.off = 0;
+                if (fb.paused && fb.len <= FLOW_LOW_WATER)
+                    fb.paused = 0;
+                progress = 1;
+            }
+        }
+        if (!done && !fb.paused) {                                  // end server에서 버퍼에 남은 자리만큼 받음
+            if (fb.off > 0 && FLOW_BUF_SIZE - fb.off - fb.len < FLOW_BUF_SIZE - FLOW_HIGH_WATER) {
+                memmove(fb.data, fb.data + fb.off, fb.len);
+                fb.off = 0;
+            }
+            if ((n = recv(srv->rio_fd, fb.data + fb.off + fb.len, FLOW_BUF_SIZE - fb.off - fb.len, MSG_DONTWAIT)) == 0) {
+                if (framing != HTTP_BODY_CLOSE || timer_fired(timer)) { // 본문이 덜 온 채로 끊김 (timer의 shutdown도 EOF로 보임)
+                    rc = RELAY_ABORTED;
+                    break;
+                }
+                done = 1;                             // 연결 종료가 곧 응답의 끝
+            } else if (n < 0) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    rc = RELAY_ABORTED;
+                    break;
+                }
+                n = 0;
+            } else
+                progress = 1;
+        }
+        if (progress || (done && fb.len == 0))
+            continue;
+
+        // 양쪽 다 막힘: 보낼 게 있으면 client 쓰기를, 받을 자리가 있으면 end server 읽기를 기다림 (음수 fd는 poll이 무시)
+        pfd[0].fd = !done && !fb.paused ? srv->rio_fd : -1;
+        pfd[1].fd = fb.len > 0 ? clientfd : -1;
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+            rc = RELAY_ABORTED;
+            break;
+        }
+    }
+    pool_put(fb.data, FLOW_BUF_SIZE);
+    return rc;
+}
+
+/** flow 버퍼에 새로 받은 n 바이트 중 응답 본문에 속하는 바이트 수 (그 뒤는 버림), framing 오류면 -1 */
+// 본문이 끝나면 *done = 1
+static long relay_body_take(const char *p, long n, int framing, long *length, http_chunked *chunked, int *done) {
+    if (framing == HTTP_BODY_LENGTH) {
+        if (n > *length)
+            n = *length;
+        if ((*length -= n) == 0)
+            *done = 1;
+    } else if (framing == HTTP_BODY_CHUNKED) {
+        if ((n = http_chunked_scan(chunked, p, n)) < 0)
+            return -1;
+        if (chunked->done)
+            *done = 1;
+    }
+    return n;
+}
+
+/** 클라이언트 rio 버퍼에 요청 헤더가 다 들어올 때까지 읽으면서 그 자리에서 파싱 */
+// 반환값: 1 완료, 0 요청 전에 연결 종료, 음수는 HTTP_PARSE_ERROR / HTTP_PARSE_TOO_LARGE
+int read_request(rio_t *rp, http_request *req) {
+  int rc;
+  ssize_t n;
+
+  http_request_init(req);
+  while ((rc = http_parse_request(req, rp->rio_bufptr, rp->rio_cnt)) == HTTP_PARSE_AGAIN) {
+    if (rp->rio_cnt == RIO_BUFSIZE)               // 버퍼보다 큰 헤더는 받지 않음
+      return HTTP_PARSE_TOO_LARGE;
+    if ((n = rio_fillb(rp)) <= 0)                 // 이어서 읽고 멈춘 곳부터 다시 파싱
+      return rp->rio_cnt == 0 ? 0 : HTTP_PARSE_ERROR;
+  }
+  return rc == HTTP_PARSE_DONE ? 1 : rc;
 }
 
-void parse_uri(char *uri, char *host, int *port, char *path) {
+/** 파싱된 uri view에서 host, port, path를 꺼냄 (없으면 기본값) */
+int parse_uri(const char *buf, http_uri *uri, char *host, int *port, char *path) {
+    char portStr[16];
+
     *port = end_server_port;
-    char *pos = strstr(uri, "//");
-    pos = pos != NULL? pos + 2 : uri;
-
-    char *pos2 = strstr(pos, ":");
-    if (pos2 != NULL) {                      // port 번호 지정되어 있는 경우
-      *pos2 = '\0';
-      sscanf(pos, "%s", host);
-      sscanf(pos2 + 1, "%d%s", port, path);        // ':' 건너뛰기
-    } else {
-      pos2 = strstr(pos, "/");
-      if (pos2 != NULL) {                    // path가 있는 경우
-        *pos2 = '\0';
-        sscanf(pos, "%s", host);
-        *pos2 = '/';
-        sscanf(pos2, "%s", path);
-      } else {                              // host만 있는 경우
-        sscanf(pos, "%s", host);
-      }
-    }
-    if (strlen(host) == 0) strcpy(host, end_server_host);   // host명이 없는 경우 지정
+    if (uri->host.len == 0) strcpy(host, end_server_host);   // host명이 없는 경우 지정
+    else if (http_view_copy(buf, uri->host, host, MAXLINE) < 0) return -1;
 
-    return;
+    if (uri->port.len > 0) {                 // port 번호 지정되어 있는 경우
+      if (http_view_copy(buf, uri->port, portStr, sizeof(portStr)) < 0) return -1;
+      *port = atoi(portStr);
+    }
+
+    if (path == NULL) return 0;              // path가 필요 없는 경우
+    if (uri->path.len == 0) strcpy(path, "/");              // host만 있는 경우
+    else if (http_view_copy(buf, uri->path, path, MAXLINE) < 0) return -1;
+
+    return 0;
 }
 
 
-void build_http_header(char *http_header, char *hostname, char *path, rio_t *client_rio) {
-  char buf[MAXLINE], request_hdr[MAXLINE], other_hdr[MAXLINE], host_hdr[MAXLINE];
+/** end server에 보낼 요청을 한 번에 훑으며 iovec으로 만듦, iovec 갯수를 반환 */
+// client 헤더 줄은 reqbuf를 그대로 가리키므로 writev가 끝날 때까지 reqbuf를 덮어쓰면 안 됨
+// chunked 본문을 보내는 요청은 HTTP/1.1로 보냄 (Content-Length와 Transfer-Encoding 헤더는 그대로 전달)
+int build_http_header(struct iovec *iov, char *hostname, const char *reqbuf, http_request *req, int chunked) {
+  int i, cnt = 0, host_idx, run_start = -1, run_end = -1;
   
-  // request line
-  sprintf(request_hdr, requestline_hdr_format, path);
+  // request line: method + " " + path + " HTTP/1.0\r\n" (method 뒤의 공백까지 client 버퍼에서)
+  iov_push(iov, &cnt, reqbuf + req->method.off, req->method.len + 1);
+  if (req->uri.path.len > 0)
+    iov_push(iov, &cnt, reqbuf + req->uri.path.off, req->uri.path.len);
+  else
+    iov_push(iov, &cnt, "/", 1);
+  if (chunked)
+    iov_push(iov, &cnt, requestline_version_11, sizeof(requestline_version_11) - 1);
+  else
+    iov_push(iov, &cnt, requestline_version, sizeof(requestline_version) - 1);
+
+  // Host 자리는 비워 두고 client가 보냈으면 그 줄로 채움
+  host_idx = cnt;
+  iov_push(iov, &cnt, NULL, 0);
+  iov_push(iov, &cnt, NULL, 0);
+  iov_push(iov, &cnt, NULL, 0);
+
+  iov_push(iov, &cnt, conn_hdr, sizeof(conn_hdr) - 1);
+  iov_push(iov, &cnt, prox_hdr, sizeof(prox_hdr) - 1);
+  iov_push(iov, &cnt, user_agent_hdr, sizeof(user_agent_hdr) - 1);
 
-  // get other request header for client rio and change it
-  while (Rio_readlineb(client_rio, buf, MAXLINE) > 0) {
-    if (strcmp(buf, endof_hdr) == 0)
-      break;  // EOF
+  // 나머지 헤더 줄은 바꿀 것만 빼고, 연속된 줄은 iovec 하나로 묶음
+  for (i = 0; i < req->nheaders; i++) {
+    http_header_view *h = &req->headers[i];
     
-    if (!strncasecmp(buf, host_key, strlen(host_key))) {
-      strcpy(host_hdr, buf);
+    switch (h->id) {                                  // 파싱할 때 분류해 둔 헤더 이름
+    case HTTP_HDR_HOST:
+      iov[host_idx].iov_base = (void *)(reqbuf + h->line.off);
+      iov[host_idx].iov_len = h->line.len;
+      continue;
+    case HTTP_HDR_CONNECTION:
+    case HTTP_HDR_PROXY_CONNECTION:
+    case HTTP_HDR_USER_AGENT:
+    case HTTP_HDR_EXPECT:                             // 100-continue는 proxy가 직접 답함
       continue;
     }
 
-    if (strncasecmp(buf, connection_key, strlen(connection_key))
-        &&strncasecmp(buf, proxy_connection_key, strlen(proxy_connection_key))
-        &&strncasecmp(buf, user_agent_key, strlen(user_agent_key))) {
-        strcat(other_hdr, buf);
-      }
+    if (run_start >= 0 && h->line.off == run_end) {   // 바로 앞 줄에 이어짐
+      run_end += h->line.len;
+      continue;
+    }
+    if (run_start >= 0)
+      iov_push(iov, &cnt, reqbuf + run_start, run_end - run_start);
+    run_start = h->line.off;
+    run_end = h->line.off + h->line.len;
   }
-  if (strlen(host_hdr) == 0) {
-    sprintf(host_hdr, host_hdr_format, hostname);
+  if (run_start >= 0)
+    iov_push(iov, &cnt, reqbuf + run_start, run_end - run_start);
+
+  if (iov[host_idx].iov_len == 0) {                   // client가 Host를 안 보낸 경우
+    iov[host_idx].iov_base = (void *)host_hdr_prefix;
+    iov[host_idx].iov_len = sizeof(host_hdr_prefix) - 1;
+    iov[host_idx + 1].iov_base = hostname;
+    iov[host_idx + 1].iov_len = strlen(hostname);
+    iov[host_idx + 2].iov_base = (void *)endof_hdr;
+    iov[host_idx + 2].iov_len = sizeof(endof_hdr) - 1;
   }
-  sprintf(http_header, "%s%s%s%s%s%s%s",
-          request_hdr,
-          host_hdr,
-          conn_hdr,
-          prox_hdr,
-          user_agent_hdr,
-          other_hdr,
-          endof_hdr);
-  return;
+
+  iov_push(iov, &cnt, endof_hdr, sizeof(endof_hdr) - 1);
+  return cnt;
 }
 
 /** 에러 메세지를 클라이언트에 보냄 */
@@ -248,111 +1360,862 @@ void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longms
     sprintf(body, "%s<hr><em>The Proxy server</em>\r\n", body);
 
     sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, buf, strlen(buf));
     sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, buf, strlen(buf));
     sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, body, strlen(body));
 }
 
 inline int connect_endServer(char *hostname, int port) {
   char portStr[100];
   sprintf(portStr, "%d", port);
-  return Open_clientfd(hostname, portStr);
+  // 실패해도 proxy를 종료하지 않고 502로 응답. 연결 중인 소켓은 shutdown으로 깨울 수 없어서 타이머 휠 대신 poll로 기다림
+  return open_clientfd_timeout(hostname, portStr, CONNECT_TIMEOUT);
 }
 
-void cache_init() {
+// pool의 크기 class (client와 end server의 rio_t, 요청 batch, 캐쉬할 응답이 들어가는 크기들)
+static const size_t pool_class_size[POOL_CLASSES] = {
+  2048, 4096, sizeof(rio_t), 16384, 32768, 65536, MAX_OBJECT_SIZE + 1
+};
+
+void pool_init() {
   int i;
-  for (i=0; i<TOTAL_CACHE_BLOCK_NUM; i++) {
-    cache.blocks[i].LRU = 0;        // 초기치 우선순위 없음
-    cache.blocks[i].is_empty = 1;   // empty
-    Sem_init(&cache.blocks[i].write_mutex, 0, 1);
-    Sem_init(&cache.blocks[i].read_cnt_mutex, 0, 1);
-    cache.blocks[i].read_cnt = 0;
+  for (i = 0; i < POOL_CLASSES; i++) {
+    pool.free_list[i] = NULL;
+    pool.nfree[i] = 0;
+    Sem_init(&pool.mutex[i], 0, 1);
   }
+  pool.in_use = pool.idle = 0;
 }
 
-int cache_find(char *uri) {
+/** size가 들어가는 가장 작은 class, 없으면 POOL_CLASSES */
+static int pool_class(size_t size) {
   int i;
-  for (i=0; i<TOTAL_CACHE_BLOCK_NUM; i++) {
-    read_before(i);
+  for (i = 0; i < POOL_CLASSES && pool_class_size[i] < size; i++)
+    ;
+  return i;
+}
 
-    if ((cache.blocks[i].is_empty == 0) && (strcmp(uri, cache.blocks[i].cache_uri) == 0)) { // cache 되어 있으면
-      read_after(i);
-      return i;
-    }
-    read_after(i);
+void *pool_get(size_t size, size_t *cap) {
+  int c = pool_class(size);
+  pool_buf *b = NULL;
+
+  if (c == POOL_CLASSES) {                      // pool에 두지 않는 크기
+    if (cap != NULL) *cap = size;
+    return Malloc(size);
+  }
+  P(&pool.mutex[c]);
+  if ((b = pool.free_list[c]) != NULL) {
+    pool.free_list[c] = b->next;
+    pool.nfree[c]--;
   }
-  return -1;
+  V(&pool.mutex[c]);
+
+  if (b != NULL)
+    __atomic_sub_fetch(&pool.idle, pool_class_size[c], __ATOMIC_RELAXED);
+  else
+    b = Malloc(pool_class_size[c]);
+  __atomic_add_fetch(&pool.in_use, pool_class_size[c], __ATOMIC_RELAXED);
+  if (cap != NULL) *cap = pool_class_size[c];
+  return b;
 }
 
-void cache_uri(char *uri, char *buf) {
-  int i = cache_eviction();                   // 빈 캐쉬 혹은 우선순위가 가장 낮은 캐쉬 블록
+/** pool_get으로 받은 버퍼를 돌려줌 (cap은 받은 크기 또는 요청한 크기) */
+void pool_put(void *buf, size_t cap) {
+  int c = pool_class(cap), keep = 0;
+  pool_buf *b = buf;
 
-  write_before(i);
+  if (c == POOL_CLASSES) {
+    Free(buf);
+    return;
+  }
+  __atomic_sub_fetch(&pool.in_use, pool_class_size[c], __ATOMIC_RELAXED);
+  P(&pool.mutex[c]);
+  if (pool.nfree[c] < POOL_MAX_FREE) {          // 연결이 몰렸다 빠지면 남는 만큼은 해제
+    b->next = pool.free_list[c];
+    pool.free_list[c] = b;
+    pool.nfree[c]++;
+    keep = 1;
+  }
+  V(&pool.mutex[c]);
+
+  if (keep)
+    __atomic_add_fetch(&pool.idle, pool_class_size[c], __ATOMIC_RELAXED);
+  else
+    Free(buf);
+}
+
+void grow_buf_reserve(grow_buf *b, size_t need) {
+  size_t cap;
+  char *data;
+
+  if (need <= b->cap)
+    return;
+  if (need < 2 * b->cap)                        // 조금씩 자라는 응답이면 두 배씩
+    need = 2 * b->cap;
+  data = pool_get(need, &cap);
+  if (b->data != NULL) {
+    memcpy(data, b->data, b->cap);
+    pool_put(b->data, b->cap);
+  }
+  b->data = data;
+  b->cap = cap;
+}
+
+void grow_buf_release(grow_buf *b) {
+  if (b->data != NULL)
+    pool_put(b->data, b->cap);
+  b->data = NULL;
+  b->cap = 0;
+}
+
+/** 연결 하나가 차지하는 메모리: 쉬는 동안 남는 것과 요청을 처리하는 동안 빌리는 것 */
+// 연결이 들어오기 전에 main에서만 부름, 실행 중의 연결 수와 버퍼 사용량은 proxy_connections_active, proxy_buffer_bytes로
+void conn_report(void) {
+  printf("Per connection: idle %lu bytes of state + %d KB stack reserved (touched pages only); "
+         "while busy + %lu client buffer, %lu per pipelined request, %lu per origin fetch, "
+         "%d relay buffer, up to %d cache buffer\n",
+         (unsigned long)sizeof(client_conn), CONN_STACK_SIZE / 1024, (unsigned long)sizeof(rio_t),
+         (unsigned long)sizeof(pipeline_req), (unsigned long)sizeof(rio_t), FLOW_BUF_SIZE, MAX_OBJECT_SIZE);
+}
 
-  strcpy(cache.blocks[i].cache_uri, uri);     // uri 채우기
-  strcpy(cache.blocks[i].cache_object, buf);  // 내용 채우기
-  cache.blocks[i].is_empty = 0;               // 채워진 블록 표시
-  cache.blocks[i].LRU = LRU_MAX_NUMBER;       // 가장 큰 우선순위로 갱신
-  cache_LRU(i);                               // 다른 캐쉬 블록 내리기
+/** 모든 shard의 히스토그램 초기화 */
+void stats_init() {
+  int i, k;
 
-  write_after(i);
+  for (i = 0; i < STATS_SHARDS; i++)
+    for (k = 0; k < PHASES; k++)
+      hdr_init(&stats[i].phase[k]);
 }
 
-void cache_LRU(int index) {
+void stats_hits(client_conn *c, int from, int to) {
+  stats_shard *s = &stats[c->shard];
+  long now = stats_now(), bytes = 0, size;
+  pipeline_req *p;
   int i;
-  for (i = 0; i < TOTAL_CACHE_BLOCK_NUM; i++) {
-    if (i == index) continue;             // 자기 자신은 넘기기
-    write_before(i);
-    if (cache.blocks[i].is_empty == 0) {  // 채워져 있으면
-      cache.blocks[i].LRU--;              // 우선순위를 내리기
+
+  for (i = from; i < to; i++) {
+    p = &c->batch[i];
+    hdr_record_atomic(&s->phase[PHASE_LOOKUP], p->t_lookup - c->t_parsed);
+    hdr_record_atomic(&s->phase[PHASE_TOTAL_HIT], now - c->t_start);
+    size = p->method == METHOD_HEAD ? p->hit->conn_off + 2 : p->hit->size;
+    stats_log(c, p, ALOG_INFO, ALOG_EV_HIT, 200, size, now, NULL);
+    bytes += size;
+  }
+  STATS_ADD(c->shard, hits, to - from);
+  STATS_ADD(c->shard, bytes, bytes);
+}
+
+/** end server에서 끝까지 받아 보낸 요청의 구간 기록 */
+void stats_miss(client_conn *c, pipeline_req *p, relay_result *res) {
+  stats_shard *s = &stats[c->shard];
+  long now = stats_now();
+
+  hdr_record_atomic(&s->phase[PHASE_LOOKUP], p->t_lookup - c->t_parsed);
+  hdr_record_atomic(&s->phase[PHASE_CONNECT], p->t_connected - p->t_lookup);
+  hdr_record_atomic(&s->phase[PHASE_FIRST_BYTE], res->first_byte - p->t_connected);
+  hdr_record_atomic(&s->phase[PHASE_TRANSFER], now - res->first_byte);
+  hdr_record_atomic(&s->phase[PHASE_TOTAL_MISS], now - c->t_start);
+  STATS_ADD(c->shard, misses, 1);
+  STATS_ADD(c->shard, bytes, res->size);
+  stats_log(c, p, ALOG_INFO, ALOG_EV_MISS, res->status, res->size, now, res);
+}
+
+void stats_error(client_conn *c, pipeline_req *p, const char *errnum) {
+  STATS_ADD(c->shard, errors, 1);
+  stats_log(c, p, ALOG_WARN, ALOG_EV_ERROR, atoi(errnum), 0, stats_now(), NULL);
+}
+
+/** 요청 하나를 access log와 (-j이면) 캡쳐 파일에 남김, 구간은 지나간 것만 us로 */
+static void stats_log(client_conn *c, pipeline_req *p, int level, int event, int status, long bytes, long now, relay_result *res) {
+  static const char *method_names[] = { "GET", "HEAD", "POST", "PUT", "CONNECT" };
+  alog_rec *r;
+
+  if ((r = alog_start(level, event, 1)) == NULL)
+    return;
+  r->conn = c->id;
+  r->status = status;
+  r->bytes_out = bytes;
+  r->latency = now - c->t_start;
+  if (p->uri != NULL && !(p->errnum != NULL && !strcmp(p->errnum, "501")))  // 파싱하지 못했거나 모르는 method면 비워 둠
+    strcpy(r->method, method_names[p->method]);
+  if (c->t_parsed > c->t_start)
+    r->phase[ALOG_PH_PARSE] = (c->t_parsed - c->t_start) / 1000;
+  if (p->t_lookup > 0)
+    r->phase[ALOG_PH_LOOKUP] = (p->t_lookup - c->t_parsed) / 1000;
+  if (res != NULL) {
+    r->phase[ALOG_PH_CONNECT] = (p->t_connected - p->t_lookup) / 1000;
+    r->phase[ALOG_PH_FIRST_BYTE] = (res->first_byte - p->t_connected) / 1000;
+    r->phase[ALOG_PH_TRANSFER] = (now - res->first_byte) / 1000;
+  }
+  alog_text(r, p->uri);
+  alog_commit(r);
+}
+
+/** printf 형식으로 b의 *len 위치에 이어 씀 */
+static void stats_append(grow_buf *b, size_t *len, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  while (1) {
+    va_start(ap, fmt);
+    n = vsnprintf(b->data + *len, b->cap - *len, fmt, ap);
+    va_end(ap);
+    if (*len + n < b->cap)
+      break;
+    grow_buf_reserve(b, *len + n + 1);
+  }
+  *len += n;
+}
+
+/** 카운터와 구간별 분위수를 Prometheus text 형식으로 보냄, 실패하면 -1 */
+// 기록하는 쪽을 멈추지 않고 합치므로 값들이 같은 순간의 것은 아님
+int respond_stats(int fd, int keep_alive) {
+  static const char *phase_names[PHASES] = {
+    "parse", "lookup", "connect", "first_byte", "transfer", "total_hit", "total_miss"
+  };
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  hdr_hist *h = Malloc(sizeof(hdr_hist));
+  grow_buf body = { NULL, 0 };
+  size_t len = 0;
+  long hits = 0, misses = 0, errors = 0, bytes = 0, connections = 0;
+  char hdr[MAXLINE];
+  struct iovec iov[2];
+  int i, k, q, rc;
+
+  grow_buf_reserve(&body, 4096);
+  for (i = 0; i < STATS_SHARDS; i++) {
+    hits += __atomic_load_n(&stats[i].hits, __ATOMIC_RELAXED);
+    misses += __atomic_load_n(&stats[i].misses, __ATOMIC_RELAXED);
+    errors += __atomic_load_n(&stats[i].errors, __ATOMIC_RELAXED);
+    bytes += __atomic_load_n(&stats[i].bytes, __ATOMIC_RELAXED);
+    connections += __atomic_load_n(&stats[i].connections, __ATOMIC_RELAXED);
+  }
+  stats_append(&body, &len, "# HELP proxy_requests_total Requests answered, by result.\n"
+               "# TYPE proxy_requests_total counter\n"
+               "proxy_requests_total{result=\"hit\"} %ld\n"
+               "proxy_requests_total{result=\"miss\"} %ld\n"
+               "proxy_requests_total{result=\"error\"} %ld\n", hits, misses, errors);
+  stats_append(&body, &len, "# HELP proxy_response_bytes_total Response bytes sent to clients.\n"
+               "# TYPE proxy_response_bytes_total counter\n"
+               "proxy_response_bytes_total %ld\n", bytes);
+  stats_append(&body, &len, "# HELP proxy_connections_total Client connections accepted.\n"
+               "# TYPE proxy_connections_total counter\n"
+               "proxy_connections_total %ld\n"
+               "# HELP proxy_connections_active Client connections open now.\n"
+               "# TYPE proxy_connections_active gauge\n"
+               "proxy_connections_active %ld\n", connections, __atomic_load_n(&conn_active, __ATOMIC_RELAXED));
+  stats_append(&body, &len, "# HELP proxy_timeouts_total Sockets shut down by an expired deadline.\n"
+               "# TYPE proxy_timeouts_total counter\n"
+               "proxy_timeouts_total %ld\n"
+               "# HELP proxy_buffer_bytes Pooled buffer memory.\n"
+               "# TYPE proxy_buffer_bytes gauge\n"
+               "proxy_buffer_bytes{state=\"in_use\"} %ld\n"
+               "proxy_buffer_bytes{state=\"pooled\"} %ld\n", wheel.expired, pool.in_use, pool.idle);
+
+  stats_append(&body, &len, "# HELP proxy_phase_seconds Time spent in each phase of a request.\n"
+               "# TYPE proxy_phase_seconds summary\n");
+  for (k = 0; k < PHASES; k++) {
+    hdr_init(h);
+    for (i = 0; i < STATS_SHARDS; i++)
+      hdr_merge(h, &stats[i].phase[k]);
+    for (q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++)
+      stats_append(&body, &len, "proxy_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                   phase_names[k], quantiles[q], hdr_percentile(h, quantiles[q] * 100) / 1e9);
+    stats_append(&body, &len, "proxy_phase_seconds_sum{phase=\"%s\"} %.9f\n"
+                 "proxy_phase_seconds_count{phase=\"%s\"} %ld\n",
+                 phase_names[k], h->sum / 1e9, phase_names[k], h->total);
+  }
+  Free(h);
+  if (prefetch_enabled)
+    prefetch_report(&body, &len);
+
+  sprintf(hdr, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n%s\r\n",
+          (unsigned long)len, keep_alive ? conn_keep_alive_hdr : conn_hdr);
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = strlen(hdr);
+  iov[1].iov_base = body.data;
+  iov[1].iov_len = len;
+  rc = rio_writev(fd, iov, 2) < 0 ? -1 : 0;
+  grow_buf_release(&body);
+  return rc;
+}
+
+/** 타이머 휠 초기화, TIMER_TICK_MS마다 휠을 돌리는 쓰레드 생성 */
+void timer_init() {
+  pthread_t tid;
+  int l, i;
+
+  for (l = 0; l < TIMER_LEVELS; l++)
+    for (i = 0; i < TIMER_SLOTS; i++)
+      wheel.slots[l][i].next = wheel.slots[l][i].prev = &wheel.slots[l][i];
+  wheel.now = 0;
+  wheel.expired = 0;
+  Sem_init(&wheel.mutex, 0, 1);
+  Pthread_create(&tid, NULL, timer_thread, NULL);
+}
+
+/** 남은 tick 수로 단계를 정해서 그 단계의 칸 끝에 넣음 (O(1)) */
+// 단계 l에는 64^l <= 남은 tick < 64^(l+1)인 타이머가 들어가고, 그 칸 차례가 오면 timer_tick이 아래 단계로 다시 나눠 넣음
+void timer_add(timer_node *t) {
+  unsigned long delta;
+  timer_node *head;
+  int level = 0;
+
+  if (t->expires < wheel.now)                     // cascade 중에 이미 지난 타이머는 이번 tick에
+    t->expires = wheel.now;
+  delta = t->expires - wheel.now;
+  if (delta >= 1UL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) {
+    delta = (1UL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1;
+    t->expires = wheel.now + delta;
+  }
+  while (delta >= 1UL << (TIMER_LEVEL_BITS * (level + 1)))
+    level++;
+
+  head = &wheel.slots[level][(t->expires >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+/** t를 ms 뒤에 만료되도록 걸기, 이미 걸려 있으면 떼어서 다시 검 */
+void timer_arm(timer_node *t, int fd, int how, int ms, const char *what) {
+  P(&wheel.mutex);
+  if (t->next != NULL) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+  }
+  t->fd = fd;
+  t->how = how;
+  t->what = what;
+  t->fired = 0;
+  t->expires = wheel.now + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  timer_add(t);
+  V(&wheel.mutex);
+}
+
+/** t를 떼어냄, 이미 만료되어 fd를 shutdown했으면 1 */
+int timer_cancel(timer_node *t) {
+  int fired;
+
+  P(&wheel.mutex);
+  if (t->next != NULL) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+  }
+  fired = t->fired;
+  V(&wheel.mutex);
+  return fired;
+}
+
+/** t가 이미 만료되어 fd를 shutdown했으면 1, 떼어내지는 않음 */
+int timer_fired(timer_node *t) {
+  int fired;
+
+  P(&wheel.mutex);
+  fired = t->fired;
+  V(&wheel.mutex);
+  return fired;
+}
+
+/** tick 하나 처리: 단계가 한 바퀴 돌았으면 윗 단계 칸을 내려보내고, 0단계 칸의 타이머를 만료 */
+// 0단계 칸에 있는 타이머는 모두 이번 tick이 만료 시각. mutex를 잡고 호출
+void timer_tick() {
+  timer_node list, *t, *head;
+  int l, i;
+
+  for (l = 1; l < TIMER_LEVELS; l++) {
+    if ((wheel.now >> (TIMER_LEVEL_BITS * (l - 1))) & (TIMER_SLOTS - 1))
+      break;                                      // 아래 단계가 한 바퀴 돌지 않음
+    i = (wheel.now >> (TIMER_LEVEL_BITS * l)) & (TIMER_SLOTS - 1);
+    head = &wheel.slots[l][i];
+    if (head->next == head)
+      continue;
+    list.next = head->next;                       // 칸의 리스트를 통째로 떼어서 다시 넣음
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    head->next = head->prev = head;
+    while ((t = list.next) != &list) {
+      list.next = t->next;
+      t->next->prev = &list;
+      timer_add(t);
     }
-    write_after(i);
   }
+
+  head = &wheel.slots[0][wheel.now & (TIMER_SLOTS - 1)];
+  while ((t = head->next) != head) {
+    head->next = t->next;
+    t->next->prev = head;
+    t->next = t->prev = NULL;
+    t->fired = 1;
+    shutdown(t->fd, t->how);                      // 막혀 있던 read/write/poll이 깨어남, 닫는 것은 연결 쓰레드가
+    wheel.expired++;
+    alog_write(ALOG_WARN, ALOG_EV_TIMEOUT, -1, 0, 0, 0, 0, t->what);
+  }
+  wheel.now++;
+}
+
+/** 흐른 시간만큼 휠을 돌림 (늦게 깨어나도 밀린 tick을 모두 처리) */
+void *timer_thread(void *vargp) {
+  struct timespec start, now;
+  unsigned long target;
+
+  Pthread_detach(pthread_self());
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (1) {
+    usleep(TIMER_TICK_MS * 1000);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    target = ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000) / TIMER_TICK_MS;
+    P(&wheel.mutex);
+    while (wheel.now <= target)
+      timer_tick();
+    V(&wheel.mutex);
+  }
+  return NULL;
 }
 
-int cache_eviction() {
-  int min = LRU_MAX_NUMBER;
-  int minindex = 0;
+/** prefetch 큐와 worker 쓰레드 생성 */
+void prefetch_init(int workers, long budget) {
   int i;
-  for (i=0; i<TOTAL_CACHE_BLOCK_NUM; i++) {
-    read_before(i);
-    if (cache.blocks[i].is_empty == 1) {  // 비어 있으면 저장 가능함
-      minindex = i;
-      read_after(i);
-      break;
+  pthread_t tid;
+
+  pf_queue.front = pf_queue.rear = 0;
+  Sem_init(&pf_queue.mutex, 0, 1);
+  Sem_init(&pf_queue.slots, 0, PREFETCH_QUEUE_SIZE);
+  Sem_init(&pf_queue.items_cnt, 0, 0);
+
+  memset(&pf_stats, 0, sizeof(pf_stats));
+  pf_stats.budget = budget;
+  Sem_init(&pf_stats.mutex, 0, 1);
+  cache_hook.prefetch_used = prefetch_used;
+  cache_hook.prefetch_evicted = prefetch_evicted;
+
+  for (i = 0; i < workers; i++)                 // worker 수가 곧 동시 prefetch 수
+    Pthread_create(&tid, NULL, prefetch_thread, NULL);
+  prefetch_enabled = 1;
+}
+
+/** prefetch worker 쓰레드 루틴 */
+void *prefetch_thread(void *vargp) {
+  char *uri;
+  Pthread_detach(pthread_self());
+  while (1) {
+    P(&pf_queue.items_cnt);
+    P(&pf_queue.mutex);
+    uri = pf_queue.items[pf_queue.front];
+    pf_queue.front = (pf_queue.front + 1) % PREFETCH_QUEUE_SIZE;
+    V(&pf_queue.mutex);
+    V(&pf_queue.slots);
+
+    prefetch_fetch(uri);
+    Free(uri);
+  }
+  return NULL;
+}
+
+/** 큐에 uri를 넣음, 큐가 차 있으면 클라이언트를 기다리게 하지 않고 버림 */
+void prefetch_enqueue(char *uri) {
+  char *item;
+
+  if (sem_trywait(&pf_queue.slots) < 0) {
+    P(&pf_stats.mutex);
+    pf_stats.dropped++;
+    V(&pf_stats.mutex);
+    return;
+  }
+  item = Malloc(strlen(uri) + 1);
+  strcpy(item, uri);
+
+  P(&pf_queue.mutex);
+  pf_queue.items[pf_queue.rear] = item;
+  pf_queue.rear = (pf_queue.rear + 1) % PREFETCH_QUEUE_SIZE;
+  V(&pf_queue.mutex);
+  V(&pf_queue.items_cnt);
+
+  P(&pf_stats.mutex);
+  pf_stats.issued++;
+  V(&pf_stats.mutex);
+}
+
+/** html 본문에서 src="..." / href="..." 값을 찾아 같은 origin이면 큐에 넣음 */
+// body는 '\0'으로 끝나 있어야 함
+void prefetch_scan(char *uri, char *body, int len) {
+  char *p = body, *end = body + len, *val, *val_end;
+  char ref[MAXLINE], target[MAXLINE];
+  int attr_len;
+
+  while (p < end) {
+    if (!strncasecmp(p, "src", 3)) attr_len = 3;
+    else if (!strncasecmp(p, "href", 4)) attr_len = 4;
+    else { p++; continue; }
+
+    if (p > body && (isalnum((unsigned char)p[-1]) || p[-1] == '-')) {  // data-src 같은 다른 속성은 건너뛰기
+      p += attr_len;
+      continue;
+    }
+    p += attr_len;
+    while (p < end && isspace((unsigned char)*p)) p++;
+    if (p >= end || *p != '=') continue;
+    p++;
+    while (p < end && isspace((unsigned char)*p)) p++;
+
+    if (p < end && (*p == '"' || *p == '\'')) {  // 따옴표로 감싼 값
+      char quote = *p++;
+      val = p;
+      while (p < end && *p != quote) p++;
+    } else {                                      // 따옴표 없는 값
+      val = p;
+      while (p < end && !isspace((unsigned char)*p) && *p != '>') p++;
+    }
+    val_end = p;
+    if (val_end == val || val_end - val >= MAXLINE) continue;
+
+    memcpy(ref, val, val_end - val);
+    ref[val_end - val] = '\0';
+    if (prefetch_resolve(uri, ref, target) && strcmp(target, uri) && cache_find(target) == -1)
+      prefetch_enqueue(target);
+  }
+}
+
+/** base uri 기준으로 ref를 절대 uri로 바꿈, 다른 origin이거나 받을 수 없는 링크면 0 */
+int prefetch_resolve(char *base, char *ref, char *out) {
+  char *auth, *auth_end, *frag, *last;
+  int prefix_len;
+
+  if ((frag = strchr(ref, '#')) != NULL)        // fragment는 서버에 보내지 않음
+    *frag = '\0';
+  if (ref[0] == '\0')
+    return 0;
+
+  // base의 "scheme://host:port" 부분
+  auth = strstr(base, "//");
+  auth = auth != NULL ? auth + 2 : base;
+  auth_end = strchr(auth, '/');
+  if (auth_end == NULL)
+    auth_end = auth + strlen(auth);
+  prefix_len = auth_end - base;
+
+  if (!strncasecmp(ref, "http://", 7)) {        // 절대 uri는 host:port가 같을 때만
+    char *ref_auth = ref + 7;
+    int auth_len = auth_end - auth;
+    if (strncasecmp(ref_auth, auth, auth_len) || (ref_auth[auth_len] != '/' && ref_auth[auth_len] != '\0'))
+      return 0;
+    if (strlen(ref) >= MAXLINE) return 0;
+    strcpy(out, ref);
+    return 1;
+  }
+  if (ref[0] == '/' && ref[1] == '/')           // 다른 host일 수 있는 scheme 생략 uri
+    return 0;
+  if (strcspn(ref, ":/?") < strlen(ref) && ref[strcspn(ref, ":/?")] == ':')  // mailto:, javascript:, https: 등
+    return 0;
+
+  if (ref[0] == '/') {                          // host 기준 경로
+    if (prefix_len + strlen(ref) >= MAXLINE) return 0;
+    memcpy(out, base, prefix_len);
+    strcpy(out + prefix_len, ref);
+    return 1;
+  }
+
+  // 상대 경로는 base의 마지막 '/'까지 붙임 (query는 제외)
+  last = NULL;
+  for (char *q = auth_end; *q && *q != '?'; q++)
+    if (*q == '/') last = q;
+  prefix_len = last != NULL ? last - base + 1 : prefix_len;
+  if (prefix_len + strlen(ref) + 1 >= MAXLINE) return 0;
+  memcpy(out, base, prefix_len);
+  if (last == NULL)
+    out[prefix_len++] = '/';
+  strcpy(out + prefix_len, ref);
+  return 1;
+}
+
+/** end server에서 uri를 받아 캐쉬에 채움 (클라이언트에는 보내지 않음) */
+void prefetch_fetch(char *uri) {
+  char hostname[MAXLINE], path[MAXLINE];
+  struct iovec iov[10];
+  grow_buf obj = { NULL, 0 };
+  int port, clientfd, size = 0, budget_ok, rc, iovcnt = 0;
+  timer_node timer = { NULL };
+  rio_t rio;
+  relay_result res;
+  http_view target;
+  http_uri u;
+
+  if (cache_find(uri) != -1)                    // 그 사이에 다른 요청이 채웠으면 넘어감
+    return;
+
+  P(&pf_stats.mutex);
+  budget_ok = pf_stats.outstanding < pf_stats.budget;
+  if (!budget_ok) pf_stats.dropped++;
+  V(&pf_stats.mutex);
+  if (!budget_ok)
+    return;
+
+  target.off = 0;
+  target.len = strlen(uri);
+  if (http_parse_uri(uri, target, &u) < 0 || parse_uri(uri, &u, hostname, &port, path) < 0)
+    return;
+
+  if ((clientfd = connect_endServer(hostname, port)) < 0)
+    return;
+
+  // path와 hostname은 origin이 보낸 html에서 온 것이라 길 수 있으므로 고정 버퍼에 모으지 않고 iovec으로
+  iov_push(iov, &iovcnt, "GET ", 4);
+  iov_push(iov, &iovcnt, path, strlen(path));
+  iov_push(iov, &iovcnt, requestline_version, sizeof(requestline_version) - 1);
+  iov_push(iov, &iovcnt, host_hdr_prefix, sizeof(host_hdr_prefix) - 1);
+  iov_push(iov, &iovcnt, hostname, strlen(hostname));
+  iov_push(iov, &iovcnt, endof_hdr, sizeof(endof_hdr) - 1);
+  iov_push(iov, &iovcnt, conn_hdr, sizeof(conn_hdr) - 1);
+  iov_push(iov, &iovcnt, prox_hdr, sizeof(prox_hdr) - 1);
+  iov_push(iov, &iovcnt, user_agent_hdr, sizeof(user_agent_hdr) - 1);
+  iov_push(iov, &iovcnt, endof_hdr, sizeof(endof_hdr) - 1);
+  if (rio_writev(clientfd, iov, iovcnt) < 0) {
+    Close(clientfd);
+    return;
+  }
+
+  // 응답 framing대로 받되 캐쉬할 수 없는 응답이면 버림
+  Rio_readinitb(&rio, clientfd);
+  timer_arm(&timer, clientfd, SHUT_RDWR, FIRST_BYTE_TIMEOUT, "prefetch response");   // 응답하지 않는 서버가 worker를 붙잡지 않게
+  rc = relay_response(&rio, -1, 0, NULL, &obj, &res, &timer);
+  if (timer_cancel(&timer))                                         // 연결 종료 framing이면 잘린 응답이 완료처럼 보임
+    rc = RELAY_ABORTED;
+  if (rc < 0 || !res.cacheable) {
+    Close(clientfd);
+    grow_buf_release(&obj);
+    return;
+  }
+  Close(clientfd);
+  size = res.size;
+
+  P(&pf_stats.mutex);
+  budget_ok = pf_stats.outstanding + size <= pf_stats.budget;
+  if (budget_ok) {
+    pf_stats.outstanding += size;
+    pf_stats.fetched++;
+    pf_stats.bytes += size;
+  } else {
+    pf_stats.dropped++;
+  }
+  V(&pf_stats.mutex);
+
+  if (budget_ok && cache_find(uri) == -1)
+    cache_uri(uri, obj.data, size, res.conn_off, 1);
+  else if (budget_ok) {                         // 받는 사이에 클라이언트 요청이 먼저 채움
+    P(&pf_stats.mutex);
+    pf_stats.outstanding -= size;
+    pf_stats.fetched--;
+    V(&pf_stats.mutex);
+  }
+  grow_buf_release(&obj);
+}
+
+/** prefetch된 블록이 처음으로 클라이언트 요청에 쓰임 (cache_get이 한 번만 부름) */
+void prefetch_used(cache_obj *obj) {
+  P(&pf_stats.mutex);
+  pf_stats.outstanding -= obj->size;
+  pf_stats.hits++;
+  V(&pf_stats.mutex);
+}
+
+/** prefetch된 블록이 한 번도 쓰이지 않고 evict됨 (블록 쓰기 잠금 안에서) */
+void prefetch_evicted(cache_obj *obj) {
+  P(&pf_stats.mutex);
+  pf_stats.outstanding -= obj->size;
+  pf_stats.wasted++;
+  V(&pf_stats.mutex);
+}
+
+/** prefetch 통계를 metrics 응답에 덧붙임 */
+// 캐쉬 적중 경로에서 stdout에 쓰지 않도록 /__proxy/metrics로만 내보냄
+void prefetch_report(grow_buf *body, size_t *len) {
+  prefetch_stats st;
+
+  P(&pf_stats.mutex);
+  st = pf_stats;
+  V(&pf_stats.mutex);
+  stats_append(body, len, "# HELP proxy_prefetch_requests_total Prefetches, by what became of them.\n"
+               "# TYPE proxy_prefetch_requests_total counter\n"
+               "proxy_prefetch_requests_total{result=\"issued\"} %ld\n"
+               "proxy_prefetch_requests_total{result=\"dropped\"} %ld\n"
+               "proxy_prefetch_requests_total{result=\"fetched\"} %ld\n"
+               "proxy_prefetch_requests_total{result=\"used\"} %ld\n"
+               "proxy_prefetch_requests_total{result=\"wasted\"} %ld\n"
+               "# HELP proxy_prefetch_bytes_total Bytes fetched by prefetches.\n"
+               "# TYPE proxy_prefetch_bytes_total counter\n"
+               "proxy_prefetch_bytes_total %ld\n"
+               "# HELP proxy_prefetch_hit_ratio Share of fetched prefetches used by a client.\n"
+               "# TYPE proxy_prefetch_hit_ratio gauge\n"
+               "proxy_prefetch_hit_ratio %.4f\n",
+               st.issued, st.dropped, st.fetched, st.hits, st.wasted, st.bytes,
+               st.fetched ? (double)st.hits / st.fetched : 0.0);
+}
+
+/** SNAPSHOT_SIGNAL은 스냅샷 쓰레드만 sigwait로 받도록 막아둠 */
+void snapshot_block_signal() {
+  sigset_t mask;
+  Sigemptyset(&mask);
+  Sigaddset(&mask, SNAPSHOT_SIGNAL);
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+    app_error("pthread_sigmask error");
+}
+
+/** 스냅샷 쓰레드 생성 */
+void snapshot_start(char *path) {
+  pthread_t tid;
+  Pthread_create(&tid, NULL, snapshot_thread, path);
+}
+
+/** 시그널을 받을 때마다 스냅샷 저장, 트래픽은 멈추지 않음 */
+void *snapshot_thread(void *vargp) {
+  char *path = (char *)vargp, msg[MAXLINE];
+  sigset_t mask;
+  int sig;
+
+  Pthread_detach(pthread_self());
+  Sigemptyset(&mask);
+  Sigaddset(&mask, SNAPSHOT_SIGNAL);
+  while (1) {
+    if (sigwait(&mask, &sig) != 0)
+      continue;
+    if (snapshot_save(path) == 0) {                                     // 다른 쓰레드의 로그와 섞이지 않도록 alog로
+      snprintf(msg, sizeof(msg), "saved cache snapshot %s", path);
+      alog_msg(ALOG_INFO, msg);
     }
-    if (cache.blocks[i].LRU < min) {    // 우선 순위가 낮은 캐쉬블록으로 갱신
-      minindex = i;
-      min = cache.blocks[i]. LRU;
+  }
+  return NULL;
+}
+
+/** 캐쉬 블록을 하나씩 읽기 잠금하면서 임시 파일에 쓰고, 다 쓰면 rename으로 교체 */
+// 한 번에 한 블록만 잠그므로 다른 블록의 요청은 기다리지 않음
+int snapshot_save(char *path) {
+  char tmp_path[MAXLINE];
+  snapshot_header hdr;
+  snapshot_entry ent;
+  FILE *fp;
+  int i, err = 0;
+
+  snprintf(tmp_path, MAXLINE, "%s.tmp", path);
+  if ((fp = fopen(tmp_path, "wb")) == NULL) {
+    fprintf(stderr, "snapshot_save: %s: %s\n", tmp_path, strerror(errno));
+    return -1;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)        // count는 마지막에 채움
+    err = 1;
+
+  for (i = 0; i < TOTAL_CACHE_BLOCK_NUM && !err; i++) {
+    read_before(i);
+    if (cache.blocks[i].is_empty == 0) {
+      ent.uri_len = strlen(cache.blocks[i].cache_uri);
+      ent.size = cache.blocks[i].cache_object->size;
+      ent.conn_off = cache.blocks[i].cache_object->conn_off;
+      if (fwrite(&ent, sizeof(ent), 1, fp) != 1
+          || fwrite(cache.blocks[i].cache_uri, 1, ent.uri_len, fp) != ent.uri_len
+          || fwrite(cache.blocks[i].cache_object->data, 1, ent.size, fp) != ent.size)
+        err = 1;
+      hdr.count++;
     }
     read_after(i);
   }
 
-  return minindex;
+  if (!err && (fseek(fp, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1))
+    err = 1;
+  if (fclose(fp) != 0)
+    err = 1;
+  if (err || rename(tmp_path, path) < 0) {
+    fprintf(stderr, "snapshot_save: %s: %s\n", path, strerror(errno));
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
 }
-void read_before(int i) {
-  P(&cache.blocks[i].read_cnt_mutex);
-  cache.blocks[i].read_cnt++;
-  if (cache.blocks[i].read_cnt == 1)
-    write_before(i);
-  V(&cache.blocks[i].read_cnt_mutex);
+
+/** 스냅샷 파일을 mmap만 해둠, 파일이 없으면 빈 캐쉬로 시작 */
+int snapshot_load(char *path) {
+  struct stat sbuf;
+  int fd;
+
+  Sem_init(&snap_mutex, 0, 1);
+  if ((fd = open(path, O_RDONLY, 0)) < 0)
+    return -1;
+  if (fstat(fd, &sbuf) < 0 || sbuf.st_size < sizeof(snapshot_header)) {
+    close(fd);
+    return -1;
+  }
+  snap_map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (snap_map == MAP_FAILED || memcmp(snap_map, SNAPSHOT_MAGIC, 8)) {
+    if (snap_map != MAP_FAILED)
+      munmap(snap_map, sbuf.st_size);
+    fprintf(stderr, "snapshot_load: %s is not a cache snapshot\n", path);
+    snap_map = NULL;
+    return -1;
+  }
+  snap_map_size = sbuf.st_size;
+  return 0;
 }
 
-void read_after(int i) {
-  P(&cache.blocks[i].read_cnt_mutex);
-  cache.blocks[i].read_cnt--;
-  if (cache.blocks[i].read_cnt == 0)
-    write_after(i);
-  V(&cache.blocks[i].read_cnt_mutex);
+/** 처음 찾을 때 한 번만 entry들의 위치를 인덱스로 만듦 */
+void snapshot_build_index() {
+  snapshot_header *hdr = (snapshot_header *)snap_map;
+  snapshot_entry ent;
+  size_t off = sizeof(snapshot_header);
+  int i;
+
+  snap_index = Calloc(hdr->count ? hdr->count : 1, sizeof(snapshot_index));
+  for (i = 0; i < hdr->count; i++) {
+    if (off + sizeof(ent) > snap_map_size)
+      break;
+    memcpy(&ent, snap_map + off, sizeof(ent));   // 정렬되지 않은 위치일 수 있음
+    off += sizeof(ent);
+    if (ent.uri_len >= MAXLINE || ent.size >= MAX_OBJECT_SIZE || ent.conn_off > ent.size
+        || off + ent.uri_len + ent.size > snap_map_size)
+      break;                                     // 잘린 파일이면 앞부분만 사용
+    snap_index[i].uri = snap_map + off;
+    snap_index[i].uri_len = ent.uri_len;
+    snap_index[i].object = snap_map + off + ent.uri_len;
+    snap_index[i].size = ent.size;
+    snap_index[i].conn_off = ent.conn_off;
+    off += ent.uri_len + ent.size;
+  }
+  snap_count = i;
 }
 
-void write_before(int i) {
-  P(&cache.blocks[i].write_mutex);
+/** uri가 아직 옮기지 않은 스냅샷 entry에 있으면 옮긴 것으로 표시하고 index, 없으면 -1 */
+int snapshot_take(char *uri) {
+  int i, found = -1;
+  size_t len = strlen(uri);
+
+  Pthread_once(&snap_index_once, snapshot_build_index);
+
+  P(&snap_mutex);
+  for (i = 0; i < snap_count; i++) {
+    if (!snap_index[i].restored && snap_index[i].uri_len == len
+        && memcmp(snap_index[i].uri, uri, len) == 0) {
+      snap_index[i].restored = 1;              // 한 번만 옮김
+      found = i;
+      break;
+    }
+  }
+  V(&snap_mutex);
+  return found;
 }
 
-void write_after(int i) {
-  V(&cache.blocks[i].write_mutex);
+/** uri가 아직 옮기지 않은 스냅샷 entry에 있으면 캐쉬에 채우고 1 */
+int snapshot_restore(char *uri) {
+  int found;
+
+  if ((found = snapshot_take(uri)) < 0)
+    return 0;
+  cache_uri(uri, snap_index[found].object, snap_index[found].size, snap_index[found].conn_off, 0);
+  return 1;
 }
@@ -1,10 +1,69 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ * Run by tiny -c with TINY_WORKER_FD set, it stays up and answers one
+ * request after another on that socket (see ../cgipool.h).
  */
 /* $begin adder */
 #include "csapp.h"
 
+void add(void);
+int next_request(int sockfd);
+
 int main(void) {
+    char *fdstr;
+    int sockfd;
+
+    if ((fdstr = getenv("TINY_WORKER_FD")) == NULL) {   // 보통의 CGI: 요청 하나를 처리하고 끝남
+        add();
+        exit(0);
+    }
+    sockfd = atoi(fdstr);
+    send(sockfd, "", 1, 0);                             // 준비됐다고 알림
+    while (next_request(sockfd) == 0) {                 // 요청마다 환경변수와 표준 출력을 바꿔서 같은 코드를 실행
+        add();
+        close(STDOUT_FILENO);                           // 연결은 tiny와 이 프로세스만 들고 있으므로 닫아야 client가 끝을 봄
+        send(sockfd, "", 1, 0);                         // 끝났다고 알림
+    }
+    exit(0);                                            // tiny가 소켓을 닫음
+}
+
+/** tiny가 보낸 요청 하나를 받아서 환경변수와 표준 출력으로 만듦 */
+// 메세지는 "<method>\0<query>\0"이고 client 연결 식별자가 SCM_RIGHTS로 붙어 옴
+int next_request(int sockfd) {
+    char buf[2 * MAXLINE];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov = { buf, sizeof(buf) - 1 };
+    ssize_t n;
+    int connfd;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    while ((n = recvmsg(sockfd, &msg, 0)) < 0 && errno == EINTR)
+        ;
+    if (n <= 0 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    memcpy(&connfd, CMSG_DATA(cmsg), sizeof(int));
+    buf[n] = '\0';
+    setenv("REQUEST_METHOD", buf, 1);
+    setenv("QUERY_STRING", buf + strlen(buf) + 1, 1);
+    if (connfd != STDOUT_FILENO) {                      // 앞 요청에서 1번을 닫았으므로 받은 식별자가 바로 1번일 수 있음
+        dup2(connfd, STDOUT_FILENO);
+        close(connfd);
+    }
+    return 0;
+}
+
+/** 두 수를 더한 응답을 표준 출력에 씀 */
+void add(void) {
     char *buf, *p, *method;
     char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
     int n1 = 0, n2 = 0;
@@ -32,13 +91,11 @@ int main(void) {
 
     // HTTP response 출력
     printf("Connection: close\r\n");
-    printf("Content-length %d\r\n", (int)strlen(content));
+    printf("Content-length: %d\r\n", (int)strlen(content));
     printf("Content-type: text/html\r\n\r\n");
 
     if (strcasecmp(method, "HEAD") != 0) printf("%s", content);     // HEAD method는 본문을 출력하지 않음
     
     fflush(stdout);
-
-    exit(0);
 }
 /* $end adder */
@@ -0,0 +1,260 @@
+/*
+ * cgipool.c - persistent CGI worker processes (see cgipool.h)
+ *
+ * Each program has a fixed array of worker slots and a stack of the
+ * idle ones under its own mutex. A thread pops a slot, which is then
+ * its alone: it starts the worker if the slot has none, hands over the
+ * request and waits for the answer without holding any lock, then
+ * pushes the slot back. The top of the stack is the worker used last,
+ * so a light load keeps reusing the same few processes.
+ */
+#include "csapp.h"
+#include "cgipool.h"
+#include <poll.h>
+
+#define READY_TIMEOUT 1000          /* ms a new worker has to say it is ready */
+
+typedef struct {
+    pid_t pid;                      /* 0 if not running */
+    int fd;                         /* tiny's end of the worker's socket */
+} cgi_worker;
+
+typedef struct {
+    char *path;
+    int started;                    /* A worker has said it was ready */
+    int broken;                     /* Its first worker never did: not a worker program */
+    cgi_worker workers[CGIPOOL_MAX_WORKERS];
+    int idle[CGIPOOL_MAX_WORKERS];  /* Slots not serving a request, a stack */
+    int nidle;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;            /* A slot was pushed back, or broken was set */
+} cgi_prog;
+
+static int nworkers;                /* Per program, 0: no pool */
+static cgi_prog *progs[CGIPOOL_MAX_PROGS];
+static int nprogs;
+static pthread_mutex_t progs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long n_requests, n_died, n_running;
+
+void cgipool_init(int n)
+{
+    nworkers = n < CGIPOOL_MAX_WORKERS ? n : CGIPOOL_MAX_WORKERS;
+}
+
+/* The program at path, added on first use; NULL if the table is full */
+static cgi_prog *find_prog(const char *path)
+{
+    cgi_prog *p = NULL;
+    int i;
+
+    pthread_mutex_lock(&progs_mutex);
+    for (i = 0; i < nprogs; i++)
+        if (!strcmp(progs[i]->path, path)) {
+            p = progs[i];
+            break;
+        }
+    if (p == NULL && nprogs < CGIPOOL_MAX_PROGS) {
+        p = Calloc(1, sizeof(cgi_prog));
+        p->path = strdup(path);
+        for (i = 0; i < nworkers; i++)
+            p->idle[i] = nworkers - 1 - i;                  /* Slot 0 on top */
+        p->nidle = nworkers;
+        pthread_mutex_init(&p->mutex, NULL);
+        pthread_cond_init(&p->cond, NULL);
+        progs[nprogs++] = p;
+    }
+    pthread_mutex_unlock(&progs_mutex);
+    return p;
+}
+
+/* Reap w's process and close its socket */
+static void stop(cgi_worker *w)
+{
+    close(w->fd);
+    kill(w->pid, SIGKILL);                                  /* It may only have closed its end */
+    while (waitpid(w->pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+    w->pid = 0;
+    __atomic_sub_fetch(&n_running, 1, __ATOMIC_RELAXED);
+}
+
+/* Wait for w's one-byte message; -1 if it exited or hung up, -2 if it took longer than timeout ms */
+static int wait_ready(cgi_worker *w, int timeout)
+{
+    struct pollfd pfd = { w->fd, POLLIN, 0 };
+    char c;
+    int n;
+
+    while ((n = poll(&pfd, 1, timeout)) < 0 && errno == EINTR)
+        ;
+    if (n == 0)
+        return -2;
+    if (n < 0)
+        return -1;
+    while ((n = recv(w->fd, &c, 1, 0)) < 0 && errno == EINTR)
+        ;
+    return n == 1 ? 0 : -1;
+}
+
+char **cgipool_envp(char **vars)
+{
+    char **envp, **e, **v;
+    size_t n = 0, len;
+
+    for (e = environ; *e; e++)
+        n++;
+    for (v = vars; *v; v++)
+        n++;
+    envp = Malloc((n + 1) * sizeof(char *));
+    n = 0;
+    for (e = environ; *e; e++) {
+        for (v = vars; *v; v++) {
+            len = strchr(*v, '=') - *v + 1;                 /* Name and '=' */
+            if (!strncmp(*e, *v, len))
+                break;
+        }
+        if (*v == NULL)                                     /* Not replaced */
+            envp[n++] = *e;
+    }
+    for (v = vars; *v; v++)
+        envp[n++] = *v;
+    envp[n] = NULL;
+    return envp;
+}
+
+/* Run the program in slot w; -1 if it can't be started or doesn't act as a worker */
+static int start(cgi_prog *p, cgi_worker *w)
+{
+    char *argv[] = { p->path, NULL }, fdvar[32], *vars[] = { fdvar, NULL }, **envp;
+    int sv[2];
+
+    /* Both ends close-on-exec, so CGI programs forked by other threads don't hold them */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    /* Everything the child needs is built here: after fork() in a threaded
+       process it may only make async-signal-safe calls */
+    snprintf(fdvar, sizeof(fdvar), "TINY_WORKER_FD=%d", sv[1]);
+    envp = cgipool_envp(vars);
+    if ((w->pid = fork()) < 0) {
+        free(envp);
+        close(sv[0]);
+        close(sv[1]);
+        w->pid = 0;
+        return -1;
+    }
+    if (w->pid == 0) {
+        fcntl(sv[1], F_SETFD, 0);
+        execve(p->path, argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+    w->fd = sv[0];
+    __atomic_add_fetch(&n_running, 1, __ATOMIC_RELAXED);
+    if (wait_ready(w, READY_TIMEOUT) < 0) {
+        stop(w);
+        return -1;
+    }
+    pthread_mutex_lock(&p->mutex);
+    p->started = 1;
+    pthread_mutex_unlock(&p->mutex);
+    return 0;
+}
+
+/* Send one request with connfd attached; -1 if the worker is gone */
+static int send_request(cgi_worker *w, int connfd, char *method, char *cgiargs)
+{
+    char buf[2 * MAXLINE];
+    union {                                                 /* Aligned for the cmsghdr */
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "%s%c%s", method, '\0', cgiargs) + 1;
+    if (n > (int)sizeof(buf))
+        return -1;
+    iov.iov_base = buf;
+    iov.iov_len = n;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &connfd, sizeof(int));
+
+    while ((n = sendmsg(w->fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return n < 0 ? -1 : 0;
+}
+
+int cgipool_run(char *filename, int connfd, char *cgiargs, char *method)
+{
+    cgi_prog *p;
+    cgi_worker *w;
+    int slot, tries, n, rc = -1;
+
+    if (nworkers == 0 || (p = find_prog(filename)) == NULL)
+        return -1;
+    pthread_mutex_lock(&p->mutex);
+    while (p->nidle == 0 && !p->broken)
+        pthread_cond_wait(&p->cond, &p->mutex);
+    if (p->broken) {
+        pthread_mutex_unlock(&p->mutex);
+        return -1;
+    }
+    slot = p->idle[--p->nidle];
+    pthread_mutex_unlock(&p->mutex);
+    w = &p->workers[slot];
+
+    /* Twice: an idle worker may have died since its last request */
+    for (tries = 0; tries < 2 && rc < 0; tries++) {
+        n = -1;
+        if (w->pid == 0 && start(p, w) < 0) {
+            /* Only a program that never came up is given up on; a failed
+               restart may be a passing fork() or socketpair() failure, and
+               this request goes to the fork path while the next one retries */
+            pthread_mutex_lock(&p->mutex);
+            if (!p->started)
+                p->broken = 1;
+            pthread_mutex_unlock(&p->mutex);
+            break;
+        }
+        if (send_request(w, connfd, method, cgiargs) == 0) {
+            if ((n = wait_ready(w, CGIPOOL_TIMEOUT)) == 0) {
+                rc = 0;
+                __atomic_add_fetch(&n_requests, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            rc = n == -2 ? -1 : 0;                          /* A hung worker's request is forked */
+        }
+        stop(w);
+        __atomic_add_fetch(&n_died, 1, __ATOMIC_RELAXED);
+        if (n == -2)
+            break;
+    }
+
+    pthread_mutex_lock(&p->mutex);
+    p->idle[p->nidle++] = slot;
+    if (p->broken)
+        pthread_cond_broadcast(&p->cond);                   /* Waiters go to the fork path */
+    else
+        pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    return rc;
+}
+
+void cgipool_stats(cgipool_stat *st)
+{
+    st->requests = __atomic_load_n(&n_requests, __ATOMIC_RELAXED);
+    st->died = __atomic_load_n(&n_died, __ATOMIC_RELAXED);
+    st->workers = __atomic_load_n(&n_running, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,55 @@
+/*
+ * cgipool.h - persistent CGI worker processes for tiny's dynamic content
+ *
+ * Instead of a fork() and execve() per request, each CGI program is
+ * started as nworkers long-lived processes the first time it is asked
+ * for, and every request is handed to an idle one. A worker is run with
+ * TINY_WORKER_FD=<fd> in its environment, naming its end of an AF_UNIX
+ * SOCK_SEQPACKET socket. For each request, tiny sends one message on it:
+ *
+ *     "<REQUEST_METHOD>\0<QUERY_STRING>\0"
+ *
+ * with the client connection attached as SCM_RIGHTS. The worker writes
+ * the rest of the response (tiny has sent the status line and Server
+ * header) to that descriptor, closes it, and answers with a one-byte
+ * message. Until then the worker is busy; a request that finds every
+ * worker of its program busy waits for one. Workers are started as
+ * requests need them, up to nworkers per program.
+ *
+ * A worker also sends a one-byte message once it is ready, before its
+ * first request. A program whose first worker doesn't within a second
+ * is taken to be an ordinary CGI program and is left to the fork path
+ * from then on: that is what cgipool_run()'s -1 means. A worker that
+ * exits or closes its socket after that is reaped and started again
+ * when next needed; the request it was serving, if any, gets whatever
+ * it wrote. A worker that hasn't answered within CGIPOOL_TIMEOUT is
+ * killed the same way and its request is forked instead. If starting
+ * it again fails, that one request is forked and the next one tries
+ * again.
+ *
+ * cgipool_envp() returns environ with the "NAME=value" strings of the
+ * NULL-terminated vars in place of any entries of the same names, for
+ * execve() in a child: the child of a threaded process can't safely
+ * call setenv(). Only the array is malloc'd; the caller frees it.
+ */
+#ifndef __CGIPOOL_H__
+#define __CGIPOOL_H__
+
+#include "csapp.h"
+
+#define CGIPOOL_MAX_PROGS 16        /* Programs with workers at most */
+#define CGIPOOL_MAX_WORKERS 64      /* Workers per program at most */
+#define CGIPOOL_TIMEOUT 30000       /* ms a worker has to answer a request */
+
+typedef struct {
+    long requests;                  /* Requests answered by a worker */
+    long died;                      /* Workers that exited, hung up or timed out, to be started again */
+    long workers;                   /* Running now */
+} cgipool_stat;
+
+void cgipool_init(int nworkers);
+int cgipool_run(char *filename, int connfd, char *cgiargs, char *method);
+void cgipool_stats(cgipool_stat *st);
+char **cgipool_envp(char **vars);
+
+#endif /* __CGIPOOL_H__ */
@@ -0,0 +1,317 @@
+/*
+ * fcache.c - open file cache for tiny's static content (see fcache.h)
+ *
+ * A hash table of entries under one readers-writer lock, so lookups run
+ * in parallel and only adding or dropping an entry takes it exclusively.
+ * A background thread reads inotify events for the watched directories
+ * and drops the entry named by each. Every event also bumps the
+ * generation number of the entry's bucket, and fcache_insert() refuses
+ * an entry opened before the last event in its bucket: that event may
+ * have been about the file it holds and have come before the entry was
+ * in the table to be dropped.
+ *
+ * An entry's body is read into memory before the entry is
+ * inserted, outside the lock; the bytes are reserved against mem_max
+ * first and given back when the entry is freed.
+ */
+#include "csapp.h"
+#include "fcache.h"
+#include <sys/inotify.h>
+
+#define FCACHE_BUCKETS 1024         /* A power of two */
+#define FCACHE_MAX_DIRS 256         /* Watched directories */
+#define FCACHE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+                       | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct {
+    int wd;
+    char *path;
+} fcache_dir;
+
+static fentry *buckets[FCACHE_BUCKETS];
+static int nentries;
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int inotify_fd = -1;         /* -1: nothing is cached */
+static fcache_dir dirs[FCACHE_MAX_DIRS];
+static int ndirs;
+static long gens[FCACHE_BUCKETS];   /* Events seen so far, per bucket */
+
+static long mem_max;                /* Bytes of bodies kept at most */
+static long resident;
+static long n_lookups, n_hits, n_mem_hits;
+
+static unsigned hash(const char *s)
+{
+    unsigned h = 2166136261u;                               /* FNV-1a */
+
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h & (FCACHE_BUCKETS - 1);
+}
+
+static fentry *find(const char *path)
+{
+    fentry *e;
+
+    for (e = buckets[hash(path)]; e != NULL; e = e->next)
+        if (!strcmp(e->path, path))
+            break;
+    return e;
+}
+
+/* Unlink the entry for path; its table reference is the caller's to drop */
+static fentry *unlink_entry(const char *path)
+{
+    fentry **pp, *e;
+
+    for (pp = &buckets[hash(path)]; (e = *pp) != NULL; pp = &e->next)
+        if (!strcmp(e->path, path)) {
+            *pp = e->next;
+            nentries--;
+            return e;
+        }
+    return NULL;
+}
+
+/* Drop every entry, when events were lost or a directory went away */
+static void flush_all(void)
+{
+    fentry *e, *next, *dead = NULL;
+    int i;
+
+    pthread_rwlock_wrlock(&lock);
+    for (i = 0; i < FCACHE_BUCKETS; i++) {
+        gens[i]++;
+        for (e = buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            e->next = dead;
+            dead = e;
+        }
+        buckets[i] = NULL;
+    }
+    nentries = 0;
+    pthread_rwlock_unlock(&lock);
+    for (e = dead; e != NULL; e = next) {
+        next = e->next;
+        fcache_release(e);
+    }
+}
+
+/* Drop name in directory wd, under every spelling of the directory watched ("." and "./" share a wd) */
+static void invalidate(int wd, const char *name)
+{
+    char path[MAXLINE];
+    fentry *e, *dead = NULL;
+    int i;
+
+    pthread_rwlock_wrlock(&lock);
+    for (i = 0; i < ndirs; i++)
+        if (dirs[i].wd == wd) {
+            snprintf(path, sizeof(path), "%s/%s", dirs[i].path, name);
+            gens[hash(path)]++;
+            if ((e = unlink_entry(path)) != NULL) {
+                e->next = dead;
+                dead = e;
+            }
+        }
+    pthread_rwlock_unlock(&lock);
+    for (; dead != NULL; dead = e) {
+        e = dead->next;
+        fcache_release(dead);
+    }
+}
+
+/* The watch on wd is gone; the directory is watched again when next needed */
+static void unwatch(int wd)
+{
+    int i;
+
+    pthread_rwlock_wrlock(&lock);
+    for (i = 0; i < ndirs; i++)
+        if (dirs[i].wd == wd) {
+            Free(dirs[i].path);
+            dirs[i--] = dirs[--ndirs];
+        }
+    pthread_rwlock_unlock(&lock);
+}
+
+static void *inotify_thread(void *vargp)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if ((n = read(inotify_fd, buf, sizeof(buf))) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *)p;
+            if (ev->mask & IN_IGNORED)
+                unwatch(ev->wd);
+            if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+                flush_all();
+            else if (ev->len > 0)
+                invalidate(ev->wd, ev->name);
+        }
+    }
+    flush_all();                                            /* Can't tell what changes any more */
+    inotify_fd = -1;
+    return NULL;
+}
+
+void fcache_init(long max)
+{
+    pthread_t tid;
+
+    mem_max = max;
+    if ((inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "fcache: inotify_init1: %s, not caching\n", strerror(errno));
+        return;
+    }
+    Pthread_create(&tid, NULL, inotify_thread, NULL);
+}
+
+fentry *fcache_lookup(const char *path)
+{
+    fentry *e;
+
+    pthread_rwlock_rdlock(&lock);
+    if ((e = find(path)) != NULL)
+        __atomic_fetch_add(&e->refcnt, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&lock);
+
+    __atomic_fetch_add(&n_lookups, 1, __ATOMIC_RELAXED);
+    if (e != NULL) {
+        __atomic_fetch_add(&n_hits, 1, __ATOMIC_RELAXED);
+        if (e->body != NULL)
+            __atomic_fetch_add(&n_mem_hits, 1, __ATOMIC_RELAXED);
+    }
+    return e;
+}
+
+/* Watch the directory path is in, once; -1 if it can't be */
+static int watch_dir(const char *path)
+{
+    char dir[MAXLINE], *slash;
+    int i, wd;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    if ((slash = strrchr(dir, '/')) == NULL)
+        strcpy(dir, ".");
+    else
+        *slash = '\0';
+
+    pthread_rwlock_wrlock(&lock);
+    for (i = 0; i < ndirs; i++)
+        if (!strcmp(dirs[i].path, dir))
+            break;
+    if (i == ndirs) {
+        if (ndirs == FCACHE_MAX_DIRS || inotify_fd < 0
+            || (wd = inotify_add_watch(inotify_fd, dir, FCACHE_EVENTS)) < 0) {
+            pthread_rwlock_unlock(&lock);
+            return -1;
+        }
+        dirs[ndirs].wd = wd;
+        dirs[ndirs++].path = strdup(dir);
+    }
+    pthread_rwlock_unlock(&lock);
+    return 0;
+}
+
+fentry *fcache_open(const char *path)
+{
+    fentry *e = Calloc(1, sizeof(fentry));
+    struct stat sbuf;
+
+    /* Watch first, so no change after the open can go unseen */
+    e->refcnt = 1;
+    if (watch_dir(path) < 0)
+        e->gen = -1;
+    else {
+        pthread_rwlock_rdlock(&lock);
+        e->gen = gens[hash(path)];
+        pthread_rwlock_unlock(&lock);
+    }
+    if ((e->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(e->fd, &sbuf) < 0) {
+        if (e->fd >= 0)
+            close(e->fd);
+        Free(e);
+        return NULL;
+    }
+    e->path = strdup(path);
+    e->size = sbuf.st_size;
+    e->mtime = sbuf.st_mtime;
+    return e;
+}
+
+/* Read e's whole file into memory, if it is small and there is room */
+static void load(fentry *e)
+{
+    ssize_t n;
+    off_t off;
+
+    if (e->size == 0 || e->size > FCACHE_BODY_MAX)
+        return;
+    if (__atomic_add_fetch(&resident, e->size, __ATOMIC_RELAXED) > mem_max) {
+        __atomic_sub_fetch(&resident, e->size, __ATOMIC_RELAXED);
+        return;
+    }
+    e->body = Malloc(e->size);
+    for (off = 0; off < e->size; off += n)
+        if ((n = pread(e->fd, e->body + off, e->size - off, off)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            Free(e->body);                                  /* The file shrank; send from the fd */
+            e->body = NULL;
+            __atomic_sub_fetch(&resident, e->size, __ATOMIC_RELAXED);
+            return;
+        }
+}
+
+void fcache_insert(fentry *e)
+{
+    if (e->gen < 0)
+        return;
+    load(e);
+    pthread_rwlock_wrlock(&lock);
+    if (e->gen == gens[hash(e->path)] && nentries < FCACHE_MAX_ENTRIES && find(e->path) == NULL) {
+        e->next = buckets[hash(e->path)];
+        buckets[hash(e->path)] = e;
+        nentries++;
+        e->refcnt++;                                        /* The table's */
+    }
+    pthread_rwlock_unlock(&lock);
+}
+
+void fcache_release(fentry *e)
+{
+    if (__atomic_sub_fetch(&e->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    close(e->fd);
+    if (e->body != NULL) {
+        Free(e->body);
+        __atomic_sub_fetch(&resident, e->size, __ATOMIC_RELAXED);
+    }
+    Free(e->path);
+    Free(e->hdr);
+    Free(e);
+}
+
+void fcache_stats(fcache_stat *st)
+{
+    st->lookups = __atomic_load_n(&n_lookups, __ATOMIC_RELAXED);
+    st->hits = __atomic_load_n(&n_hits, __ATOMIC_RELAXED);
+    st->mem_hits = __atomic_load_n(&n_mem_hits, __ATOMIC_RELAXED);
+    st->resident = __atomic_load_n(&resident, __ATOMIC_RELAXED);
+    pthread_rwlock_rdlock(&lock);
+    st->entries = nentries;
+    pthread_rwlock_unlock(&lock);
+}
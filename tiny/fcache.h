@@ -0,0 +1,62 @@
+/*
+ * fcache.h - open file cache for tiny's static content
+ *
+ * Keeps, for each static file served, an open descriptor, its size and
+ * modification time, its MIME type and the response header already
+ * formatted, so serving a cached file takes no stat(), open() or
+ * close() and no header formatting. An inotify watch on the directory
+ * of every cached file drops an entry as soon as the file is written,
+ * replaced, renamed, removed or has its mode changed.
+ *
+ * Files up to FCACHE_BODY_MAX bytes are also kept in memory, so a hit
+ * is a single writev() of the header and the body. Those bodies take at
+ * most the mem_max bytes given to fcache_init(); once that is used up,
+ * further files are served from their descriptors until invalidations
+ * free some room.
+ *
+ * On a miss the caller opens the file with fcache_open(), fills in
+ * filetype and hdr, and publishes the entry with fcache_insert(). Entries
+ * are reference counted: a thread that got one can keep sending from
+ * its descriptor after the entry has been invalidated, and gives it back
+ * with fcache_release().
+ */
+#ifndef __FCACHE_H__
+#define __FCACHE_H__
+
+#include "csapp.h"
+
+#define FCACHE_MAX_ENTRIES 1024     /* Open descriptors kept at most */
+#define FCACHE_BODY_MAX 65536       /* Largest file kept in memory */
+
+typedef struct fentry {
+    struct fentry *next;            /* Hash chain */
+    char *path;
+    int fd;
+    off_t size;
+    time_t mtime;
+    char filetype[64];
+    char last_modified[40];         /* HTTP date of mtime */
+    char etag[48];
+    char *hdr;                      /* Response header up to the Connection line, malloc'd */
+    size_t hdr_len;
+    char *body;                     /* The whole file, or NULL */
+    int refcnt;                     /* The table's reference, if cached, plus users */
+    long gen;                       /* Bucket's invalidations before it was opened, -1 if it can't be cached */
+} fentry;
+
+typedef struct {
+    long lookups;                   /* fcache_lookup() calls */
+    long hits;                      /* ... that found an entry */
+    long mem_hits;                  /* ... that found the response in memory */
+    long entries;
+    long resident;                  /* Bytes of files held in memory */
+} fcache_stat;
+
+void fcache_init(long mem_max);
+fentry *fcache_lookup(const char *path);    /* NULL if not cached */
+fentry *fcache_open(const char *path);      /* New uncached entry; NULL if path can't be opened */
+void fcache_insert(fentry *e);              /* Cache e, unless the cache is full or can't watch it */
+void fcache_release(fentry *e);
+void fcache_stats(fcache_stat *st);
+
+#endif /* __FCACHE_H__ */
@@ -1,46 +1,120 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple HTTP Web server that uses the GET method to serve
+ *     static and dynamic content. Iterative by default; with
+ *     -t <threads> the main thread only accepts connections and a
+ *     prethreaded pool of workers serves them, keeping connections
+ *     alive (and reading pipelined requests) up to -r requests, closing
+ *     them after -k idle seconds. Responses are HTTP/1.1, every one
+ *     framed by Content-length or by closing the connection. With
+ *     -c <workers>, CGI programs that support it run as that many
+ *     persistent processes each instead of a fork per request.
  *
  * Updated 11/2019 droh
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
  */
 #include "csapp.h"
+#include "sbuf.h"
+#include "fcache.h"
+#include "cgipool.h"
+#include <sys/sendfile.h>
+#include <ctype.h>
+#include <netinet/tcp.h>
 
-void doit(int fd);                                                                      // 한 개의 HTTP 트랜잭션을 처리
-void read_requesthdrs(rio_t *rp);                                                       // 요청 헤더를 읽고 무시..?
+#define SBUFSIZE 64                                                                     // accept했지만 아직 worker가 받지 않은 연결 수 한도
+#define STATS_PATH "/__tiny/metrics"                                                    // 이 경로의 GET은 파일 대신 캐쉬 통계를 Prometheus text 형식으로 답함
+#define CONN_KEEP "Connection: keep-alive\r\n\r\n"                                    // 응답 헤더의 마지막 줄
+#define CONN_CLOSE "Connection: close\r\n\r\n"
+
+void serve_conn(int fd);                                                                // 연결 하나의 요청들을 차례로 처리
+int doit(int fd, rio_t *rp, int last);                                                  // 한 개의 HTTP 트랜잭션을 처리, 연결을 유지하면 1
+int read_requesthdrs(rio_t *rp, int *keep, long *body_len, char *range, char *if_range); // 요청 헤더를 읽고 필요한 것만 봄
+void header_value(char *buf, char *value);                                              // 헤더 줄의 값 부분을 앞뒤 공백 없이 복사
 int parse_uri(char *uri, char *filename, char *cgiargs);                                // HTML uri를 분석
-void serve_static(int fd, char *filename, int filesize, char *method);                  // 정적 콘텐츠를 클라이언트에게 제공
+int serve_static(int fd, fentry *e, char *method, int keep, char *range, char *if_range);  // 정적 콘텐츠를 클라이언트에게 제공, 다 보내지 못하면 -1
+int parse_range(char *range, off_t size, off_t *first, off_t *last);                    // Range 헤더 값에서 보낼 구간을 구함
+void static_header(fentry *e);                                                          // 정적 콘텐츠의 응답 헤더를 만들어 e에 둠
+void serve_stats(int fd, int keep);                                                     // 캐쉬 통계를 보냄
+int send_more(int fd, char *buf, size_t n);                                             // 뒤에 더 보낼 것이 있다고 알리며 buf를 전부 보냄
+int send_file(int fd, int srcfd, off_t offset, off_t count);                            // 파일 내용을 사용자 버퍼를 거치지 않고 보냄
 void get_filetype(char *filename, char *filetype);                                      // 파일명으로부터 파일타입을 알아냄
 void serve_dynamic(int fd, char *filename, char *cgiargs, char *method);                // 동적 콘텐츠를 클라이언트에게 제공
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);     // 에러 메세지를 클라이언트에 보냄
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, int keep); // 에러 메세지를 클라이언트에 보냄
 void echo(int connfd);                                                                  // 텍스트 줄을 echo해줌
+void *worker(void *vargp);                                                              // 연결을 하나씩 받아서 처리하는 쓰레드
+
+sbuf_t sbuf;                                                                            // main이 accept한 연결 식별자를 worker에게 넘기는 버퍼
+int max_requests;                                                                       // 연결 하나에서 처리할 요청 수 한도
+int idle_timeout = 5;                                                                   // 다음 요청을 기다리는 시간 (초)
+long cgi_forks;                                                                         // fork로 처리한 동적 요청 수
 
 int main(int argc, char **argv) {
-    int listenfd, connfd;
+    int listenfd, connfd, opt, i, nthreads = 0, cgi_workers = 0;
+    long cache_mb = 16;
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    pthread_t tid;
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "t:m:r:k:c:")) != -1) {
+        switch (opt) {
+        case 't': nthreads = atoi(optarg); break;                  // 0이면 원래처럼 한 번에 한 연결만 처리
+        case 'm': cache_mb = atol(optarg); break;                  // 응답을 통째로 메모리에 둘 크기 (MB), 0이면 두지 않음
+        case 'r': max_requests = atoi(optarg); break;
+        case 'k': idle_timeout = atoi(optarg); break;
+        case 'c': cgi_workers = atoi(optarg); break;               // CGI 프로그램마다 띄워 둘 worker 프로세스 수, 0이면 요청마다 fork
+        default:
+            fprintf(stderr, "usage: %s [-t <threads>] [-m <cache MB>] [-r <requests per connection>] [-k <idle secs>] [-c <CGI workers>] <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1 || nthreads < 0 || cache_mb < 0 || max_requests < 0 || idle_timeout < 1 || cgi_workers < 0) {
+        fprintf(stderr, "usage: %s [-t <threads>] [-m <cache MB>] [-r <requests per connection>] [-k <idle secs>] [-c <CGI workers>] <port>\n", argv[0]);
         exit(1);
     }
+    if (max_requests == 0)                                          // 한 번에 한 연결만 처리하면 keep-alive client가 다른 client를 막으므로 기본은 1
+        max_requests = nthreads > 0 ? 100 : 1;
+    Signal(SIGPIPE, SIG_IGN);                                       // 끊긴 client에 쓰면 서버 전체가 죽지 않고 EPIPE
+    fcache_init(cache_mb << 20);
+    cgipool_init(cgi_workers);
 
-    listenfd = Open_listenfd(argv[1]);                              // 지정한 포트 번호로 듣기 식별자 생성
+    listenfd = Open_listenfd(argv[optind]);                         // 지정한 포트 번호로 듣기 식별자 생성
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC);                           // CGI 프로그램에는 물려주지 않음
+    if (nthreads > 0) {
+        sbuf_init(&sbuf, SBUFSIZE);
+        for (i = 0; i < nthreads; i++)                              // worker 쓰레드를 미리 만들어 둠
+            Pthread_create(&tid, NULL, worker, NULL);
+    }
     while (1) {
         clientlen = sizeof(clientaddr);
         connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);   // line:netp:tiny:accept
-        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
+        fcntl(connfd, F_SETFD, FD_CLOEXEC);                         // 다른 연결의 CGI 프로그램이 이 연결을 붙잡고 있지 않도록
+        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV);  // 이름 조회(DNS)는 하지 않음
         printf("Accepted connection from (%s, %s)\n", hostname, port);
-        doit(connfd);   // line:netp:tiny:doit
+        if (nthreads > 0) {
+            sbuf_insert(&sbuf, connfd);                             // worker가 다 바쁘면 버퍼에서 기다림
+            continue;
+        }
+        serve_conn(connfd);   // line:netp:tiny:doit
         // echo(connfd);   //echo
         Close(connfd);  // line:netp:tiny:close
     }
 }
 
+/** 연결을 하나씩 받아서 처리하는 쓰레드 */
+void *worker(void *vargp) {
+    int connfd;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        connfd = sbuf_remove(&sbuf);
+        serve_conn(connfd);
+        Close(connfd);
+    }
+    return NULL;
+}
+
 /** 텍스트 줄을 echo해줌 */
 void echo(int connfd) {
     size_t n;
@@ -54,77 +128,154 @@ void echo(int connfd) {
     }
 }
 
+/** 연결 하나의 요청들을 차례로 처리 */
+// 응답을 보내는 동안 client가 미리 보낸(pipelined) 요청은 rio 버퍼와 소켓에 남아 있다가 다음 doit이 읽음
+void serve_conn(int fd) {
+    struct timeval tv = { idle_timeout, 0 };
+    int n = 0, one = 1;
+    rio_t rio;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));      // 다음 요청을 idle_timeout초 넘게 기다리지 않음
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));      // 응답을 받아 가지 않는 client에 묶여 있지 않음
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));   // 유지되는 연결에서 응답 끝부분이 delayed ACK를 기다리지 않게
+    Rio_readinitb(&rio, fd);
+    while (doit(fd, &rio, ++n >= max_requests))
+        ;
+}
+
 /** 한 개의 HTTP 트랜잭션을 처리 */
-void doit(int fd) {
-    int is_static;
+// last: 이 연결의 마지막 요청이면 1, 반환값: 연결을 유지하면 1
+int doit(int fd, rio_t *rp, int last) {
+    int is_static, keep, rc;
+    long body_len;
     struct stat sbuf;
+    fentry *e;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
+    char filename[MAXLINE], cgiargs[MAXLINE], range[MAXLINE], if_range[MAXLINE], *ptr;
 
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)                                       // 닫히거나 끊긴 연결, 또는 idle timeout
+        return 0;
     printf("Request headers:\n");
     printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3) {
+        clienterror(fd, buf, "400", "Bad request", "Tiny couldn't parse the request line", 0);
+        return 0;
+    }
     if (strcasecmp(method, "GET") && strcasecmp(method, "HEAD")) {                // GET과 HEAD method만 처리
-        clienterror(fd, method, "501", "Not implemented", "Tiny does not implement this method");
-        return;
+        clienterror(fd, method, "501", "Not implemented", "Tiny does not implement this method", 0);
+        return 0;                                                                   // 본문이 어디서 끝나는지 보지 않았으므로 연결을 닫음
     }
 
-    read_requesthdrs(&rio);
+    keep = !strcasecmp(version, "HTTP/1.1");                                        // HTTP/1.1은 기본이 keep-alive, 1.0은 요청해야 함
+    if (read_requesthdrs(rp, &keep, &body_len, range, if_range) < 0)
+        return 0;
+    for (; body_len > 0; body_len -= MAXLINE)                                       // GET에 딸려 온 본문은 버림
+        if (rio_readnb(rp, buf, body_len < MAXLINE ? body_len : MAXLINE) <= 0)
+            return 0;
+    if (last)
+        keep = 0;
 
+    if (!strncasecmp(uri, "http://", 7)) {                                          // absolute-form이면 경로만 남김
+        ptr = strchr(uri + 7, '/');
+        memmove(uri, ptr ? ptr : "/", strlen(ptr ? ptr : "/") + 1);
+    }
+    if (!strcasecmp(method, "GET") && !strcmp(uri, STATS_PATH)) {                   // tiny 자신의 통계 요청
+        serve_stats(fd, keep);
+        return keep;
+    }
     is_static = parse_uri(uri, filename, cgiargs);
+    if (is_static && (e = fcache_lookup(filename)) != NULL) {                       // 열린 파일 캐쉬: stat, open 없이 바로 보냄
+        rc = serve_static(fd, e, method, keep, range, if_range);
+        fcache_release(e);
+        return rc < 0 ? 0 : keep;                                                   // 응답을 다 보내지 못했으면 이어 쓸 수 없으므로 닫음
+    }
     if (stat(filename, &sbuf) < 0) {
-        clienterror(fd, filename, "404", "Not found", "Tiny couldn't find this file");
-        return;
+        clienterror(fd, filename, "404", "Not found", "Tiny couldn't find this file", keep);
+        return keep;
     }
 
     if (is_static) {
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {        // 읽기 권한 확인
-            clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't read the file");
-            return;
+            clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't read the file", keep);
+            return keep;
+        }
+        if ((e = fcache_open(filename)) == NULL) {                                  // stat 뒤에 지워졌거나 권한이 바뀜
+            clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't read the file", keep);
+            return keep;
         }
-        serve_static(fd, filename, sbuf.st_size, method);                           // 정적 콘텐츠 제공
+        get_filetype(filename, e->filetype);
+        static_header(e);
+        fcache_insert(e);                                                           // 다음 요청부터는 캐쉬에서
+        rc = serve_static(fd, e, method, keep, range, if_range);                    // 정적 콘텐츠 제공
+        fcache_release(e);
+        return rc < 0 ? 0 : keep;
     }
     else {
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {        // 실행 권한 확인
-            clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't run the CGI program");
-            return;
+            clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't run the CGI program", keep);
+            return keep;
         }
         serve_dynamic(fd, filename, cgiargs, method);                               // 동적 콘텐츠 제공
+        return 0;                                                                   // CGI 프로그램이 Connection: close를 보냄
     }
 }
 
 /** 에러 메세지를 클라이언트에 보냄 */
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, int keep) {
     char buf[MAXLINE], body[MAXBUF];
+    struct iovec iov[2];
 
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
+    snprintf(body, sizeof(body), "<html><title>Tiny Error</title><body bgcolor=""ffffff"">\r\n"
+             "%s: %s\r\n<p>%s: %s\r\n<hr><em>The Tiny Web server</em>\r\n", errnum, shortmsg, longmsg, cause);
 
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    // 헤더와 본문을 writev 한 번으로 (유지되는 연결에서 조각난 쓰기는 다음 요청을 늦춤)
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %s %s\r\nContent-type: text/html\r\nContent-length: %d\r\n%s",
+             errnum, shortmsg, (int)strlen(body), keep ? CONN_KEEP : CONN_CLOSE);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = strlen(buf);
+    iov[1].iov_base = body;
+    iov[1].iov_len = strlen(body);
+    rio_writev(fd, iov, 2);
 }
 
-/** 요청 헤더를 읽고 무시 */
-void read_requesthdrs(rio_t *rp) {
+/** 요청 헤더를 읽고 필요한 것만 봄 */
+// 연결 유지 여부, 본문 길이, Range와 If-Range 값 (없으면 빈 문자열)
+// 헤더 끝 전에 연결이 닫히면 -1 (전에는 EOF에서 같은 buf로 계속 돌았음)
+int read_requesthdrs(rio_t *rp, int *keep, long *body_len, char *range, char *if_range) {
     char buf[MAXLINE];
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    while (strcmp(buf, "\r\n")) {
-        Rio_readlineb(rp, buf, MAXLINE);
+    *body_len = 0;
+    range[0] = if_range[0] = '\0';
+    while (1) {
+        if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+            return -1;
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+            return 0;
         printf("%s", buf);
+        if (!strncasecmp(buf, "Connection:", 11)) {
+            if (strstr(buf + 11, "close") || strstr(buf + 11, "Close"))
+                *keep = 0;
+            else if (strstr(buf + 11, "keep-alive") || strstr(buf + 11, "Keep-Alive"))
+                *keep = 1;
+        }
+        else if (!strncasecmp(buf, "Content-length:", 15))
+            *body_len = atol(buf + 15);
+        else if (!strncasecmp(buf, "Range:", 6))
+            header_value(buf + 6, range);
+        else if (!strncasecmp(buf, "If-Range:", 9))
+            header_value(buf + 9, if_range);
     }
-    return;
+}
+
+/** 헤더 줄의 값 부분을 앞뒤 공백 없이 복사 */
+void header_value(char *buf, char *value) {
+    char *end;
+
+    while (*buf == ' ' || *buf == '\t') buf++;
+    end = buf + strlen(buf);
+    while (end > buf && isspace((unsigned char)end[-1])) end--;
+    memcpy(value, buf, end - buf);
+    value[end - buf] = '\0';
 }
 
 /** HTML uri를 분석 */
@@ -157,30 +308,202 @@ int parse_uri(char *uri, char *filename, char *cgiargs) {
 }
 
 /** 정적 콘텐츠를 클라이언트에게 제공 */
-void serve_static(int fd, char *filename, int filesize, char *method) {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
-
-    get_filetype(filename, filetype);
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));
+// 헤더는 미리 만든 e->hdr 뒤에 연결 유지 여부 줄만 붙임
+// 작은 파일은 본문이 메모리에 있으므로 헤더, Connection 줄, 본문을 writev 한 번으로 보냄
+// 나머지는 캐쉬가 열어 둔 e->fd에서 보냄 (sendfile은 offset을 따로 받으므로 여러 쓰레드가 같은 fd로 보내도 됨)
+// Range가 있으면 그 구간만 206으로 (If-Range가 있으면 파일이 그 ETag나 Last-modified 그대로일 때만)
+int serve_static(int fd, fentry *e, char *method, int keep, char *range, char *if_range) {
+    char *conn = keep ? CONN_KEEP : CONN_CLOSE, buf[MAXBUF];
+    struct iovec iov[3];
+    off_t first, last;
+    int rc = 0;
+
+    if (range[0] && (!if_range[0] || !strcmp(if_range, e->etag) || !strcmp(if_range, e->last_modified)))
+        rc = parse_range(range, e->size, &first, &last);
+    if (rc < 0) {                                                   // 파일 밖의 구간
+        snprintf(buf, sizeof(buf), "HTTP/1.1 416 Range Not Satisfiable\r\nServer: Tiny Web Server\r\n"
+                 "Content-range: bytes */%lld\r\nContent-length: 0\r\n%s", (long long)e->size, conn);
+        printf("Response headers:\n%s", buf);
+        return rio_writen(fd, buf, strlen(buf)) < 0 ? -1 : 0;
+    }
+    if (rc > 0) {                                                   // 206: 헤더는 구간마다 다르므로 여기서 만듦
+        snprintf(buf, sizeof(buf), "HTTP/1.1 206 Partial Content\r\nServer: Tiny Web Server\r\n"
+                 "Content-length: %lld\r\nContent-range: bytes %lld-%lld/%lld\r\nContent-type: %s\r\n"
+                 "Accept-ranges: bytes\r\nLast-modified: %s\r\nETag: %s\r\n%s",
+                 (long long)(last - first + 1), (long long)first, (long long)last, (long long)e->size,
+                 e->filetype, e->last_modified, e->etag, conn);
+        printf("Response headers:\n%s", buf);
+        if (strcasecmp(method, "HEAD") == 0)
+            return rio_writen(fd, buf, strlen(buf)) < 0 ? -1 : 0;
+        if (e->body != NULL) {
+            iov[0].iov_base = buf;
+            iov[0].iov_len = strlen(buf);
+            iov[1].iov_base = e->body + first;
+            iov[1].iov_len = last - first + 1;
+            return rio_writev(fd, iov, 2) < 0 ? -1 : 0;
+        }
+        if (send_more(fd, buf, strlen(buf)) < 0)
+            return -1;
+        return send_file(fd, e->fd, first, last - first + 1);      // 구간의 시작 offset부터 sendfile
+    }
+
     printf("Response headers:\n");
-    printf("%s", buf);
+    printf("%s%s", e->hdr, conn);
 
-    if (strcasecmp(method, "HEAD") == 0) return;                    // HEAD method는 본문을 출력하지 않음
+    iov[0].iov_base = e->hdr;
+    iov[0].iov_len = e->hdr_len;
+    iov[1].iov_base = conn;
+    iov[1].iov_len = strlen(conn);
+    if (strcasecmp(method, "HEAD") == 0 || e->size == 0)            // HEAD method는 본문을 출력하지 않음
+        return rio_writev(fd, iov, 2) < 0 ? -1 : 0;
+    if (e->body != NULL) {
+        iov[2].iov_base = e->body;
+        iov[2].iov_len = e->size;
+        return rio_writev(fd, iov, 3) < 0 ? -1 : 0;
+    }
 
-    srcfd = Open(filename, O_RDONLY, 0);                            // 대상 콘텐츠를 읽기 전용으로 열기
-    // srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);     // PROT_READ: 읽기 가능한 페이지, MAP_PRIVATE: 다른 프로세스와 공유하지 않음
-    srcp = (char *)malloc(filesize);
-    Rio_readn(srcfd, srcp, filesize);
-    Close(srcfd);
-    Rio_writen(fd, srcp, filesize);
-    // Munmap(srcp, filesize);
-    free(srcp);
+    // 헤더는 MSG_MORE로 커널에 남겨 두었다가 본문 첫 부분과 같은 패킷으로 보냄
+    // 본문은 sendfile로 페이지 캐쉬에서 소켓으로 바로 복사하므로, 파일 크기와 상관없이 사용자 버퍼가 필요 없음
+    memcpy(buf, e->hdr, e->hdr_len);
+    strcpy(buf + e->hdr_len, conn);
+    if (send_more(fd, buf, e->hdr_len + strlen(conn)) < 0)
+        return -1;
+    return send_file(fd, e->fd, 0, e->size);                        // client가 끊었거나 보내는 중에 파일이 줄어들면 -1
+}
+
+/** 정적 콘텐츠의 응답 헤더를 만들어 e에 둠 */
+// 크기는 열린 파일의 fstat 값이므로 보내는 내용과 맞음
+// Connection 줄과 헤더 끝 빈 줄은 요청마다 serve_static이 붙임
+// ETag와 Last-modified는 If-Range 비교에도 씀
+void static_header(fentry *e) {
+    char buf[MAXBUF];
+    struct tm tm;
+
+    gmtime_r(&e->mtime, &tm);
+    strftime(e->last_modified, sizeof(e->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    snprintf(e->etag, sizeof(e->etag), "\"%llx-%lx\"", (long long)e->size, (long)e->mtime);
+
+    e->hdr_len = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nServer: Tiny Web Server\r\n"
+                          "Content-length: %lld\r\nContent-type: %s\r\nAccept-ranges: bytes\r\n"
+                          "Last-modified: %s\r\nETag: %s\r\n",
+                          (long long)e->size, e->filetype, e->last_modified, e->etag);
+    e->hdr = strdup(buf);
+}
+
+/** Range 헤더 값에서 보낼 구간을 구함 */
+// 1: [*first, *last] 구간, 0: 처리하지 않는 값 (전체를 200으로), -1: 파일 안에 없는 구간 (416)
+// 여러 구간(multipart/byteranges)은 처리하지 않고 전체를 보냄
+int parse_range(char *range, off_t size, off_t *first, off_t *last) {
+    long long a, b;
+    char *p = range + 6, end;
+
+    if (strncasecmp(range, "bytes=", 6) || strchr(p, ','))
+        return 0;
+    while (*p == ' ') p++;
+    if (*p == '-') {                                                // bytes=-n: 마지막 n 바이트
+        if (sscanf(p + 1, "%lld%c", &b, &end) != 1 || b < 0)
+            return 0;
+        if (b == 0 || size == 0)
+            return -1;
+        *first = b < size ? size - b : 0;
+        *last = size - 1;
+        return 1;
+    }
+    switch (sscanf(p, "%lld-%lld%c", &a, &b, &end)) {
+    case 1:                                                         // bytes=a-: a부터 끝까지
+        if (p[strlen(p) - 1] != '-')
+            return 0;
+        b = size - 1;
+        break;
+    case 2:                                                         // bytes=a-b
+        if (b < a)
+            return 0;
+        break;
+    default:
+        return 0;
+    }
+    if (a < 0)
+        return 0;
+    if (a >= size)
+        return -1;
+    *first = a;
+    *last = b < size ? b : size - 1;
+    return 1;
+}
+
+/** 캐쉬 통계를 보냄 */
+// 정적 요청 중 메모리의 본문으로 보낸 것, 열린 fd로 보낸 것, 캐쉬에 없던 것과 메모리에 둔 파일의 바이트 수
+void serve_stats(int fd, int keep) {
+    char body[MAXBUF], buf[MAXLINE];
+    fcache_stat st;
+    cgipool_stat cst;
+
+    fcache_stats(&st);
+    cgipool_stats(&cst);
+    snprintf(body, sizeof(body),
+             "# HELP tiny_static_requests_total Static requests, by where the response came from.\n"
+             "# TYPE tiny_static_requests_total counter\n"
+             "tiny_static_requests_total{from=\"memory\"} %ld\n"
+             "tiny_static_requests_total{from=\"fd\"} %ld\n"
+             "tiny_static_requests_total{from=\"miss\"} %ld\n"
+             "# HELP tiny_cache_hit_ratio Share of static requests answered from the cache.\n"
+             "# TYPE tiny_cache_hit_ratio gauge\n"
+             "tiny_cache_hit_ratio %.4f\n"
+             "# HELP tiny_cache_entries Files held open by the cache.\n"
+             "# TYPE tiny_cache_entries gauge\n"
+             "tiny_cache_entries %ld\n"
+             "# HELP tiny_cache_resident_bytes Bytes of files held in memory.\n"
+             "# TYPE tiny_cache_resident_bytes gauge\n"
+             "tiny_cache_resident_bytes %ld\n"
+             "# HELP tiny_cgi_requests_total Dynamic requests, by how the CGI program was run.\n"
+             "# TYPE tiny_cgi_requests_total counter\n"
+             "tiny_cgi_requests_total{via=\"worker\"} %ld\n"
+             "tiny_cgi_requests_total{via=\"fork\"} %ld\n"
+             "# HELP tiny_cgi_workers CGI worker processes running.\n"
+             "# TYPE tiny_cgi_workers gauge\n"
+             "tiny_cgi_workers %ld\n"
+             "# HELP tiny_cgi_worker_deaths_total CGI workers that exited, hung up or timed out, started again when next needed.\n"
+             "# TYPE tiny_cgi_worker_deaths_total counter\n"
+             "tiny_cgi_worker_deaths_total %ld\n",
+             st.mem_hits, st.hits - st.mem_hits, st.lookups - st.hits,
+             st.lookups ? (double)st.hits / st.lookups : 0.0, st.entries, st.resident,
+             cst.requests, __atomic_load_n(&cgi_forks, __ATOMIC_RELAXED), cst.workers, cst.died);
+    snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nServer: Tiny Web Server\r\n"
+             "Content-length: %d\r\nContent-type: text/plain; version=0.0.4\r\n%s",
+             (int)strlen(body), keep ? CONN_KEEP : CONN_CLOSE);
+    rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, body, strlen(body));
+}
+
+/** 뒤에 더 보낼 것이 있다고 알리며 buf를 전부 보냄 */
+// 다음 write나 sendfile이 올 때까지 커널이 보내지 않고 모아 둠 (TCP_CORK를 켜고 끄는 setsockopt 두 번이 필요 없음)
+int send_more(int fd, char *buf, size_t n) {
+    ssize_t nsent;
+
+    while (n > 0) {
+        if ((nsent = send(fd, buf, n, MSG_MORE)) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += nsent;
+        n -= nsent;
+    }
+    return 0;
+}
+
+/** 파일 내용을 사용자 버퍼를 거치지 않고 보냄 */
+// srcfd의 offset부터 count 바이트, sendfile은 한 번에 다 보내지 못할 수 있으므로 반복
+int send_file(int fd, int srcfd, off_t offset, off_t count) {
+    ssize_t nsent;
+
+    while (count > 0) {
+        if ((nsent = sendfile(fd, srcfd, &offset, count)) <= 0) {
+            if (nsent < 0 && errno == EINTR) continue;
+            return -1;                                              // 끊긴 client, 또는 보내는 중에 파일이 줄어듦
+        }
+        count -= nsent;
+    }
+    return 0;
 }
 
 /** 파일명으로부터 파일타입을 알아냄 */
@@ -207,18 +530,27 @@ void get_filetype(char *filename, char *filetype) {
 
 /** 동적 콘텐츠를 클라이언트에게 제공 */
 void serve_dynamic(int fd, char *filename, char *cgiargs, char *method) {
-    char buf[MAXLINE], *emptylist[] =  { NULL };
+    char buf[MAXLINE], *emptylist[] =  { NULL }, query[MAXLINE + 16], reqmethod[MAXLINE + 16];
+    char *vars[] = { query, reqmethod, NULL }, **envp;
+    pid_t pid;
 
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "HTTP/1.1 200 OK\r\n");
+    rio_writen(fd, buf, strlen(buf));
     sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, buf, strlen(buf));
 
-    if (Fork() == 0) {                          // 자식 프로세스 생성
-        setenv("QUERY_STRING", cgiargs, 1);     // 인자를 복사 (CGI 환경변수 - program argument)
-        setenv("REQUEST_METHOD", method, 1);    // 인자를 복사 (CGI 환경변수 - name of the HTTP method; GET, HEAD, POST, etc.)
-        Dup2(fd, STDOUT_FILENO);                // 자식의 표준 출력을 연결 파일 식별자로 재지정
-        Execve(filename, emptylist, environ);   // CGI program을 로드하고 실행
+    if (cgipool_run(filename, fd, cgiargs, method) == 0)   // 떠 있는 worker가 처리 (fork, execve 없음)
+        return;
+    __atomic_add_fetch(&cgi_forks, 1, __ATOMIC_RELAXED);   // worker로 돌 수 없는 프로그램이거나 -c가 없으면 원래대로
+    // 환경변수는 fork 전에 만들어 둠: 쓰레드가 여럿인 프로세스의 자식은 다른 쓰레드가 잡고 있던 malloc lock 등에 걸릴 수 있어 setenv를 부를 수 없음
+    snprintf(query, sizeof(query), "QUERY_STRING=%s", cgiargs);         // CGI 환경변수 - program argument
+    snprintf(reqmethod, sizeof(reqmethod), "REQUEST_METHOD=%s", method); // CGI 환경변수 - name of the HTTP method; GET, HEAD, POST, etc.
+    envp = cgipool_envp(vars);
+    if ((pid = Fork()) == 0) {                  // 자식 프로세스 생성
+        dup2(fd, STDOUT_FILENO);                // 자식의 표준 출력을 연결 파일 식별자로 재지정
+        execve(filename, emptylist, envp);      // CGI program을 로드하고 실행
+        _exit(127);                             // 자식에서는 stdio 버퍼를 비우는 exit()도 부르지 않음
     }
-    Wait(NULL);                                 // 부모 프로세스는 자식 프로세스의 종료를 기다림
+    free(envp);
+    Waitpid(pid, NULL, 0);                      // 부모는 자기 자식만 기다림 (Wait(NULL)은 다른 쓰레드의 자식을 거둘 수 있음)
 }
\ No newline at end of file